@@ -0,0 +1,1420 @@
+/*
+ * fakex - minimal X server stand-in for xcalib integration benchmarks
+ *
+ * This program is GPL-ed postcardware! please see README
+ *
+ * It is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA.
+ */
+
+/*
+ * fakex listens on the local socket of an X display and speaks just
+ * enough of the X11 protocol for the unmodified xcalib binary - with
+ * the real Xlib, libXrandr and libXxf86vm - to run against it:
+ *
+ * - connection setup with one screen
+ * - core QueryExtension, ListExtensions, InternAtom, GetAtomName,
+ *   GetProperty and GetInputFocus (XSync)
+ * - BIG-REQUESTS for gamma ramps above 256 KB
+ * - RandR QueryVersion, SelectInput, GetScreenResources(Current),
+ *   GetOutputInfo, GetCrtcInfo, GetOutputPrimary, the CRTC gamma
+ *   requests and output properties, of which only a CTM (-ctm) is
+ *   listed and kept
+ * - XF86VidMode QueryVersion, gamma and gamma ramp requests
+ *
+ * Number of outputs, gamma sizes, RandR version and a latency added
+ * to each round trip are configurable, and SetCrtcGamma can be made
+ * to fail with BadMatch. Requests, round trips and bytes are counted
+ * per client, so a benchmark sees how xcalib talks to the server and
+ * not only how long it takes. Everything else is answered with
+ * BadRequest, which makes Xlib abort the client loudly.
+ *
+ * With -hotplug fakex soaks a resident client like "xcalib -watch":
+ * once the client selected RandR events, outputs are connected,
+ * disconnected and given new gamma sizes at a fixed rate, each change
+ * resetting the CRTC to an identity ramp and sending the RandR events.
+ * The time until the client uploads again is measured per change;
+ * uploads are compared with the first upload of the same gamma size.
+ * At the end latency percentiles, changes never followed by an upload,
+ * wrong ramps and the memory growth of the client are reported and
+ * fakex exits, with status 1 if any check failed.
+ *
+ * Only clients of the same byte order are accepted.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <X11/X.h>
+#include <X11/Xproto.h>
+#include <X11/Xatom.h>
+#include <X11/extensions/bigreqsproto.h>
+#include <X11/extensions/randrproto.h>
+#include <X11/extensions/xf86vm.h>
+#include <X11/extensions/xf86vmproto.h>
+
+#define MAX_CLIENTS   64
+#define MAX_OUTPUTS   32
+#define MAX_ATOMS     256
+#define STORM_SIZES   8
+#define STORM_SETTLE  2000000   /* microseconds to wait for the last uploads */
+
+/* fixed resource ids of the single screen */
+#define ROOT_WINDOW   0x000000fe
+#define ROOT_COLORMAP 0x000000fd
+#define ROOT_VISUAL   0x000000fc
+#define OUTPUT_BASE   0x00000100
+#define CRTC_BASE     0x00000200
+#define MODE_ID       0x00000300
+
+/* extensions and the numbers they are given */
+#define RANDR_OPCODE      140
+#define RANDR_EVENT       89
+#define RANDR_ERROR       147
+#define VIDMODE_OPCODE    141
+#define VIDMODE_ERROR     154
+#define BIGREQ_OPCODE     142
+#define BIGREQ_MAX_LENGTH (16 * 1024 * 1024)
+
+/* one output; connected outputs have a CRTC with a gamma ramp */
+struct output_t {
+  int connected;
+  unsigned int gamma_size;
+  CARD16 * gamma;           /* red, then green, then blue */
+  unsigned long long pending; /* first unanswered -hotplug change, 0 if none */
+  CARD32 ctm[18];           /* -ctm: S31.32 sign-magnitude, low word first */
+};
+
+/* one client connection */
+struct client_t {
+  int fd;
+  int setup_done;
+  int big_requests;
+  CARD16 sequence;
+  unsigned char * in;
+  size_t in_len, in_size;
+  CARD32 randr_mask;        /* RRSelectInput on the root window */
+  pid_t pid;
+  /* statistics */
+  unsigned long requests, replies, errors, events;
+  unsigned long long bytes_in, bytes_out;
+  unsigned long long started;
+};
+
+struct server_t {
+  int randr_major, randr_minor;
+  int vidmode;
+  int num_outputs;
+  struct output_t output[MAX_OUTPUTS];
+  unsigned int vidmode_size;
+  CARD16 * vidmode_gamma;
+  unsigned int latency_us;
+  int fail_gamma;
+  CARD32 ctm;               /* -ctm: the atom of the output property */
+  int verbose;
+  CARD32 config_time;
+  char * atoms[MAX_ATOMS];
+  int num_atoms;
+  struct client_t * clients[MAX_CLIENTS];
+  /* -hotplug */
+  unsigned int storm_events, storm_sent, storm_rate;
+  unsigned int storm_seed;
+  unsigned long long storm_next, storm_last;
+  pid_t storm_pid;
+  long storm_rss;
+  unsigned int reference_size[STORM_SIZES];
+  CARD16 * reference[STORM_SIZES];
+  unsigned long long * latency;
+  unsigned int num_latency;
+  unsigned long uploads, mismatches;
+  int storm_failed;
+  /* totals over all clients */
+  unsigned long total_clients, total_requests, total_replies, total_errors;
+} server;
+
+static volatile sig_atomic_t quit = 0;
+
+void
+on_signal(int sig)
+{
+  (void) sig;
+  quit = 1;
+}
+
+/*
+ * FUNCTION now_us
+ *
+ * returns a monotonic time stamp in microseconds
+ */
+unsigned long long
+now_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/*
+ * FUNCTION pad4
+ *
+ * returns n rounded up to a multiple of 4
+ */
+size_t
+pad4(size_t n)
+{
+  return (n + 3) & ~(size_t)3;
+}
+
+/*
+ * FUNCTION send_all
+ *
+ * write a buffer completely to a client
+ *
+ * returns 0 if the client went away
+ */
+int
+send_all(struct client_t * c, const void * data, size_t len)
+{
+  const unsigned char * p = (const unsigned char *) data;
+  ssize_t n;
+
+  while(len > 0)
+  {
+    n = write(c->fd, p, len);
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n <= 0)
+      return 0;
+    p += n;
+    len -= n;
+    c->bytes_out += n;
+  }
+  return 1;
+}
+
+/*
+ * FUNCTION send_reply
+ *
+ * send a reply of at least 32 bytes whose header was filled by the
+ * caller except for type, sequence number and length, followed by
+ * extra bytes padded to 4. Round trips are delayed by the configured
+ * latency.
+ *
+ * returns 0 if the client went away
+ */
+int
+send_reply(struct client_t * c, void * reply, size_t size,
+           const void * extra, size_t extra_len)
+{
+  xGenericReply * rep = (xGenericReply *) reply;
+  static const unsigned char zero[4] = { 0 };
+
+  if(server.latency_us)
+    usleep(server.latency_us);
+
+  rep->type = X_Reply;
+  rep->sequenceNumber = c->sequence;
+  rep->length = (size - 32 + pad4(extra_len)) / 4;
+  c->replies++;
+  return send_all(c, reply, size) &&
+         (!extra_len || send_all(c, extra, extra_len)) &&
+         send_all(c, zero, pad4(extra_len) - extra_len);
+}
+
+/*
+ * FUNCTION send_error
+ *
+ * returns 0 if the client went away
+ */
+int
+send_error(struct client_t * c, int code, CARD32 resource, int major, int minor)
+{
+  xError err;
+
+  memset(&err, 0, sizeof(err));
+  err.type = X_Error;
+  err.errorCode = code;
+  err.sequenceNumber = c->sequence;
+  err.resourceID = resource;
+  err.majorCode = major;
+  err.minorCode = minor;
+  c->errors++;
+  if(server.verbose)
+    fprintf(stderr, "fakex: client %d: error %d for request %d.%d\n",
+            c->fd, code, major, minor);
+  return send_all(c, &err, sizeof(err));
+}
+
+/*
+ * FUNCTION identity_ramp
+ *
+ * fill the three channels of a gamma ramp with a gamma of 1.0
+ */
+void
+identity_ramp(CARD16 * ramp, unsigned int size)
+{
+  unsigned int i;
+
+  for(i=0; i<size; i++)
+    ramp[i] = ramp[i + size] = ramp[i + 2*size] =
+      size > 1 ? (CARD16)((unsigned long)i * 65535 / (size - 1)) : 0;
+}
+
+/*
+ * FUNCTION intern_atom
+ *
+ * returns the atom of a name, creating it unless onlyIfExists;
+ * predefined atoms are not known by name, which is sufficient here
+ */
+Atom
+intern_atom(const char * name, size_t len, int onlyIfExists)
+{
+  int i;
+
+  for(i=0; i<server.num_atoms; i++)
+    if(strlen(server.atoms[i]) == len && !memcmp(server.atoms[i], name, len))
+      return XA_LAST_PREDEFINED + 1 + i;
+  if(onlyIfExists || server.num_atoms == MAX_ATOMS)
+    return None;
+  server.atoms[server.num_atoms] = (char *) malloc(len + 1);
+  memcpy(server.atoms[server.num_atoms], name, len);
+  server.atoms[server.num_atoms][len] = '\0';
+  return XA_LAST_PREDEFINED + 1 + server.num_atoms++;
+}
+
+/*
+ * FUNCTION send_setup
+ *
+ * answer the connection prefix with a successful setup describing one
+ * 24 bit TrueColor screen
+ *
+ * returns 0 if the client went away
+ */
+int
+send_setup(struct client_t * c, int index)
+{
+  static const char vendor[] = "xcalib fakex";
+  unsigned char buffer[512];
+  xConnSetupPrefix * prefix = (xConnSetupPrefix *) buffer;
+  xConnSetup * setup;
+  xPixmapFormat * format;
+  xWindowRoot * root;
+  xDepth * depth;
+  xVisualType * visual;
+  size_t len = sizeof(xConnSetupPrefix);
+
+  memset(buffer, 0, sizeof(buffer));
+  setup = (xConnSetup *) (buffer + len);
+  setup->release = 1;
+  setup->ridBase = (CARD32)(index + 1) << 21;
+  setup->ridMask = 0x1fffff;
+  setup->nbytesVendor = sizeof(vendor) - 1;
+  setup->maxRequestSize = 65535;
+  setup->numRoots = 1;
+  setup->numFormats = 2;
+  setup->imageByteOrder = LSBFirst;
+  setup->bitmapBitOrder = LSBFirst;
+  setup->bitmapScanlineUnit = 32;
+  setup->bitmapScanlinePad = 32;
+  setup->minKeyCode = 8;
+  setup->maxKeyCode = 255;
+  len += sizeof(xConnSetup);
+  memcpy(buffer + len, vendor, sizeof(vendor) - 1);
+  len += pad4(sizeof(vendor) - 1);
+
+  format = (xPixmapFormat *) (buffer + len);
+  format[0].depth = 1;
+  format[0].bitsPerPixel = 1;
+  format[0].scanLinePad = 32;
+  format[1].depth = 24;
+  format[1].bitsPerPixel = 32;
+  format[1].scanLinePad = 32;
+  len += 2 * sizeof(xPixmapFormat);
+
+  root = (xWindowRoot *) (buffer + len);
+  root->windowId = ROOT_WINDOW;
+  root->defaultColormap = ROOT_COLORMAP;
+  root->whitePixel = 0xffffff;
+  root->blackPixel = 0;
+  root->pixWidth = 1920;
+  root->pixHeight = 1080;
+  root->mmWidth = 508;
+  root->mmHeight = 286;
+  root->minInstalledMaps = 1;
+  root->maxInstalledMaps = 1;
+  root->rootVisualID = ROOT_VISUAL;
+  root->backingStore = NotUseful;
+  root->rootDepth = 24;
+  root->nDepths = 1;
+  len += sizeof(xWindowRoot);
+
+  depth = (xDepth *) (buffer + len);
+  depth->depth = 24;
+  depth->nVisuals = 1;
+  len += sizeof(xDepth);
+  visual = (xVisualType *) (buffer + len);
+  visual->visualID = ROOT_VISUAL;
+  visual->class = TrueColor;
+  visual->bitsPerRGB = 8;
+  visual->colormapEntries = 256;
+  visual->redMask = 0xff0000;
+  visual->greenMask = 0x00ff00;
+  visual->blueMask = 0x0000ff;
+  len += sizeof(xVisualType);
+
+  prefix->success = xTrue;
+  prefix->majorVersion = X_PROTOCOL;
+  prefix->minorVersion = X_PROTOCOL_REVISION;
+  prefix->length = (len - sizeof(xConnSetupPrefix)) / 4;
+  return send_all(c, buffer, len);
+}
+
+/*
+ * FUNCTION find_crtc
+ *
+ * returns the output driving a CRTC or NULL if there is no such CRTC
+ */
+struct output_t *
+find_crtc(CARD32 crtc)
+{
+  unsigned int i = crtc - CRTC_BASE;
+
+  if(crtc < CRTC_BASE || i >= (unsigned int)server.num_outputs ||
+     !server.output[i].connected)
+    return NULL;
+  return &server.output[i];
+}
+
+/*
+ * FUNCTION randr_screen_resources
+ *
+ * returns 0 if the client went away
+ */
+int
+randr_screen_resources(struct client_t * c)
+{
+  xRRGetScreenResourcesReply rep;
+  static const char modeName[] = "1920x1080";
+  unsigned char * extra;
+  CARD32 * ids;
+  xRRModeInfo * mode;
+  int i, nCrtcs = 0, ok;
+  size_t len;
+
+  for(i=0; i<server.num_outputs; i++)
+    nCrtcs += server.output[i].connected;
+  len = 4 * (nCrtcs + server.num_outputs) + sizeof(xRRModeInfo) + sizeof(modeName) - 1;
+  extra = (unsigned char *) calloc(1, len);
+  ids = (CARD32 *) extra;
+  for(i=0; i<server.num_outputs; i++)
+    if(server.output[i].connected)
+      *ids++ = CRTC_BASE + i;
+  for(i=0; i<server.num_outputs; i++)
+    *ids++ = OUTPUT_BASE + i;
+  mode = (xRRModeInfo *) ids;
+  mode->id = MODE_ID;
+  mode->width = 1920;
+  mode->height = 1080;
+  mode->dotClock = 148500000;
+  mode->hSyncStart = 2008;
+  mode->hSyncEnd = 2052;
+  mode->hTotal = 2200;
+  mode->vSyncStart = 1084;
+  mode->vSyncEnd = 1089;
+  mode->vTotal = 1125;
+  mode->nameLength = sizeof(modeName) - 1;
+  memcpy(mode + 1, modeName, sizeof(modeName) - 1);
+
+  memset(&rep, 0, sizeof(rep));
+  rep.timestamp = server.config_time;
+  rep.configTimestamp = server.config_time;
+  rep.nCrtcs = nCrtcs;
+  rep.nOutputs = server.num_outputs;
+  rep.nModes = 1;
+  rep.nbytesNames = sizeof(modeName) - 1;
+  ok = send_reply(c, &rep, sizeof(rep), extra, len);
+  free(extra);
+  return ok;
+}
+
+/*
+ * FUNCTION randr_output_info
+ *
+ * returns 0 if the client went away
+ */
+int
+randr_output_info(struct client_t * c, CARD32 output, int minor)
+{
+  xRRGetOutputInfoReply rep;
+  unsigned char extra[64];
+  CARD32 * ids = (CARD32 *) extra;
+  unsigned int i = output - OUTPUT_BASE;
+  size_t len = 0;
+
+  if(output < OUTPUT_BASE || i >= (unsigned int)server.num_outputs)
+    return send_error(c, RANDR_ERROR + BadRROutput, output, RANDR_OPCODE, minor);
+
+  memset(&rep, 0, sizeof(rep));
+  rep.status = RRSetConfigSuccess;
+  rep.timestamp = server.config_time;
+  rep.connection = server.output[i].connected ? RR_Connected : RR_Disconnected;
+  if(server.output[i].connected)
+  {
+    rep.crtc = CRTC_BASE + i;
+    rep.mmWidth = 508;
+    rep.mmHeight = 286;
+    rep.nCrtcs = 1;
+    rep.nModes = 1;
+    rep.nPreferred = 1;
+    ids[0] = CRTC_BASE + i;
+    ids[1] = MODE_ID;
+    len = 8;
+  }
+  rep.nameLength = sprintf((char *) extra + len, "FAKE-%u", i);
+  return send_reply(c, &rep, sizeof(rep), extra, len + rep.nameLength);
+}
+
+/*
+ * FUNCTION randr_crtc_info
+ *
+ * returns 0 if the client went away
+ */
+int
+randr_crtc_info(struct client_t * c, CARD32 crtc, int minor)
+{
+  xRRGetCrtcInfoReply rep;
+  CARD32 outputs[2];
+  struct output_t * o;
+
+  if((o = find_crtc(crtc)) == NULL)
+    return send_error(c, RANDR_ERROR + BadRRCrtc, crtc, RANDR_OPCODE, minor);
+
+  memset(&rep, 0, sizeof(rep));
+  rep.status = RRSetConfigSuccess;
+  rep.timestamp = server.config_time;
+  rep.x = 1920 * (crtc - CRTC_BASE);
+  rep.width = 1920;
+  rep.height = 1080;
+  rep.mode = MODE_ID;
+  rep.rotation = RR_Rotate_0;
+  rep.rotations = RR_Rotate_0;
+  rep.nOutput = 1;
+  rep.nPossibleOutput = 1;
+  outputs[0] = outputs[1] = OUTPUT_BASE + (crtc - CRTC_BASE);
+  return send_reply(c, &rep, sizeof(rep), outputs, sizeof(outputs));
+}
+
+/*
+ * FUNCTION client_rss
+ *
+ * returns the resident set size of a process in kB, -1 if unknown
+ */
+long
+client_rss(pid_t pid)
+{
+  char path[64], line[256];
+  long rss = -1;
+  FILE * fp;
+
+  snprintf(path, sizeof(path), "/proc/%d/status", (int) pid);
+  if((fp = fopen(path, "r")) == NULL)
+    return -1;
+  while(fgets(line, sizeof(line), fp))
+    if(sscanf(line, "VmRSS: %ld", &rss) == 1)
+      break;
+  fclose(fp);
+  return rss;
+}
+
+/*
+ * FUNCTION storm_upload
+ *
+ * account a gamma upload to an output: the latency since the first
+ * change it answers, and whether the ramp equals the first upload of
+ * this gamma size
+ */
+void
+storm_upload(struct output_t * o)
+{
+  int k;
+
+  server.uploads++;
+  if(o->pending)
+  {
+    server.latency[server.num_latency++] = now_us() - o->pending;
+    o->pending = 0;
+  }
+  for(k=0; k<STORM_SIZES && server.reference_size[k]; k++)
+    if(server.reference_size[k] == o->gamma_size)
+    {
+      if(memcmp(server.reference[k], o->gamma, 6 * o->gamma_size))
+        server.mismatches++;
+      return;
+    }
+  if(k < STORM_SIZES)
+  {
+    server.reference_size[k] = o->gamma_size;
+    server.reference[k] = (CARD16 *) malloc(6 * o->gamma_size);
+    memcpy(server.reference[k], o->gamma, 6 * o->gamma_size);
+  }
+}
+
+/*
+ * FUNCTION storm_notify
+ *
+ * send the events of a change of an output to all clients which
+ * selected them
+ */
+void
+storm_notify(int index)
+{
+  struct output_t * o = &server.output[index];
+  struct client_t * c;
+  xRRScreenChangeNotifyEvent screen;
+  xRROutputChangeNotifyEvent output;
+  xRRCrtcChangeNotifyEvent crtc;
+  int i;
+
+  for(i=0; i<MAX_CLIENTS; i++)
+  {
+    if(!(c = server.clients[i]) || !c->randr_mask)
+      continue;
+    if(c->randr_mask & RRScreenChangeNotifyMask)
+    {
+      memset(&screen, 0, sizeof(screen));
+      screen.type = RANDR_EVENT + RRScreenChangeNotify;
+      screen.rotation = RR_Rotate_0;
+      screen.sequenceNumber = c->sequence;
+      screen.timestamp = screen.configTimestamp = server.config_time;
+      screen.root = screen.window = ROOT_WINDOW;
+      screen.widthInPixels = 1920;
+      screen.heightInPixels = 1080;
+      screen.widthInMillimeters = 508;
+      screen.heightInMillimeters = 286;
+      send_all(c, &screen, sizeof(screen));
+      c->events++;
+    }
+    if(c->randr_mask & RROutputChangeNotifyMask)
+    {
+      memset(&output, 0, sizeof(output));
+      output.type = RANDR_EVENT + RRNotify;
+      output.subCode = RRNotify_OutputChange;
+      output.sequenceNumber = c->sequence;
+      output.timestamp = output.configTimestamp = server.config_time;
+      output.window = ROOT_WINDOW;
+      output.output = OUTPUT_BASE + index;
+      output.crtc = o->connected ? CRTC_BASE + index : None;
+      output.mode = o->connected ? MODE_ID : None;
+      output.rotation = RR_Rotate_0;
+      output.connection = o->connected ? RR_Connected : RR_Disconnected;
+      send_all(c, &output, sizeof(output));
+      c->events++;
+    }
+    if(c->randr_mask & RRCrtcChangeNotifyMask && o->connected)
+    {
+      memset(&crtc, 0, sizeof(crtc));
+      crtc.type = RANDR_EVENT + RRNotify;
+      crtc.subCode = RRNotify_CrtcChange;
+      crtc.sequenceNumber = c->sequence;
+      crtc.timestamp = server.config_time;
+      crtc.window = ROOT_WINDOW;
+      crtc.crtc = CRTC_BASE + index;
+      crtc.mode = MODE_ID;
+      crtc.rotation = RR_Rotate_0;
+      crtc.x = 1920 * index;
+      crtc.width = 1920;
+      crtc.height = 1080;
+      send_all(c, &crtc, sizeof(crtc));
+      c->events++;
+    }
+  }
+}
+
+/*
+ * FUNCTION storm_step
+ *
+ * connect, disconnect or change the gamma size of a random output;
+ * the last connected output is never disconnected
+ */
+void
+storm_step(void)
+{
+  static const unsigned int sizes[] = { 256, 1024, 4096 };
+  int index = rand_r(&server.storm_seed) % server.num_outputs;
+  int action = rand_r(&server.storm_seed) % 3, i, connected = 0;
+  struct output_t * o = &server.output[index];
+
+  for(i=0; i<server.num_outputs; i++)
+    connected += server.output[i].connected;
+  if(server.storm_sent == 0)
+    server.storm_rss = client_rss(server.storm_pid);
+
+  if(action == 0 && !(o->connected && connected == 1))
+    o->connected = !o->connected;
+  else if(o->connected)
+  {
+    o->gamma_size = sizes[rand_r(&server.storm_seed) % 3];
+    o->gamma = (CARD16 *) realloc(o->gamma, 6 * o->gamma_size);
+  }
+  else
+    o->connected = 1;
+
+  if(o->connected)
+  {
+    identity_ramp(o->gamma, o->gamma_size);
+    if(!o->pending)
+      o->pending = now_us();
+  }
+  else
+    o->pending = 0;
+
+  server.config_time++;
+  storm_notify(index);
+  server.storm_sent++;
+  server.storm_last = now_us();
+  server.storm_next += 1000000ULL / server.storm_rate;
+}
+
+/*
+ * FUNCTION compare_ull
+ */
+int
+compare_ull(const void * a, const void * b)
+{
+  unsigned long long x = *(const unsigned long long *) a;
+  unsigned long long y = *(const unsigned long long *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+/*
+ * FUNCTION storm_report
+ *
+ * print the results of -hotplug and decide whether it passed
+ */
+void
+storm_report(void)
+{
+  unsigned long long * l = server.latency;
+  unsigned int n = server.num_latency, dropped = 0, correct = 0, connected = 0;
+  long rss = client_rss(server.storm_pid);
+  int i, k;
+
+  qsort(l, n, sizeof(*l), compare_ull);
+  for(i=0; i<server.num_outputs; i++)
+  {
+    if(!server.output[i].connected)
+      continue;
+    connected++;
+    dropped += server.output[i].pending != 0;
+    for(k=0; k<STORM_SIZES; k++)
+      if(server.reference_size[k] == server.output[i].gamma_size &&
+         !memcmp(server.reference[k], server.output[i].gamma, 6 * server.output[i].gamma_size))
+        correct++;
+  }
+
+  fprintf(stderr, "fakex: hotplug: %u changes, %lu uploads, %u answered changes\n",
+          server.storm_sent, server.uploads, n);
+  if(n)
+    fprintf(stderr, "fakex: hotplug: re-apply latency ms: min %.3f  p50 %.3f  p95 %.3f  p99 %.3f  max %.3f\n",
+            l[0] / 1000.0, l[n / 2] / 1000.0, l[n * 95 / 100] / 1000.0,
+            l[n * 99 / 100] / 1000.0, l[n - 1] / 1000.0);
+  fprintf(stderr, "fakex: hotplug: %u changes dropped, %lu wrong ramps, %u of %u CRTCs correct at the end\n",
+          dropped, server.mismatches, correct, connected);
+  fprintf(stderr, "fakex: hotplug: client RSS %ld kB -> %ld kB\n", server.storm_rss, rss);
+  server.storm_failed = dropped || server.mismatches || correct != connected || n == 0;
+}
+
+/*
+ * FUNCTION randr_request
+ *
+ * returns 0 if the client went away
+ */
+int
+randr_request(struct client_t * c, unsigned char * req, size_t len)
+{
+  int minor = req[1];
+  CARD32 * args = (CARD32 *) (req + 4);
+  struct output_t * o;
+
+  /* everything beyond QueryVersion needs the requested version */
+  if(minor >= X_RRGetScreenSizeRange &&
+     server.randr_major * 100 + server.randr_minor < 102)
+    return send_error(c, BadRequest, 0, RANDR_OPCODE, minor);
+
+  switch(minor)
+  {
+    case X_RRQueryVersion:
+    {
+      xRRQueryVersionReply rep;
+      memset(&rep, 0, sizeof(rep));
+      rep.majorVersion = server.randr_major;
+      rep.minorVersion = server.randr_minor;
+      return send_reply(c, &rep, sizeof(rep), NULL, 0);
+    }
+    case X_RRSelectInput:
+      if(len < sz_xRRSelectInputReq)
+        return send_error(c, BadLength, 0, RANDR_OPCODE, minor);
+      c->randr_mask = ((xRRSelectInputReq *) req)->enable;
+      if(server.storm_events && c->randr_mask && !server.storm_pid)
+      {
+        /* give the client time to finish its first uploads */
+        server.storm_pid = c->pid;
+        server.storm_next = now_us() + 200000;
+      }
+      return 1;
+    case X_RRGetScreenResources:
+    case X_RRGetScreenResourcesCurrent:
+      if(len < 8 || args[0] != ROOT_WINDOW)
+        return send_error(c, BadWindow, len < 8 ? 0 : args[0], RANDR_OPCODE, minor);
+      return randr_screen_resources(c);
+    case X_RRGetOutputInfo:
+      if(len < sz_xRRGetOutputInfoReq)
+        return send_error(c, BadLength, 0, RANDR_OPCODE, minor);
+      return randr_output_info(c, args[0], minor);
+    case X_RRGetCrtcInfo:
+      if(len < sz_xRRGetCrtcInfoReq)
+        return send_error(c, BadLength, 0, RANDR_OPCODE, minor);
+      return randr_crtc_info(c, args[0], minor);
+    case X_RRGetOutputPrimary:
+    {
+      xRRGetOutputPrimaryReply rep;
+      memset(&rep, 0, sizeof(rep));
+      rep.output = server.num_outputs ? OUTPUT_BASE : None;
+      return send_reply(c, &rep, sizeof(rep), NULL, 0);
+    }
+    case X_RRGetCrtcGammaSize:
+    {
+      xRRGetCrtcGammaSizeReply rep;
+      if(len < 8 || (o = find_crtc(args[0])) == NULL)
+        return send_error(c, RANDR_ERROR + BadRRCrtc, len < 8 ? 0 : args[0], RANDR_OPCODE, minor);
+      memset(&rep, 0, sizeof(rep));
+      rep.size = o->gamma_size;
+      return send_reply(c, &rep, sizeof(rep), NULL, 0);
+    }
+    case X_RRGetCrtcGamma:
+    {
+      xRRGetCrtcGammaReply rep;
+      if(len < 8 || (o = find_crtc(args[0])) == NULL)
+        return send_error(c, RANDR_ERROR + BadRRCrtc, len < 8 ? 0 : args[0], RANDR_OPCODE, minor);
+      memset(&rep, 0, sizeof(rep));
+      rep.size = o->gamma_size;
+      return send_reply(c, &rep, sizeof(rep), o->gamma, 6 * o->gamma_size);
+    }
+    case X_RRSetCrtcGamma:
+    {
+      xRRSetCrtcGammaReq * set = (xRRSetCrtcGammaReq *) req;
+      if(len < sz_xRRSetCrtcGammaReq || (o = find_crtc(set->crtc)) == NULL)
+        return send_error(c, RANDR_ERROR + BadRRCrtc, len < 12 ? 0 : set->crtc, RANDR_OPCODE, minor);
+      if(set->size != o->gamma_size || server.fail_gamma)
+        return send_error(c, BadMatch, set->crtc, RANDR_OPCODE, minor);
+      if(len < sz_xRRSetCrtcGammaReq + 6 * (size_t)o->gamma_size)
+        return send_error(c, BadLength, 0, RANDR_OPCODE, minor);
+      memcpy(o->gamma, req + sz_xRRSetCrtcGammaReq, 6 * o->gamma_size);
+      if(server.storm_events)
+        storm_upload(o);
+      return 1;
+    }
+    case X_RRListOutputProperties:
+    {
+      xRRListOutputPropertiesReply rep;
+      if(len < 8 || args[0] < OUTPUT_BASE || args[0] - OUTPUT_BASE >= (CARD32)server.num_outputs)
+        return send_error(c, RANDR_ERROR + BadRROutput, len < 8 ? 0 : args[0], RANDR_OPCODE, minor);
+      memset(&rep, 0, sizeof(rep));
+      rep.nAtoms = server.ctm != None;
+      return send_reply(c, &rep, sizeof(rep), &server.ctm, 4 * rep.nAtoms);
+    }
+    /* output properties are taken but not kept, like window properties,
+     * except for the -ctm matrix */
+    case X_RRChangeOutputProperty:
+    case X_RRDeleteOutputProperty:
+      if(len < 12 || args[0] < OUTPUT_BASE || args[0] - OUTPUT_BASE >= (CARD32)server.num_outputs)
+        return send_error(c, RANDR_ERROR + BadRROutput, len < 8 ? 0 : args[0], RANDR_OPCODE, minor);
+      if(minor == X_RRChangeOutputProperty && server.ctm != None && args[1] == server.ctm)
+      {
+        xRRChangeOutputPropertyReq * change = (xRRChangeOutputPropertyReq *) req;
+        o = &server.output[args[0] - OUTPUT_BASE];
+        if(change->format != 32 || change->nUnits != 18 || len < sz_xRRChangeOutputPropertyReq + 72)
+          return send_error(c, BadValue, args[0], RANDR_OPCODE, minor);
+        memcpy(o->ctm, req + sz_xRRChangeOutputPropertyReq, sizeof(o->ctm));
+        if(server.verbose)
+          fprintf(stderr, "fakex: output %d: CTM %08x%08x %08x%08x %08x%08x\n",
+                  (int)(args[0] - OUTPUT_BASE), o->ctm[1], o->ctm[0], o->ctm[9], o->ctm[8],
+                  o->ctm[17], o->ctm[16]);
+      }
+      return 1;
+  }
+  return send_error(c, BadRequest, 0, RANDR_OPCODE, minor);
+}
+
+/*
+ * FUNCTION vidmode_request
+ *
+ * returns 0 if the client went away
+ */
+int
+vidmode_request(struct client_t * c, unsigned char * req, size_t len)
+{
+  int minor = req[1];
+  CARD16 * args = (CARD16 *) (req + 4);
+  unsigned int i, size = server.vidmode_size;
+
+  /* all requests but QueryVersion name a screen */
+  if(minor != X_XF86VidModeQueryVersion && (len < 8 || args[0] != 0))
+    return send_error(c, BadValue, len < 8 ? 0 : args[0], VIDMODE_OPCODE, minor);
+
+  switch(minor)
+  {
+    case X_XF86VidModeQueryVersion:
+    {
+      xXF86VidModeQueryVersionReply rep;
+      memset(&rep, 0, sizeof(rep));
+      rep.majorVersion = 2;
+      rep.minorVersion = 2;
+      return send_reply(c, &rep, sizeof(rep), NULL, 0);
+    }
+    case X_XF86VidModeSetClientVersion:
+      return 1;
+    case X_XF86VidModeGetPermissions:
+    {
+      xXF86VidModeGetPermissionsReply rep;
+      memset(&rep, 0, sizeof(rep));
+      rep.permissions = XF86VM_READ_PERMISSION | XF86VM_WRITE_PERMISSION;
+      return send_reply(c, &rep, sizeof(rep), NULL, 0);
+    }
+    case X_XF86VidModeSetGamma:
+    {
+      xXF86VidModeSetGammaReq * set = (xXF86VidModeSetGammaReq *) req;
+      CARD32 gamma[3];
+      int ch;
+      if(len < sz_xXF86VidModeSetGammaReq)
+        return send_error(c, BadLength, 0, VIDMODE_OPCODE, minor);
+      gamma[0] = set->red;
+      gamma[1] = set->green;
+      gamma[2] = set->blue;
+      for(ch=0; ch<3; ch++)
+      {
+        if(gamma[ch] < 100 || gamma[ch] > 100000)
+          return send_error(c, BadValue, gamma[ch], VIDMODE_OPCODE, minor);
+        for(i=0; i<size; i++)
+          server.vidmode_gamma[ch*size + i] =
+            (CARD16)(pow((double)i / (size - 1), 10000.0 / gamma[ch]) * 65535.0 + 0.5);
+      }
+      return 1;
+    }
+    case X_XF86VidModeGetGamma:
+    {
+      xXF86VidModeGetGammaReply rep;
+      memset(&rep, 0, sizeof(rep));
+      /* approximated from the middle of the ramp */
+      rep.red = rep.green = rep.blue = 10000;
+      return send_reply(c, &rep, sizeof(rep), NULL, 0);
+    }
+    case X_XF86VidModeGetGammaRampSize:
+    {
+      xXF86VidModeGetGammaRampSizeReply rep;
+      memset(&rep, 0, sizeof(rep));
+      rep.size = size;
+      return send_reply(c, &rep, sizeof(rep), NULL, 0);
+    }
+    case X_XF86VidModeGetGammaRamp:
+    {
+      xXF86VidModeGetGammaRampReply rep;
+      if(args[1] != size)
+        return send_error(c, BadValue, args[1], VIDMODE_OPCODE, minor);
+      memset(&rep, 0, sizeof(rep));
+      rep.size = size;
+      return send_reply(c, &rep, sizeof(rep), server.vidmode_gamma, 6 * size);
+    }
+    case X_XF86VidModeSetGammaRamp:
+      if(args[1] != size)
+        return send_error(c, BadValue, args[1], VIDMODE_OPCODE, minor);
+      if(len < sz_xXF86VidModeSetGammaRampReq + 6 * (size_t)size)
+        return send_error(c, BadLength, 0, VIDMODE_OPCODE, minor);
+      memcpy(server.vidmode_gamma, req + sz_xXF86VidModeSetGammaRampReq, 6 * size);
+      return 1;
+  }
+  return send_error(c, BadRequest, 0, VIDMODE_OPCODE, minor);
+}
+
+/*
+ * FUNCTION core_request
+ *
+ * returns 0 if the client went away
+ */
+int
+core_request(struct client_t * c, unsigned char * req, size_t len)
+{
+  static const struct { const char * name; int major, event, error, enabled; } ext[] = {
+    { "RANDR", RANDR_OPCODE, RANDR_EVENT, RANDR_ERROR, 1 },
+    { "XFree86-VidModeExtension", VIDMODE_OPCODE, 0, VIDMODE_ERROR, 2 },
+    { "BIG-REQUESTS", BIGREQ_OPCODE, 0, 0, 3 }
+  };
+  int present[3];
+  unsigned int i;
+
+  present[0] = server.randr_major > 0;
+  present[1] = server.vidmode;
+  present[2] = 1;
+
+  switch(req[0])
+  {
+    case X_QueryExtension:
+    {
+      xQueryExtensionReply rep;
+      size_t n = ((xQueryExtensionReq *) req)->nbytes;
+      memset(&rep, 0, sizeof(rep));
+      for(i=0; i<3; i++)
+        if(present[i] && len >= 8 + n && strlen(ext[i].name) == n &&
+           !memcmp(req + 8, ext[i].name, n))
+        {
+          rep.present = xTrue;
+          rep.major_opcode = ext[i].major;
+          rep.first_event = ext[i].event;
+          rep.first_error = ext[i].error;
+        }
+      return send_reply(c, &rep, sizeof(rep), NULL, 0);
+    }
+    case X_ListExtensions:
+    {
+      xListExtensionsReply rep;
+      unsigned char names[64];
+      size_t n = 0;
+      memset(&rep, 0, sizeof(rep));
+      for(i=0; i<3; i++)
+        if(present[i])
+        {
+          names[n] = strlen(ext[i].name);
+          memcpy(names + n + 1, ext[i].name, names[n]);
+          n += names[n] + 1;
+          rep.nExtensions++;
+        }
+      return send_reply(c, &rep, sizeof(rep), names, n);
+    }
+    case X_InternAtom:
+    {
+      xInternAtomReply rep;
+      xInternAtomReq * intern = (xInternAtomReq *) req;
+      if(len < (size_t)sz_xInternAtomReq + intern->nbytes)
+        return send_error(c, BadLength, 0, req[0], 0);
+      memset(&rep, 0, sizeof(rep));
+      rep.atom = intern_atom((char *) req + sz_xInternAtomReq, intern->nbytes,
+                             intern->onlyIfExists);
+      return send_reply(c, &rep, sizeof(rep), NULL, 0);
+    }
+    case X_GetAtomName:
+    {
+      xGetAtomNameReply rep;
+      CARD32 atom = ((xResourceReq *) req)->id;
+      if(atom <= XA_LAST_PREDEFINED || atom > XA_LAST_PREDEFINED + (CARD32)server.num_atoms)
+        return send_error(c, BadAtom, atom, req[0], 0);
+      memset(&rep, 0, sizeof(rep));
+      rep.nameLength = strlen(server.atoms[atom - XA_LAST_PREDEFINED - 1]);
+      return send_reply(c, &rep, sizeof(rep),
+                        server.atoms[atom - XA_LAST_PREDEFINED - 1], rep.nameLength);
+    }
+    case X_GetProperty:
+    {
+      /* no window has properties */
+      xGetPropertyReply rep;
+      memset(&rep, 0, sizeof(rep));
+      rep.propertyType = None;
+      return send_reply(c, &rep, sizeof(rep), NULL, 0);
+    }
+    case X_GetInputFocus:
+    {
+      xGetInputFocusReply rep;
+      memset(&rep, 0, sizeof(rep));
+      rep.revertTo = RevertToPointerRoot;
+      rep.focus = PointerRoot;
+      return send_reply(c, &rep, sizeof(rep), NULL, 0);
+    }
+    /* requests without reply whose effect nobody can observe here */
+    case X_ChangeWindowAttributes:
+    case X_ChangeProperty:
+    case X_DeleteProperty:
+    case X_CreateGC:
+    case X_ChangeGC:
+    case X_FreeGC:
+    case X_NoOperation:
+      return 1;
+  }
+
+  if(req[0] == RANDR_OPCODE && present[0])
+    return randr_request(c, req, len);
+  if(req[0] == VIDMODE_OPCODE && present[1])
+    return vidmode_request(c, req, len);
+  if(req[0] == BIGREQ_OPCODE)
+  {
+    xBigReqEnableReply rep;
+    memset(&rep, 0, sizeof(rep));
+    rep.max_request_size = BIGREQ_MAX_LENGTH;
+    c->big_requests = 1;
+    return send_reply(c, &rep, sizeof(rep), NULL, 0);
+  }
+  return send_error(c, BadRequest, 0, req[0], 0);
+}
+
+/*
+ * FUNCTION process_input
+ *
+ * handle the connection prefix and all complete requests in the
+ * input buffer of a client
+ *
+ * returns 0 if the client has to be closed
+ */
+int
+process_input(struct client_t * c, int index)
+{
+  static const CARD16 one = 1;
+  size_t used = 0, len, header;
+  unsigned char * req;
+  xConnClientPrefix * prefix;
+
+  if(!c->setup_done)
+  {
+    if(c->in_len < sizeof(xConnClientPrefix))
+      return 1;
+    prefix = (xConnClientPrefix *) c->in;
+    len = sizeof(xConnClientPrefix) + pad4(prefix->nbytesAuthProto) +
+          pad4(prefix->nbytesAuthString);
+    if(c->in_len < len)
+      return 1;
+    if(prefix->byteOrder != (*(const unsigned char *) &one ? 'l' : 'B'))
+      return 0;
+    if(!send_setup(c, index))
+      return 0;
+    c->setup_done = 1;
+    used = len;
+  }
+
+  while(c->in_len - used >= 4)
+  {
+    req = c->in + used;
+    len = 4 * (size_t)((xReq *) req)->length;
+    header = 4;
+    if(len == 0 && c->big_requests)
+    {
+      /* the 32 bit length follows the header and is dropped */
+      if(c->in_len - used < 8)
+        break;
+      len = 4 * (size_t)((CARD32 *) req)[1];
+      header = 8;
+      if(len < 8)
+        return 0;
+    }
+    else if(len == 0)
+      return 0;
+    if(c->in_len - used < len)
+      break;
+    if(header == 8)
+    {
+      /* move the request header over the extended length */
+      memmove(req + 4, req, 4);
+      req += 4;
+      len -= 4;
+    }
+
+    c->sequence++;
+    c->requests++;
+    if(server.verbose)
+      fprintf(stderr, "fakex: client %d: request %d.%d, %lu bytes\n",
+              c->fd, req[0], req[0] >= 128 ? req[1] : 0, (unsigned long)len);
+    if(!core_request(c, req, len))
+      return 0;
+    used += len + header - 4;
+  }
+
+  memmove(c->in, c->in + used, c->in_len - used);
+  c->in_len -= used;
+  return 1;
+}
+
+/*
+ * FUNCTION close_client
+ *
+ * print the statistics of a client and drop it
+ */
+void
+close_client(int index)
+{
+  struct client_t * c = server.clients[index];
+
+  fprintf(stderr, "fakex: client %d: %lu requests, %lu round trips, %lu errors, "
+          "%llu bytes in, %llu bytes out, %.3f ms\n", c->fd, c->requests,
+          c->replies, c->errors, c->bytes_in, c->bytes_out,
+          (now_us() - c->started) / 1000.0);
+  server.total_requests += c->requests;
+  server.total_replies += c->replies;
+  server.total_errors += c->errors;
+  close(c->fd);
+  free(c->in);
+  free(c);
+  server.clients[index] = NULL;
+}
+
+/*
+ * FUNCTION parse_sizes
+ *
+ * parse a comma separated list of gamma sizes for the outputs; the
+ * last size is repeated for the remaining ones
+ *
+ * returns 0 on error
+ */
+int
+parse_sizes(const char * text, unsigned int * sizes)
+{
+  int n = 0, used;
+  unsigned int size;
+
+  while(n < MAX_OUTPUTS && sscanf(text, "%u%n", &size, &used) == 1)
+  {
+    if(size < 2 || size > 65535)
+      return 0;
+    sizes[n++] = size;
+    text += used;
+    if(*text != ',')
+      break;
+    text++;
+  }
+  if(*text || n == 0)
+    return 0;
+  while(n < MAX_OUTPUTS)
+  {
+    sizes[n] = sizes[n-1];
+    n++;
+  }
+  return 1;
+}
+
+void
+usage(void)
+{
+  fprintf(stdout, "usage: fakex [-options]\n\n");
+  fprintf(stdout, "    -display <:dpy>         default :99\n");
+  fprintf(stdout, "    -outputs <count>        connected outputs, default 1\n");
+  fprintf(stdout, "    -disconnected <count>   additional disconnected outputs\n");
+  fprintf(stdout, "    -gammasize <size,...>   per output, default 1024\n");
+  fprintf(stdout, "    -randr <major.minor>    default 1.5, 0.0 disables RandR\n");
+  fprintf(stdout, "    -novidmode\n");
+  fprintf(stdout, "    -vidmodesize <size>     default 256\n");
+  fprintf(stdout, "    -latency <us>           added to every round trip\n");
+  fprintf(stdout, "    -failgamma              SetCrtcGamma fails with BadMatch\n");
+  fprintf(stdout, "    -ctm                    outputs have a CTM property\n");
+  fprintf(stdout, "    -hotplug <changes>      soak a client selecting RandR events\n");
+  fprintf(stdout, "    -hotplugrate <per-s>    default 200\n");
+  fprintf(stdout, "    -seed <number>\n");
+  fprintf(stdout, "    -v\n");
+  exit(0);
+}
+
+int
+main(int argc, char * argv[])
+{
+  const char * display = ":99";
+  unsigned int sizes[MAX_OUTPUTS];
+  int connected = 1, disconnected = 0, i, n, listener, fd;
+  struct sockaddr_un addr;
+  struct pollfd fds[MAX_CLIENTS + 1];
+  struct client_t * c;
+  struct ucred cred;
+  socklen_t len;
+  unsigned long long now;
+  int timeout;
+  ssize_t got;
+
+  parse_sizes("1024", sizes);
+  server.randr_major = 1;
+  server.randr_minor = 5;
+  server.vidmode = 1;
+  server.vidmode_size = 256;
+  server.storm_rate = 200;
+  server.storm_seed = 1;
+
+  for(i=1; i<argc; i++)
+  {
+    if(!strcmp(argv[i], "-display") && i+1 < argc)
+      display = argv[++i];
+    else if(!strcmp(argv[i], "-outputs") && i+1 < argc)
+      connected = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "-disconnected") && i+1 < argc)
+      disconnected = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "-gammasize") && i+1 < argc)
+    {
+      if(!parse_sizes(argv[++i], sizes))
+        usage();
+    }
+    else if(!strcmp(argv[i], "-randr") && i+1 < argc)
+    {
+      if(sscanf(argv[++i], "%d.%d", &server.randr_major, &server.randr_minor) != 2)
+        usage();
+    }
+    else if(!strcmp(argv[i], "-novidmode"))
+      server.vidmode = 0;
+    else if(!strcmp(argv[i], "-vidmodesize") && i+1 < argc)
+      server.vidmode_size = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "-latency") && i+1 < argc)
+      server.latency_us = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "-failgamma"))
+      server.fail_gamma = 1;
+    else if(!strcmp(argv[i], "-ctm"))
+      server.ctm = intern_atom("CTM", 3, 0);
+    else if(!strcmp(argv[i], "-hotplug") && i+1 < argc)
+      server.storm_events = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "-hotplugrate") && i+1 < argc)
+      server.storm_rate = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "-seed") && i+1 < argc)
+      server.storm_seed = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "-v"))
+      server.verbose = 1;
+    else
+      usage();
+  }
+  if(connected < 0 || disconnected < 0 || connected + disconnected > MAX_OUTPUTS ||
+     server.vidmode_size < 2 || server.vidmode_size > 65535 || display[0] != ':' ||
+     server.storm_rate < 1)
+    usage();
+  server.latency = (unsigned long long *) malloc((server.storm_events + 1) * sizeof(unsigned long long));
+
+  server.num_outputs = connected + disconnected;
+  for(i=0; i<server.num_outputs; i++)
+  {
+    server.output[i].connected = i < connected;
+    server.output[i].gamma_size = sizes[i];
+    server.output[i].gamma = (CARD16 *) malloc(6 * sizes[i]);
+    identity_ramp(server.output[i].gamma, sizes[i]);
+  }
+  server.vidmode_gamma = (CARD16 *) malloc(6 * server.vidmode_size);
+  identity_ramp(server.vidmode_gamma, server.vidmode_size);
+  server.config_time = 1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  mkdir("/tmp/.X11-unix", 01777);
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "/tmp/.X11-unix/X%d", atoi(display + 1));
+  unlink(addr.sun_path);
+  if((listener = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+     bind(listener, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+     listen(listener, 16) < 0)
+  {
+    perror(addr.sun_path);
+    return 1;
+  }
+
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+  signal(SIGPIPE, SIG_IGN);
+  fprintf(stderr, "fakex: listening on %s, %d outputs, RandR %d.%d%s\n", display,
+          server.num_outputs, server.randr_major, server.randr_minor,
+          server.vidmode ? ", XF86VidMode" : "");
+
+  while(!quit)
+  {
+    fds[0].fd = listener;
+    fds[0].events = POLLIN;
+    for(i=0; i<MAX_CLIENTS; i++)
+    {
+      fds[i+1].fd = server.clients[i] ? server.clients[i]->fd : -1;
+      fds[i+1].events = POLLIN;
+    }
+    timeout = -1;
+    if(server.storm_next)
+    {
+      now = now_us();
+      if(server.storm_sent < server.storm_events)
+      {
+        while(server.storm_sent < server.storm_events && now >= server.storm_next)
+          storm_step();
+        timeout = server.storm_next > now ? (server.storm_next - now + 999) / 1000 : 0;
+      }
+      else
+      {
+        /* wait for the answers to the last changes */
+        for(i=0, n=0; i<server.num_outputs; i++)
+          n += server.output[i].pending != 0;
+        if((n == 0 && now >= server.storm_last + 100000) || now >= server.storm_last + STORM_SETTLE)
+        {
+          storm_report();
+          break;
+        }
+        timeout = 10;
+      }
+    }
+    if(poll(fds, MAX_CLIENTS + 1, timeout) < 0)
+      continue;
+
+    if(fds[0].revents & POLLIN && (fd = accept(listener, NULL, NULL)) >= 0)
+    {
+      for(n=0; n<MAX_CLIENTS && server.clients[n]; n++)
+        ;
+      if(n == MAX_CLIENTS)
+        close(fd);
+      else
+      {
+        c = server.clients[n] = (struct client_t *) calloc(1, sizeof(struct client_t));
+        c->fd = fd;
+        c->started = now_us();
+        len = sizeof(cred);
+        if(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0)
+          c->pid = cred.pid;
+        server.total_clients++;
+      }
+    }
+
+    for(i=0; i<MAX_CLIENTS; i++)
+    {
+      if(!(c = server.clients[i]) || !(fds[i+1].revents & (POLLIN | POLLHUP | POLLERR)))
+        continue;
+      if(c->in_size - c->in_len < 65536)
+      {
+        c->in_size = c->in_size * 2 + 65536;
+        c->in = (unsigned char *) realloc(c->in, c->in_size);
+      }
+      got = read(c->fd, c->in + c->in_len, c->in_size - c->in_len);
+      if(got < 0 && errno == EINTR)
+        continue;
+      if(got <= 0)
+      {
+        close_client(i);
+        continue;
+      }
+      c->in_len += got;
+      c->bytes_in += got;
+      if(!process_input(c, i))
+        close_client(i);
+    }
+  }
+
+  for(i=0; i<MAX_CLIENTS; i++)
+    if(server.clients[i])
+      close_client(i);
+  unlink(addr.sun_path);
+  fprintf(stderr, "fakex: %lu clients, %lu requests, %lu round trips, %lu errors\n",
+          server.total_clients, server.total_requests, server.total_replies,
+          server.total_errors);
+  return server.storm_failed;
+}
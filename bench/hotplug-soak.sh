@@ -0,0 +1,38 @@
+#!/bin/sh
+#
+# hotplug-soak.sh - soak "xcalib -watch" with output hotplug and mode changes
+#
+# usage: bench/hotplug-soak.sh [changes [changes-per-second [profile]]]
+#
+# Runs fakex with a hotplug storm of the given number of changes
+# against a resident xcalib and prints fakex's report: re-apply latency
+# percentiles, changes never answered by an upload, wrong ramps, the
+# ramps on each CRTC at the end and the memory growth of xcalib.
+# Exits with 1 if any check failed. Expects xcalib and fakex built in
+# the current directory ("make xcalib fakex").
+
+CHANGES=${1:-5000}
+RATE=${2:-500}
+PROFILE=${3:-bluish.icc}
+DISPLAY_NUMBER=:97
+
+./fakex -display $DISPLAY_NUMBER -outputs 2 -disconnected 2 -gammasize 1024,256 \
+        -hotplug $CHANGES -hotplugrate $RATE &
+FAKEX=$!
+sleep 1
+
+# xcalib ends with an I/O error when fakex leaves after its report
+./xcalib -d $DISPLAY_NUMBER -watch $PROFILE > /dev/null 2>&1 &
+XCALIB=$!
+
+wait $FAKEX
+STATUS=$?
+kill $XCALIB 2> /dev/null
+wait $XCALIB 2> /dev/null
+
+if [ $STATUS -eq 0 ]; then
+  echo "hotplug soak passed"
+else
+  echo "hotplug soak FAILED"
+fi
+exit $STATUS
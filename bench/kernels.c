@@ -0,0 +1,132 @@
+/*
+ * kernels - benchmark of the size specialized ramp kernels of xcalib
+ *
+ * This program is GPL-ed postcardware! please see README
+ *
+ * It is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA.
+ */
+
+/*
+ * kernels is built from xcalib.c itself (without its main) and times
+ * resampling one channel of random ramps with resample_generic and
+ * with the kernel resample_select picks, for every specialized pair
+ * of sizes. The median of many runs is printed per pair with the
+ * speedup, the time resample_select needs for the positions is
+ * counted in. The exit status is 1 if a specialized kernel gives
+ * other values than the generic one.
+ */
+
+#define XCALIB_NO_MAIN
+#include "../xcalib.c"
+
+/* size pairs to time, the specialized ones first */
+static const unsigned int pairs[][2] = {
+  { 256, 256 }, { 1024, 1024 }, { 4096, 4096 }, { 256, 1024 }, { 256, 4096 },
+  { 512, 2048 },
+};
+
+int
+compare_ns(const void * a, const void * b)
+{
+  unsigned long long x = *(const unsigned long long *) a;
+  unsigned long long y = *(const unsigned long long *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+/*
+ * FUNCTION time_kernel
+ *
+ * median time of selecting a kernel and resampling three channels
+ */
+double
+time_kernel(int generic, const u_int16_t * src, u_int16_t * dst,
+            unsigned int from, unsigned int to, int runs)
+{
+  unsigned long long * ns = (unsigned long long *) malloc(runs * sizeof(unsigned long long));
+  struct resample_t rs;
+  double median;
+  int r, c;
+
+  for(r=0; r<runs; r++)
+  {
+    unsigned long long start = now_ns();
+
+    if(generic)
+    {
+      rs.from = from;
+      rs.to = to;
+      rs.steps = NULL;
+      rs.kernel = resample_generic;
+    } else
+      resample_select(&rs, from, to);
+    for(c=0; c<3; c++)
+      rs.kernel(&rs, src + c * (from + 1), dst + c * to);
+    resample_release(&rs);
+    ns[r] = now_ns() - start;
+  }
+  qsort(ns, runs, sizeof(unsigned long long), compare_ns);
+  median = ns[runs / 2] / 1000.0;
+  free(ns);
+  return median;
+}
+
+int
+main(int argc, char * argv[])
+{
+  int runs = argc > 1 ? atoi(argv[1]) : 2000, failed = 0;
+  unsigned int p, j, c;
+
+  if(runs < 1)
+  {
+    fprintf(stdout, "usage: kernels [runs]\n");
+    return 0;
+  }
+  srand(1);
+  fprintf(stdout, "%-12s %12s %12s %8s\n", "from -> to", "generic us", "selected us", "speedup");
+  for(p=0; p<sizeof(pairs) / sizeof(pairs[0]); p++)
+  {
+    unsigned int from = pairs[p][0], to = pairs[p][1];
+    u_int16_t * src = (u_int16_t *) malloc(3 * (from + 1) * sizeof(u_int16_t));
+    u_int16_t * want = (u_int16_t *) malloc(3 * to * sizeof(u_int16_t));
+    u_int16_t * got = (u_int16_t *) malloc(3 * to * sizeof(u_int16_t));
+    struct resample_t rs;
+    double generic, selected;
+    char label[32];
+
+    /* increasing ramps with some noise, extrapolated like the decoder */
+    for(c=0; c<3; c++)
+    {
+      for(j=0; j<from; j++)
+        src[c * (from + 1) + j] = j * 65472 / from + rand() % 64;
+      src[c * (from + 1) + from] = 0xffff;
+    }
+
+    generic = time_kernel(1, src, want, from, to, runs);
+    selected = time_kernel(0, src, got, from, to, runs);
+    if(memcmp(want, got, 3 * to * sizeof(u_int16_t)))
+      failed = 1;
+    snprintf(label, sizeof(label), "%u -> %u", from, to);
+    fprintf(stdout, "%-12s %12.3f %12.3f %7.2fx%s%s\n", label, generic, selected,
+            generic / selected, resample_select(&rs, from, to) ? "" : "  (generic)",
+            memcmp(want, got, 3 * to * sizeof(u_int16_t)) ? "  MISMATCH" : "");
+    resample_release(&rs);
+    free(src);
+    free(want);
+    free(got);
+  }
+  return failed;
+}
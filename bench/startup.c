@@ -0,0 +1,247 @@
+/*
+ * startup - whole process latency benchmark of xcalib
+ *
+ * This program is GPL-ed postcardware! please see README
+ *
+ * It is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA.
+ */
+
+/*
+ * startup runs the xcalib binary many times in each major mode and
+ * measures what a user waits for: fork, exec, dynamic linking, option
+ * parsing, XOpenDisplay, RandR discovery, profile parsing, upload and
+ * XCloseDisplay, up to the exit status being collected. Minimum,
+ * median and 99th percentile of the wall time and the median of minor
+ * and the maximum of major page faults (from wait4) are printed per
+ * mode.
+ *
+ * Unless -noserver is given, fakex is started on the display first,
+ * so no X server is needed. With -limit the exit status is 1 if the
+ * median of any mode exceeds the limit, for use in per commit checks.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define MAX_ARGS 8
+
+/* one measured way of running xcalib; "<profile>" is replaced by -profile */
+struct mode_t {
+  const char * name;
+  const char * args[MAX_ARGS];
+};
+
+/* one run of xcalib */
+struct run_t {
+  double ms;
+  long minflt;
+  long majflt;
+};
+
+static const struct mode_t modes[] = {
+  { "apply",              { "<profile>", NULL } },
+  { "apply -lock",        { "-lock", "<profile>", NULL } },
+  { "clear",              { "-clear", NULL } },
+  { "alter",              { "-alter", NULL } },
+  { "noaction printramps", { "-noaction", "1024", "-printramps", "<profile>", NULL } },
+};
+
+/*
+ * FUNCTION now_ms
+ */
+double
+now_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+/*
+ * FUNCTION run_once
+ *
+ * run xcalib with the arguments of a mode, output discarded
+ *
+ * returns 0 if it could not be run or did not exit with 0
+ */
+int
+run_once(const char * xcalib, const char * display, const char * profile,
+         const struct mode_t * mode, struct run_t * run)
+{
+  const char * argv[MAX_ARGS + 4];
+  struct rusage usage;
+  double start;
+  pid_t pid;
+  int status, n = 0, k, fd;
+
+  argv[n++] = xcalib;
+  /* -noaction connects as well, to fakex rather than $DISPLAY */
+  argv[n++] = "-d";
+  argv[n++] = display;
+  for(k=0; mode->args[k]; k++)
+    argv[n++] = strcmp(mode->args[k], "<profile>") ? mode->args[k] : profile;
+  argv[n] = NULL;
+
+  start = now_ms();
+  if((pid = fork()) < 0)
+    return 0;
+  if(pid == 0)
+  {
+    if((fd = open("/dev/null", O_WRONLY)) >= 0)
+    {
+      dup2(fd, 1);
+      dup2(fd, 2);
+    }
+    execv(xcalib, (char * const *) argv);
+    _exit(127);
+  }
+  if(wait4(pid, &status, 0, &usage) != pid)
+    return 0;
+  run->ms = now_ms() - start;
+  run->minflt = usage.ru_minflt;
+  run->majflt = usage.ru_majflt;
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int
+compare_runs(const void * a, const void * b)
+{
+  double x = ((const struct run_t *) a)->ms, y = ((const struct run_t *) b)->ms;
+
+  return x < y ? -1 : x > y;
+}
+
+int
+compare_long(const void * a, const void * b)
+{
+  long x = *(const long *) a, y = *(const long *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+void
+usage(void)
+{
+  fprintf(stdout, "usage: startup [-options]\n\n");
+  fprintf(stdout, "    -runs <count>       per mode, default 200\n");
+  fprintf(stdout, "    -xcalib <binary>    default ./xcalib\n");
+  fprintf(stdout, "    -fakex <binary>     default ./fakex\n");
+  fprintf(stdout, "    -display <:dpy>     default :98\n");
+  fprintf(stdout, "    -profile <icc>      default bluish.icc\n");
+  fprintf(stdout, "    -noserver           use the running X server of -display\n");
+  fprintf(stdout, "    -limit <ms>         fail if a median is above\n");
+  exit(0);
+}
+
+int
+main(int argc, char * argv[])
+{
+  const char * xcalib = "./xcalib", * fakex = "./fakex";
+  const char * display = ":98", * profile = "bluish.icc";
+  int runs = 200, noserver = 0, failed = 0, i, m, ok;
+  double limit = 0.0;
+  struct run_t * run;
+  long * faults;
+  pid_t server = 0;
+
+  for(i=1; i<argc; i++)
+  {
+    if(!strcmp(argv[i], "-runs") && i+1 < argc)
+      runs = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "-xcalib") && i+1 < argc)
+      xcalib = argv[++i];
+    else if(!strcmp(argv[i], "-fakex") && i+1 < argc)
+      fakex = argv[++i];
+    else if(!strcmp(argv[i], "-display") && i+1 < argc)
+      display = argv[++i];
+    else if(!strcmp(argv[i], "-profile") && i+1 < argc)
+      profile = argv[++i];
+    else if(!strcmp(argv[i], "-noserver"))
+      noserver = 1;
+    else if(!strcmp(argv[i], "-limit") && i+1 < argc)
+      limit = atof(argv[++i]);
+    else
+      usage();
+  }
+  if(runs < 1)
+    usage();
+
+  if(!noserver)
+  {
+    if((server = fork()) == 0)
+    {
+      int fd = open("/dev/null", O_WRONLY);
+      if(fd >= 0)
+        dup2(fd, 2);
+      execl(fakex, fakex, "-display", display, "-outputs", "2", (char *) NULL);
+      _exit(127);
+    }
+    usleep(300000);
+  }
+
+  run = (struct run_t *) malloc(runs * sizeof(struct run_t));
+  faults = (long *) malloc(runs * sizeof(long));
+  fprintf(stdout, "%-22s %6s %9s %9s %9s %8s %8s\n", "mode", "runs",
+          "min ms", "median", "p99", "minflt", "majflt");
+
+  for(m=0; m<(int)(sizeof(modes) / sizeof(modes[0])); m++)
+  {
+    long majflt = 0;
+
+    /* one unmeasured run warms the page cache */
+    ok = run_once(xcalib, display, profile, &modes[m], &run[0]);
+    for(i=0; ok && i<runs; i++)
+      ok = run_once(xcalib, display, profile, &modes[m], &run[i]);
+    if(!ok)
+    {
+      fprintf(stdout, "%-22s failed\n", modes[m].name);
+      failed = 1;
+      continue;
+    }
+
+    for(i=0; i<runs; i++)
+    {
+      faults[i] = run[i].minflt;
+      if(run[i].majflt > majflt)
+        majflt = run[i].majflt;
+    }
+    qsort(run, runs, sizeof(struct run_t), compare_runs);
+    qsort(faults, runs, sizeof(long), compare_long);
+    fprintf(stdout, "%-22s %6d %9.3f %9.3f %9.3f %8ld %8ld\n", modes[m].name, runs,
+            run[0].ms, run[runs / 2].ms, run[runs * 99 / 100].ms, faults[runs / 2], majflt);
+    if(limit > 0.0 && run[runs / 2].ms > limit)
+      failed = 1;
+  }
+
+  if(server > 0)
+  {
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+  }
+  free(run);
+  free(faults);
+  return failed;
+}
@@ -0,0 +1,28 @@
+# setup.py for the xcalib Python module
+#
+# This program is GPL-ed postcardware! please see README
+#
+# build and try in place with
+#   cd python && python3 setup.py build_ext --inplace
+#   python3 -c "import xcalib; print(xcalib.decode('../bluish.icc').size)"
+
+from setuptools import setup, Extension
+
+XCALIB_VERSION = "0.10"
+
+xcalib = Extension(
+    "xcalib",
+    sources=["xcalibmodule.c"],
+    include_dirs=[".."],
+    define_macros=[("XCALIB_VERSION", '"%s"' % XCALIB_VERSION)],
+    libraries=["X11", "Xrandr", "Xxf86vm", "Xext", "pthread", "m"],
+    depends=["../xcalib.c"],
+)
+
+setup(
+    name="xcalib",
+    version=XCALIB_VERSION,
+    description="decode, transform, compare and upload display calibration ramps",
+    license="GPL-2.0-or-later",
+    ext_modules=[xcalib],
+)
@@ -0,0 +1,571 @@
+/*
+ * xcalibmodule - Python bindings of the xcalib ramp functions
+ *
+ * This program is GPL-ed postcardware! please see README
+ *
+ * It is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA.
+ */
+
+/*
+ * The module is built from xcalib.c itself (without its main), so
+ * profiles are decoded and ramps are transformed by exactly the code
+ * the command line tool uses:
+ *
+ *   decode(filename, size=256)          vcgt/MLUT of a profile as Ramps
+ *   transform(ramps, gamma=1.0, brightness=0.0, contrast=100.0,
+ *             invert=False)             like -gc/-b/-co/-invert, in place
+ *   compare(a, b)                       per channel differences, see -compare
+ *   read_output(display=None, screen=-1, output=0)
+ *   write_output(ramps, display=None, screen=-1, output=0)
+ *
+ * gamma, brightness and contrast are one value or one per channel.
+ * Ramps(size) holds the three channels in one block of 16-bit
+ * entries and exports it through the buffer protocol as a writable
+ * 3 x size array of "H", so numpy.asarray(ramps) or memoryview(ramps)
+ * work on the same memory without a copy. The GIL is released while
+ * profiles are parsed, ramps are transformed or compared and while
+ * waiting for the X server, so many threads can analyse at once. Each
+ * backend call opens its own display connection; these calls take
+ * turns, as the extension bookkeeping of Xlib does not survive
+ * displays being opened and closed on several threads.
+ */
+
+#include <Python.h>
+
+#define XCALIB_NO_MAIN
+#include "xcalib.c"
+
+/* a set of three ramps */
+typedef struct {
+  PyObject_HEAD
+  unsigned int size;
+  u_int16_t * ramp;     /* size red, then green, then blue entries */
+  Py_ssize_t shape[2];
+  Py_ssize_t strides[2];
+} RampsObject;
+
+static PyTypeObject RampsType;
+
+#ifndef _WIN32
+/* held from open_output to close_output */
+static pthread_mutex_t backend_lock = PTHREAD_MUTEX_INITIALIZER;
+/* the display of the backend call and the X errors it got */
+static Display * module_dpy = NULL;
+static int module_errors = 0;
+static int (*previous_error_handler)(Display *, XErrorEvent *) = NULL;
+static int error_handler_installed = 0;
+#endif
+
+/*
+ * FUNCTION new_ramps
+ *
+ * returns new linear ramps like -clear uploads or NULL with an
+ * exception set
+ */
+static RampsObject *
+new_ramps(unsigned int size)
+{
+  RampsObject * self;
+  unsigned int i;
+
+  if(size < 2 || size > MAX_RAMP_SIZE)
+  {
+    PyErr_Format(PyExc_ValueError, "ramp size must be between 2 and %d", MAX_RAMP_SIZE);
+    return NULL;
+  }
+  if(!(self = PyObject_New(RampsObject, &RampsType)))
+    return NULL;
+  if(!(self->ramp = (u_int16_t *) PyMem_Malloc(3 * size * sizeof(u_int16_t))))
+  {
+    Py_DECREF(self);
+    return (RampsObject *) PyErr_NoMemory();
+  }
+  self->size = size;
+  self->shape[0] = 3;
+  self->shape[1] = size;
+  self->strides[0] = size * sizeof(u_int16_t);
+  self->strides[1] = sizeof(u_int16_t);
+  for(i=0; i<size; i++)
+    self->ramp[i] = self->ramp[size + i] = self->ramp[2*size + i] = i * 65535 / size;
+  return self;
+}
+
+static PyObject *
+Ramps_new(PyTypeObject * type, PyObject * args, PyObject * kwds)
+{
+  static char * keywords[] = { "size", NULL };
+  unsigned int size = 256;
+
+  if(!PyArg_ParseTupleAndKeywords(args, kwds, "|I", keywords, &size))
+    return NULL;
+  return (PyObject *) new_ramps(size);
+}
+
+static void
+Ramps_dealloc(RampsObject * self)
+{
+  PyMem_Free(self->ramp);
+  PyObject_Del(self);
+}
+
+static int
+Ramps_getbuffer(RampsObject * self, Py_buffer * view, int flags)
+{
+  view->obj = (PyObject *) self;
+  view->buf = self->ramp;
+  view->len = 3 * self->size * sizeof(u_int16_t);
+  view->readonly = 0;
+  view->itemsize = sizeof(u_int16_t);
+  view->format = (flags & PyBUF_FORMAT) ? "H" : NULL;
+  view->ndim = 2;
+  view->shape = (flags & PyBUF_ND) == PyBUF_ND ? self->shape : NULL;
+  view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? self->strides : NULL;
+  view->suboffsets = NULL;
+  view->internal = NULL;
+  Py_INCREF(self);
+  return 0;
+}
+
+static PyObject *
+Ramps_get_size(RampsObject * self, void * closure)
+{
+  return PyLong_FromUnsignedLong(self->size);
+}
+
+static PyObject *
+Ramps_repr(RampsObject * self)
+{
+  return PyUnicode_FromFormat("<xcalib.Ramps size=%u>", self->size);
+}
+
+static PyBufferProcs Ramps_as_buffer = {
+  (getbufferproc) Ramps_getbuffer,
+  NULL
+};
+
+static PyGetSetDef Ramps_getset[] = {
+  { "size", (getter) Ramps_get_size, NULL, "entries per channel", NULL },
+  { NULL }
+};
+
+static PyTypeObject RampsType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "xcalib.Ramps",
+  .tp_basicsize = sizeof(RampsObject),
+  .tp_dealloc = (destructor) Ramps_dealloc,
+  .tp_repr = (reprfunc) Ramps_repr,
+  .tp_as_buffer = &Ramps_as_buffer,
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_doc = "Ramps(size=256): red, green and blue ramps of 16-bit entries,\n"
+            "exported as a writable 3 x size buffer of format 'H'",
+  .tp_getset = Ramps_getset,
+  .tp_new = Ramps_new,
+};
+
+/*
+ * FUNCTION parse_channels
+ *
+ * convert one number or a sequence of three to per channel values
+ *
+ * returns 0 with an exception set on failure
+ */
+static int
+parse_channels(PyObject * obj, const char * name, double * value)
+{
+  PyObject * seq;
+  int c;
+
+  if(!obj)
+    return 1;
+  if(PyNumber_Check(obj))
+  {
+    if((value[0] = PyFloat_AsDouble(obj)) == -1.0 && PyErr_Occurred())
+      return 0;
+    value[1] = value[2] = value[0];
+    return 1;
+  }
+  if(!(seq = PySequence_Fast(obj, "")) || PySequence_Fast_GET_SIZE(seq) != 3)
+  {
+    Py_XDECREF(seq);
+    PyErr_Format(PyExc_TypeError, "%s must be a number or three numbers", name);
+    return 0;
+  }
+  for(c=0; c<3; c++)
+    if((value[c] = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(seq, c))) == -1.0 &&
+       PyErr_Occurred())
+      break;
+  Py_DECREF(seq);
+  return c == 3;
+}
+
+static PyObject *
+xcalib_decode(PyObject * module, PyObject * args, PyObject * kwds)
+{
+  static char * keywords[] = { "filename", "size", NULL };
+  PyObject * filename;
+  RampsObject * ramps;
+  unsigned int size = 256;
+  int result;
+
+  if(!PyArg_ParseTupleAndKeywords(args, kwds, "O&|I", keywords,
+                                  PyUnicode_FSConverter, &filename, &size))
+    return NULL;
+  /* the same sizes the X path accepts */
+  if(size < 16 || size > MAX_RAMP_SIZE || (size & (size - 1)))
+  {
+    Py_DECREF(filename);
+    return PyErr_Format(PyExc_ValueError, "unsupported ramp size %u", size);
+  }
+  if(!(ramps = new_ramps(size)))
+  {
+    Py_DECREF(filename);
+    return NULL;
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  result = read_vcgt_internal(PyBytes_AS_STRING(filename), ramps->ramp,
+                              ramps->ramp + size, ramps->ramp + 2*size, size);
+  Py_END_ALLOW_THREADS
+
+  if(result <= 0)
+  {
+    if(result < 0)
+      PyErr_Format(PyExc_OSError, "Unable to read file '%s'", PyBytes_AS_STRING(filename));
+    else
+      PyErr_Format(PyExc_ValueError, "No calibration data in ICC profile '%s' found",
+                   PyBytes_AS_STRING(filename));
+    Py_DECREF(ramps);
+    ramps = NULL;
+  }
+  Py_DECREF(filename);
+  return (PyObject *) ramps;
+}
+
+static PyObject *
+xcalib_transform(PyObject * module, PyObject * args, PyObject * kwds)
+{
+  static char * keywords[] = { "ramps", "gamma", "brightness", "contrast", "invert", NULL };
+  PyObject * gammaObj = NULL, * brightnessObj = NULL, * contrastObj = NULL;
+  double gamma[3] = { 1.0, 1.0, 1.0 };
+  double brightness[3] = { 0.0, 0.0, 0.0 };
+  double contrast[3] = { 100.0, 100.0, 100.0 };
+  struct xcalib_state_t state = xcalib_state;
+  RampsObject * ramps;
+  unsigned int size;
+  int invert = 0, c;
+
+  if(!PyArg_ParseTupleAndKeywords(args, kwds, "O!|OOOp", keywords, &RampsType, &ramps,
+                                  &gammaObj, &brightnessObj, &contrastObj, &invert) ||
+     !parse_channels(gammaObj, "gamma", gamma) ||
+     !parse_channels(brightnessObj, "brightness", brightness) ||
+     !parse_channels(contrastObj, "contrast", contrast))
+    return NULL;
+  for(c=0; c<3; c++)
+  {
+    if(gamma[c] <= 0.0)
+      return PyErr_Format(PyExc_ValueError, "gamma must be positive");
+    if(brightness[c] < 0.0 || brightness[c] > 99.0)
+      return PyErr_Format(PyExc_ValueError, "brightness is out of range 0.0-99.0");
+    if(contrast[c] < 1.0 || contrast[c] > 100.0)
+      return PyErr_Format(PyExc_ValueError, "contrast is out of range 1.0-100.0");
+  }
+
+  /* the same mapping the options use, on a private state */
+  state.redGamma = gamma[0];
+  state.greenGamma = gamma[1];
+  state.blueGamma = gamma[2];
+  state.redMin = brightness[0] / 100.0;
+  state.greenMin = brightness[1] / 100.0;
+  state.blueMin = brightness[2] / 100.0;
+  state.redMax = (1.0 - state.redMin) * (contrast[0] / 100.0) + state.redMin;
+  state.greenMax = (1.0 - state.greenMin) * (contrast[1] / 100.0) + state.greenMin;
+  state.blueMax = (1.0 - state.blueMin) * (contrast[2] / 100.0) + state.blueMin;
+  size = ramps->size;
+
+  Py_BEGIN_ALLOW_THREADS
+  apply_correction(&state, ramps->ramp, ramps->ramp + size, ramps->ramp + 2*size, size);
+  if(invert)
+    invert_ramps(ramps->ramp, ramps->ramp + size, ramps->ramp + 2*size, size);
+  Py_END_ALLOW_THREADS
+
+  Py_RETURN_NONE;
+}
+
+static PyObject *
+xcalib_compare(PyObject * module, PyObject * args)
+{
+  static const char * channel[3] = { "red", "green", "blue" };
+  RampsObject * a, * b;
+  struct ramp_diff_t result[3];
+  PyObject * dict, * item;
+  u_int16_t * diff;
+  unsigned int size;
+  int c;
+
+  if(!PyArg_ParseTuple(args, "O!O!", &RampsType, &a, &RampsType, &b))
+    return NULL;
+  if(a->size != b->size)
+    return PyErr_Format(PyExc_ValueError, "ramp sizes differ: %u and %u", a->size, b->size);
+  size = a->size;
+  if(!(diff = (u_int16_t *) PyMem_RawMalloc(size * sizeof(u_int16_t))))
+    return PyErr_NoMemory();
+
+  Py_BEGIN_ALLOW_THREADS
+  for(c=0; c<3; c++)
+    compare_ramp(a->ramp + c*size, b->ramp + c*size, size, diff, &result[c]);
+  Py_END_ALLOW_THREADS
+
+  PyMem_RawFree(diff);
+  if(!(dict = PyDict_New()))
+    return NULL;
+  for(c=0; c<3; c++)
+  {
+    item = Py_BuildValue("{s:I,s:d,s:I,s:I,s:I,s:(III)}",
+                         "max", result[c].max, "rms", result[c].rms,
+                         "p50", result[c].p50, "p95", result[c].p95, "p99", result[c].p99,
+                         "worst", result[c].worst[0], result[c].worst[1], result[c].worst[2]);
+    if(!item || PyDict_SetItemString(dict, channel[c], item) < 0)
+    {
+      Py_XDECREF(item);
+      Py_DECREF(dict);
+      return NULL;
+    }
+    Py_DECREF(item);
+  }
+  return dict;
+}
+
+#ifndef _WIN32
+/*
+ * FUNCTION module_error
+ *
+ * X error handler: errors of the display of the running backend call
+ * are counted, all others go to the handler that was installed before
+ */
+static int
+module_error(Display * dpy, XErrorEvent * event)
+{
+  if(dpy == module_dpy)
+  {
+    module_errors++;
+    return 0;
+  }
+  return previous_error_handler ? previous_error_handler(dpy, event) : 0;
+}
+
+/*
+ * FUNCTION open_output
+ *
+ * connect to a display and find the gamma size of an output like the
+ * command line does: the CRTC with XRandR 1.2, else the screen with
+ * XVidMode. Called without the GIL; close_output must follow.
+ *
+ * returns the gamma size or 0 on failure with *dpy set if the display
+ * could be opened
+ */
+static int
+open_output(const char * displayname, int * screen, int xoutput, Display ** dpy,
+            RRCrtc * crtc, int * xrr_version)
+{
+  int major = 0, minor = 0, size = 0;
+
+  pthread_mutex_lock(&backend_lock);
+  if(!(*dpy = XOpenDisplay(displayname)))
+    return 0;
+  module_dpy = *dpy;
+  module_errors = 0;
+  if(*screen < 0)
+    *screen = DefaultScreen(*dpy);
+  *xrr_version = XRRQueryVersion(*dpy, &major, &minor) ? major*100 + minor : -1;
+  if(*xrr_version >= 102)
+    size = find_output_crtc(*dpy, *screen, xoutput, crtc);
+  else if(!XF86VidModeGetGammaRampSize(*dpy, *screen, &size))
+    size = 0;
+  return size > MAX_RAMP_SIZE ? 0 : size;
+}
+
+/*
+ * FUNCTION close_output
+ */
+static void
+close_output(Display * dpy)
+{
+  if(dpy)
+    XCloseDisplay(dpy);
+  module_dpy = NULL;
+  pthread_mutex_unlock(&backend_lock);
+}
+
+/*
+ * FUNCTION install_error_handler
+ *
+ * called with the GIL, which serializes the installation
+ */
+static void
+install_error_handler(void)
+{
+  if(!error_handler_installed)
+  {
+    previous_error_handler = XSetErrorHandler(module_error);
+    error_handler_installed = 1;
+  }
+}
+
+static PyObject *
+xcalib_read_output(PyObject * module, PyObject * args, PyObject * kwds)
+{
+  static char * keywords[] = { "display", "screen", "output", NULL };
+  const char * displayname = NULL;
+  int screen = -1, xoutput = 0, xrr_version = -1, size, ok = 0;
+  u_int16_t * ramp = NULL;
+  Display * dpy = NULL;
+  RampsObject * ramps;
+  RRCrtc crtc = 0;
+
+  if(!PyArg_ParseTupleAndKeywords(args, kwds, "|zii", keywords,
+                                  &displayname, &screen, &xoutput))
+    return NULL;
+  install_error_handler();
+
+  Py_BEGIN_ALLOW_THREADS
+  if((size = open_output(displayname, &screen, xoutput, &dpy, &crtc, &xrr_version)) &&
+     (ramp = (u_int16_t *) malloc(3 * size * sizeof(u_int16_t))))
+  {
+    if(xrr_version >= 102)
+    {
+      XRRCrtcGamma * gamma = XRRGetCrtcGamma(dpy, crtc);
+      if(gamma && gamma->size == size)
+      {
+        memcpy(ramp, gamma->red, size * sizeof(u_int16_t));
+        memcpy(ramp + size, gamma->green, size * sizeof(u_int16_t));
+        memcpy(ramp + 2*size, gamma->blue, size * sizeof(u_int16_t));
+        ok = 1;
+      }
+      if(gamma)
+        XRRFreeGamma(gamma);
+    }
+    else
+      ok = XF86VidModeGetGammaRamp(dpy, screen, size, ramp, ramp + size, ramp + 2*size);
+    ok = ok && !module_errors;
+  }
+  close_output(dpy);
+  Py_END_ALLOW_THREADS
+
+  if(!dpy)
+    PyErr_Format(PyExc_OSError, "Can't open display %s", XDisplayName(displayname));
+  else if(!ok)
+    PyErr_Format(PyExc_OSError, "Unable to read the gamma of output %d", xoutput);
+  else if((ramps = new_ramps(size)))
+  {
+    memcpy(ramps->ramp, ramp, 3 * size * sizeof(u_int16_t));
+    free(ramp);
+    return (PyObject *) ramps;
+  }
+  free(ramp);
+  return NULL;
+}
+
+static PyObject *
+xcalib_write_output(PyObject * module, PyObject * args, PyObject * kwds)
+{
+  static char * keywords[] = { "ramps", "display", "screen", "output", NULL };
+  const char * displayname = NULL;
+  int screen = -1, xoutput = 0, xrr_version = -1, size, ok = 0, c;
+  u_int16_t * ramp = NULL;
+  Display * dpy = NULL;
+  RampsObject * ramps;
+  RRCrtc crtc = 0;
+
+  if(!PyArg_ParseTupleAndKeywords(args, kwds, "O!|zii", keywords, &RampsType, &ramps,
+                                  &displayname, &screen, &xoutput))
+    return NULL;
+  install_error_handler();
+
+  /* the ramps are resampled to the gamma size of the output */
+  Py_BEGIN_ALLOW_THREADS
+  if((size = open_output(displayname, &screen, xoutput, &dpy, &crtc, &xrr_version)) &&
+     (ramp = (u_int16_t *) malloc(3 * size * sizeof(u_int16_t))))
+  {
+    for(c=0; c<3; c++)
+      resample_ramp(ramps->ramp + c*ramps->size, ramps->size, ramp + c*size, size);
+    ok = set_display_ramps(dpy, screen, crtc, xrr_version, ramp, ramp + size,
+                           ramp + 2*size, size);
+    XSync(dpy, False);
+    ok = ok && !module_errors;
+  }
+  close_output(dpy);
+  free(ramp);
+  Py_END_ALLOW_THREADS
+
+  if(!dpy)
+    return PyErr_Format(PyExc_OSError, "Can't open display %s", XDisplayName(displayname));
+  if(!ok)
+    return PyErr_Format(PyExc_OSError, "Unable to set the gamma of output %d", xoutput);
+  Py_RETURN_NONE;
+}
+#endif
+
+static PyMethodDef xcalib_methods[] = {
+  { "decode", (PyCFunction) xcalib_decode, METH_VARARGS | METH_KEYWORDS,
+    "decode(filename, size=256) -> Ramps\n\n"
+    "read the vcgt or MLUT tag of an ICC profile at a power of two size" },
+  { "transform", (PyCFunction) xcalib_transform, METH_VARARGS | METH_KEYWORDS,
+    "transform(ramps, gamma=1.0, brightness=0.0, contrast=100.0, invert=False)\n\n"
+    "apply gamma, brightness and contrast like -gc, -b and -co in place;\n"
+    "each is one number or one per channel" },
+  { "compare", (PyCFunction) xcalib_compare, METH_VARARGS,
+    "compare(a, b) -> dict\n\n"
+    "max, rms, p50, p95, p99 and the worst entries per channel, like -compare" },
+#ifndef _WIN32
+  { "read_output", (PyCFunction) xcalib_read_output, METH_VARARGS | METH_KEYWORDS,
+    "read_output(display=None, screen=-1, output=0) -> Ramps\n\n"
+    "read the current gamma of an XRandR output (XVidMode screen without 1.2)" },
+  { "write_output", (PyCFunction) xcalib_write_output, METH_VARARGS | METH_KEYWORDS,
+    "write_output(ramps, display=None, screen=-1, output=0)\n\n"
+    "upload ramps, resampled to the gamma size of the output" },
+#endif
+  { NULL }
+};
+
+static struct PyModuleDef xcalib_module = {
+  PyModuleDef_HEAD_INIT,
+  "xcalib",
+  "decode, transform, compare and upload display calibration ramps",
+  -1,
+  xcalib_methods
+};
+
+PyMODINIT_FUNC
+PyInit_xcalib(void)
+{
+  PyObject * module;
+
+#ifndef _WIN32
+  /* backend calls of several threads each use their own display */
+  XInitThreads();
+#endif
+  if(PyType_Ready(&RampsType) < 0 || !(module = PyModule_Create(&xcalib_module)))
+    return NULL;
+  Py_INCREF(&RampsType);
+  if(PyModule_AddObject(module, "Ramps", (PyObject *) &RampsType) < 0)
+  {
+    Py_DECREF(&RampsType);
+    Py_DECREF(module);
+    return NULL;
+  }
+  PyModule_AddStringConstant(module, "__version__", XCALIB_VERSION);
+  return module;
+}
@@ -45,15 +45,40 @@
 #include <stdarg.h>
 #include <fcntl.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <dirent.h>
 #include <sys/types.h>
+#ifndef _WIN32
+# include <signal.h>
+# include <unistd.h>
+# include <poll.h>
+# include <pthread.h>
+# include <sys/file.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <sys/wait.h>
+# include <sys/time.h>
+# include <sys/socket.h>
+# include <sys/un.h>
+# include <netdb.h>
+# include <stddef.h>
+# ifdef __GLIBC__
+#  include <malloc.h>
+# endif
+#endif
 
 /* for X11 VidMode stuff */
 #ifndef _WIN32
 # include <X11/Xos.h>
 # include <X11/Xlib.h>
 # include <X11/Xutil.h>
+# include <X11/Xatom.h>
 # include <X11/extensions/xf86vmode.h>
 # include <X11/extensions/Xrandr.h>
+# include <X11/extensions/XShm.h>
+# include <sys/ipc.h>
+# include <sys/shm.h>
 # ifdef FGLRX
 #  include <fglrx_gamma.h>
 # endif
@@ -63,10 +88,22 @@
 #endif
 
 #include <math.h>
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
 
 /* the 4-byte marker for the vcgt-Tag */
 #define VCGT_TAG     0x76636774L
 #define MLUT_TAG     0x6d4c5554L
+/* Microsoft's calibration tag "MHC2" and the "sf32" type of its LUTs */
+#define MHC2_TAG     0x4d484332L
+#define SF32_TYPE    0x73663332L
+/* the other tags of a -snapshot profile */
+#define DESC_TAG     0x64657363L
+#define CPRT_TAG     0x63707274L
+#define WTPT_TAG     0x77747074L
+#define TEXT_TYPE    0x74657874L
+#define XYZ_TYPE     0x58595a20L
 
 #ifndef XCALIB_VERSION
 # define XCALIB_VERSION "version unknown (>0.5)"
@@ -77,6 +114,75 @@
 # define MAX_TABLE_SIZE   2e10
 #endif
 
+/* entries per channel of the ramp fingerprints in a profile index */
+#define FINGERPRINT_SIZE  32
+/* the 4-byte marker of profile index files ("XCFI") */
+#define INDEX_MAGIC       0x58434649L
+/* number of nearest profiles reported by -match */
+#define MATCH_RESULTS     5
+/* largest ramp size accepted from files and outputs */
+#define MAX_RAMP_SIZE     65536
+/* the 4-byte marker of compact ramp files ("XCRK") */
+#define KNOTS_MAGIC       0x5843524bL
+/* default for the largest deviation of compact ramp files */
+#define KNOTS_MAX_ERROR   16
+/* the 4-byte marker of apply lock files ("XCLK") */
+#define LOCK_MAGIC        0x58434c4bL
+/* number of queued instances an apply lock file keeps track of */
+#define LOCK_SLOTS        256
+/* image rows per work item of the software LUT */
+#define IMAGE_TILE_ROWS   32
+/* upper limit of worker threads for images */
+#define MAX_THREADS       64
+/* default frame rate of -capture */
+#define CAPTURE_FPS       10.0
+/* poll interval of the -ambient light source in milliseconds */
+#define AMBIENT_INTERVAL  1000
+/* time constant of the light level smoothing in seconds */
+#define AMBIENT_SMOOTHING 5.0
+/* minimum time between two uploads caused by light changes */
+#define AMBIENT_MIN_GAP   2.0
+/* brightness or contrast change in percent that causes an upload */
+#define AMBIENT_STEP      0.5
+/* number of gamma sizes -watch keeps rendered ramps for */
+#define WATCH_SIZES       8
+/* exit status when -timeout ends xcalib, like timeout(1) */
+#define DEADLINE_STATUS   124
+/* where -lowmem keeps ramps shared between sessions */
+#ifndef RAMP_STORE_DIR
+# define RAMP_STORE_DIR   "/dev/shm"
+#endif
+/* largest number of -preset banks */
+#define PRESET_BANKS      8
+/* largest number of points of an -ambientcurve */
+#define AMBIENT_POINTS    16
+/* magic number of -auditlog records, "XCAU" */
+#define AUDIT_MAGIC       0x58434155
+/* flags of an audit record */
+#define AUDIT_CLEAR       0x01
+#define AUDIT_ALTER       0x02
+#define AUDIT_INVERT      0x04
+#define AUDIT_AMBIENT     0x08
+#define AUDIT_WATCH       0x10
+#define AUDIT_PRESET      0x20
+/* number of largest differences listed per channel by -compare */
+#define WORST_ENTRIES     3
+/* largest number of LUT entries per channel of an MHC2 tag */
+#define MHC2_MAX_ENTRIES  4096
+/* log records kept in memory and their largest text */
+#define LOG_RING          256
+#define LOG_TEXT          192
+/* warnings of one kind printed per second, the rest is counted */
+#define LOG_BURST         10
+/* kinds of warnings rate limited separately */
+#define LOG_TYPES         64
+/* sleep of the background log writer in milliseconds */
+#define LOG_INTERVAL      20
+
+/* parameters of the 64-bit FNV-1a hash over ramp values */
+#define FNV_OFFSET        0xcbf29ce484222325ULL
+#define FNV_PRIME         0x100000001b3ULL
+
 #ifdef _WIN32
 # define u_int16_t  WORD
 #endif
@@ -93,6 +199,10 @@ void error (char *fmt, ...), warning (char *fmt, ...), message(char *fmt, ...);
 # define BE_INT(a)    (a)
 # define BE_SHORT(a)  (a)
 #endif
+/* stores are byte wise and work on any host */
+#define SET_BE_INT(a,v)   ((a)[0]=((v)>>24)&0xff, (a)[1]=((v)>>16)&0xff, \
+                           (a)[2]=((v)>>8)&0xff, (a)[3]=(v)&0xff)
+#define SET_BE_SHORT(a,v) ((a)[0]=((v)>>8)&0xff, (a)[1]=(v)&0xff)
 
 /* internal state struct */
 struct xcalib_state_t {
@@ -109,6 +219,138 @@ struct xcalib_state_t {
   float gamma_cor;
 } xcalib_state = {0, 1.0, 0.0, 1.0, 1.0, 0.0, 1.0, 1.0, 0.0, 1.0, 1.0};
 
+/* properties of one channel of a gamma ramp */
+struct ramp_stats_t {
+  float brightness;
+  float contrast;
+  float min;
+  float max;
+  int increasing;
+};
+
+/* piecewise linear approximation of the three channels of a ramp */
+struct ramp_knots_t {
+  unsigned int size;        /* size of the encoded ramp */
+  unsigned int maxError;    /* largest deviation in 16-bit code values */
+  unsigned int count[3];    /* knots per channel */
+  u_int16_t * x[3];         /* knot positions in the encoded ramp */
+  u_int16_t * y[3];         /* knot values */
+};
+
+/* shared state of all instances applying to one display, see -lock */
+struct apply_lock_t {
+  unsigned int magic;
+  unsigned int next_ticket;         /* ticket of the next arriving instance */
+  unsigned int serving;             /* ticket which may apply now */
+  pid_t pid[LOCK_SLOTS];            /* owner of each queued ticket */
+  unsigned long long key;           /* request key of the last finished apply */
+  unsigned long long finished;      /* when it finished, from now_ns() */
+  int status;                       /* and its exit status */
+};
+
+/* a PPM or PAM image mapped into memory, see -applyimage */
+struct image_t {
+  unsigned char * src;      /* first sample of the source */
+  unsigned char * dst;      /* first sample of the destination */
+  unsigned int width;
+  unsigned int height;
+  unsigned int depth;       /* samples per pixel, the first three are RGB */
+  unsigned int maxval;
+  unsigned int bytes;       /* bytes per sample, 1 or 2 (big endian) */
+  void * lut[3];            /* maxval+1 entries per channel */
+  unsigned int next_tile;   /* next row band to process, taken atomically */
+};
+
+/* a point of the illuminance to brightness/contrast mapping */
+struct ambient_point_t {
+  float lux;
+  float brightness;         /* percent, like -brightness */
+  float contrast;           /* percent, like -contrast */
+};
+
+/* one fixed size record of the -auditlog file, 128 bytes; records
+ * are appended in time order, so the file is its own time index */
+struct audit_record_t {
+  unsigned int magic;
+  unsigned int size;                /* ramp entries, 0 for -clear */
+  unsigned long long time;          /* nanoseconds since the epoch, UTC */
+  unsigned long long profile_hash;  /* FNV-1a of the profile file, 0 without */
+  unsigned long long ramp_hash;     /* FNV-1a of the uploaded ramps, as -inventory */
+  char display[40];
+  int screen;
+  int output;                       /* XRandR output, -1 for the whole screen */
+  float gamma[3];                   /* per channel, -gammacor included */
+  float min[3];                     /* brightness as fraction */
+  float max[3];                     /* contrast end point as fraction */
+  unsigned int flags;               /* AUDIT_* */
+  unsigned int reserved;
+};
+
+#ifndef _WIN32
+/* phases of the startup path with a budget of their own, see -timeout */
+static const char * deadline_phases[] = {
+  "lock", "connect", "setup", "discovery", "parse", "upload"
+};
+#define DEADLINE_PHASES   (int)(sizeof(deadline_phases) / sizeof(deadline_phases[0]))
+
+/* -timeout and -phasetimeout */
+struct deadline_t {
+  int armed;
+  unsigned long long end;           /* of the whole run from now_ns(), 0 for none */
+  int budget[DEADLINE_PHASES];      /* ms per phase, 0 for none */
+  const char * volatile phase;      /* the phase running now */
+} deadline = { 0 };
+#endif
+
+/* the open -auditlog and the fields common to all its records */
+struct audit_log_t {
+  FILE * fp;
+  struct audit_record_t record;
+} audit_log = { NULL };
+
+/* a ramp operand of -compare: profile, -printramps dump or live output */
+enum { SOURCE_PROFILE, SOURCE_TEXT, SOURCE_OUTPUT, SOURCE_KNOTS };
+struct ramp_source_t {
+  const char * name;
+  int kind;
+  unsigned int size;    /* native size, 0 if the source can render any size */
+  u_int16_t * ramp;     /* size red, then green, then blue entries */
+  struct ramp_knots_t * knots;
+};
+
+/* differences of one channel between two ramps */
+struct ramp_diff_t {
+  unsigned int max;
+  double rms;
+  unsigned int p50, p95, p99;
+  unsigned int worst[WORST_ENTRIES];
+};
+
+/* three channel ramps in the layout of a backend: entry i of channel c
+ * is at channel[c][i * stride] and holds the top "bits" bits of the
+ * 16-bit value. Planar arrays have stride 1, an interleaved r/g/b/pad
+ * table like drm_color_lut has stride 4. */
+struct ramp_view_t {
+  u_int16_t * channel[3];
+  int stride;
+  int bits;
+  unsigned int size;
+};
+
+/* matrix and luminance range of the MHC2 tag of the profile parsed
+ * last by this thread, -map parses on several; the matrix has an
+ * offset column */
+struct mhc2_t {
+  int found;
+  double matrix[3][4];
+  double minLuminance, peakLuminance;
+};
+#ifdef _WIN32
+__declspec(thread) struct mhc2_t mhc2 = { 0 };
+#else
+__thread struct mhc2_t mhc2 = { 0 };
+#endif
+
 
 void
 usage (void)
@@ -145,6 +387,38 @@ usage (void)
   fprintf (stdout, "    -blue <gamma> <brightness-percent> <contrast-percent>\n");
 #ifndef FGLRX
   fprintf (stdout, "    -alter                  or -a\n");
+#endif
+  fprintf (stdout, "    -buildindex <index-file> <profile-dir>\n");
+  fprintf (stdout, "    -match <index-file>\n");
+#ifndef _WIN32
+  fprintf (stdout, "    -lock\n");
+  fprintf (stdout, "    -detach <status-file>\n");
+  fprintf (stdout, "    -publish\n");
+  fprintf (stdout, "    -timeout <ms>\n");
+  fprintf (stdout, "    -phasetimeout <lock|connect|setup|discovery|parse|upload> <ms>\n");
+  fprintf (stdout, "    -applyimage <ppm-file>\n");
+  fprintf (stdout, "    -imageout <ppm-file>\n");
+#ifndef FGLRX
+  fprintf (stdout, "    -ambient <illuminance-file>\n");
+  fprintf (stdout, "    -ambientcurve <lux:brightness:contrast,...>\n");
+  fprintf (stdout, "    -ambientinterval <ms>\n");
+  fprintf (stdout, "    -watch\n");
+  fprintf (stdout, "    -preset <name> <profile>[,<profile>...]\n");
+  fprintf (stdout, "    -map <profile>[,<profile>...]\n");
+  fprintf (stdout, "    -lowmem\n");
+#endif
+  fprintf (stdout, "    -capture <frames>\n");
+  fprintf (stdout, "    -framerate <fps>\n");
+#endif
+  fprintf (stdout, "    -saveramps <file>\n");
+  fprintf (stdout, "    -snapshot <icc-file>\n");
+  fprintf (stdout, "    -maxerror <code-values>\n");
+  fprintf (stdout, "    -auditlog <file>\n");
+  fprintf (stdout, "    -auditquery <file> <from> <to>\n");
+  fprintf (stdout, "    -compare <source> <source>\n");
+  fprintf (stdout, "    -comparelist <list-file>\n");
+#ifndef _WIN32
+  fprintf (stdout, "    -inventory\n");
 #endif
   fprintf (stdout, "    -help                   or -h\n");
   fprintf (stdout, "    -version\n");
@@ -227,7 +501,7 @@ float        LinInterpolateRampU16   ( unsigned short    * ramp,
   if(pos < 0)
     return ramp[0];
     
-  if(pos > ramp_size-1)
+  if(pos >= ramp_size-1)
     return ramp[ramp_size-1];
   
   dist = modff( pos, &start );
@@ -242,11 +516,319 @@ float        LinInterpolateRampU16   ( unsigned short    * ramp,
 }
 
 
+/* where an upsampled entry falls between two entries of the source */
+struct resample_step_t {
+  unsigned int start;
+  float dist;
+};
+
+/* a ramp resampler chosen once for a pair of sizes and used for all
+ * channels */
+struct resample_t {
+  unsigned int from, to;
+  struct resample_step_t * steps;   /* upsampling kernels only */
+  void (*kernel)(const struct resample_t * rs, const u_int16_t * src, u_int16_t * dst);
+};
+
 /*
- * FUNCTION read_vcgt_internal
+ * FUNCTION resample_generic
+ *
+ * subsample or linearly interpolate one channel of any size; the
+ * position of every entry is computed again per channel. Upsampling
+ * reads the extrapolated entry src[from].
+ */
+void
+resample_generic(const struct resample_t * rs, const u_int16_t * src, u_int16_t * dst)
+{
+  unsigned int ratio, j;
+
+  if(rs->from >= rs->to)
+  {
+    ratio = rs->from / rs->to;
+    for(j=0; j<rs->to; j++)
+      dst[j] = src[ratio*j];
+    return;
+  }
+  /* all entries, also when the sizes are no multiples */
+  for(j=0; j<rs->to; j++)
+    dst[j] = (int)LinInterpolateRampU16((unsigned short *)src, rs->from,
+                                        j*(double)(rs->from-1)/(double)(rs->to-1));
+}
+
+/*
+ * FUNCTION resample_fixed
+ *
+ * resampling with the sizes known at compile time; interpolation
+ * uses the positions computed once by resample_select and gives the
+ * same values as resample_generic
+ */
+static inline void
+resample_fixed(const struct resample_t * rs, const u_int16_t * src, u_int16_t * dst,
+               const unsigned int from, const unsigned int to)
+{
+  unsigned int k;
+  float result;
+
+  if(from >= to)
+  {
+    for(k=0; k<to; k++)
+      dst[k] = src[(from/to)*k];
+    return;
+  }
+  for(k=0; k<to; k++)
+  {
+    const struct resample_step_t * step = rs->steps + k;
+    result = src[step->start+1] - src[step->start];
+    result *= step->dist;
+    result += src[step->start];
+    dst[k] = (int)result;
+  }
+}
+
+void
+resample_256_256(const struct resample_t * rs, const u_int16_t * src, u_int16_t * dst)
+{
+  resample_fixed(rs, src, dst, 256, 256);
+}
+
+void
+resample_1024_1024(const struct resample_t * rs, const u_int16_t * src, u_int16_t * dst)
+{
+  resample_fixed(rs, src, dst, 1024, 1024);
+}
+
+void
+resample_4096_4096(const struct resample_t * rs, const u_int16_t * src, u_int16_t * dst)
+{
+  resample_fixed(rs, src, dst, 4096, 4096);
+}
+
+void
+resample_256_1024(const struct resample_t * rs, const u_int16_t * src, u_int16_t * dst)
+{
+  resample_fixed(rs, src, dst, 256, 1024);
+}
+
+void
+resample_256_4096(const struct resample_t * rs, const u_int16_t * src, u_int16_t * dst)
+{
+  resample_fixed(rs, src, dst, 256, 4096);
+}
+
+/*
+ * FUNCTION resample_select
+ *
+ * choose the kernel for resampling from one size to another: one
+ * specialized for the common hardware sizes 256, 1024 and 4096 and
+ * upsampling 256 to 1024 or 4096, else the generic one
+ *
+ * returns 1 if a specialized kernel was chosen
+ */
+int
+resample_select(struct resample_t * rs, unsigned int from, unsigned int to)
+{
+  static const struct {
+    unsigned int from, to;
+    void (*kernel)(const struct resample_t *, const u_int16_t *, u_int16_t *);
+  } kernels[] = {
+    { 256, 256, resample_256_256 },
+    { 1024, 1024, resample_1024_1024 },
+    { 4096, 4096, resample_4096_4096 },
+    { 256, 1024, resample_256_1024 },
+    { 256, 4096, resample_256_4096 },
+  };
+  unsigned int k, n;
+  float pos;
+
+  rs->from = from;
+  rs->to = to;
+  rs->steps = NULL;
+  rs->kernel = resample_generic;
+  for(n=0; n<sizeof(kernels) / sizeof(kernels[0]); n++)
+    if(kernels[n].from == from && kernels[n].to == to)
+      break;
+  if(n == sizeof(kernels) / sizeof(kernels[0]))
+    return 0;
+  if(from < to)
+  {
+    if((rs->steps = (struct resample_step_t *) malloc(to * sizeof(struct resample_step_t))) == NULL)
+      return 0;
+    /* the same positions LinInterpolateRampU16 is given */
+    for(k=0; k<to; k++)
+    {
+      pos = k*(double)(from-1)/(double)(to-1);
+      if(pos >= from-1)
+      {
+        rs->steps[k].start = from-1;
+        rs->steps[k].dist = 0.0;
+        continue;
+      }
+      /* pos - trunc(pos) is exact, like modff */
+      rs->steps[k].start = (int)pos;
+      rs->steps[k].dist = pos - (float)rs->steps[k].start;
+    }
+  }
+  rs->kernel = kernels[n].kernel;
+  return 1;
+}
+
+/*
+ * FUNCTION resample_release
+ */
+void
+resample_release(struct resample_t * rs)
+{
+  free(rs->steps);
+  rs->steps = NULL;
+}
+
+/*
+ * FUNCTION read_s15fixed16
+ */
+double
+read_s15fixed16(const unsigned char * p)
+{
+  return (int)((unsigned int)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]) / 65536.0;
+}
+
+/*
+ * FUNCTION decode_s15fixed16
+ *
+ * convert big endian s15Fixed16 values of 0.0 to 1.0 to ramp entries,
+ * values outside are clamped. x * 65535 / 65536 is rounded as
+ * x - (x + 0.5) / 65536. With SSE2 eight values are done per step:
+ * the bytes are swapped by exchanging the 16-bit halves and then the
+ * bytes in them, and the 32-bit results are packed with signed
+ * saturation after moving them into the signed range.
+ */
+void
+decode_s15fixed16(const unsigned char * data, u_int16_t * ramp, unsigned int nEntries)
+{
+  unsigned int j = 0;
+  int x;
+#ifdef __SSE2__
+  __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi32(65536);
+  __m128i half = _mm_set1_epi32(32768), sign = _mm_set1_epi16((short)0x8000);
+  __m128i v[2], over;
+  int k;
+
+  for(; j + 8 <= nEntries; j += 8)
+  {
+    for(k = 0; k < 2; k++)
+    {
+      v[k] = _mm_loadu_si128((__m128i *)(data + 4*j + 16*k));
+      v[k] = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v[k], 0xb1), 0xb1);
+      v[k] = _mm_or_si128(_mm_slli_epi16(v[k], 8), _mm_srli_epi16(v[k], 8));
+      v[k] = _mm_andnot_si128(_mm_cmpgt_epi32(zero, v[k]), v[k]);
+      over = _mm_cmpgt_epi32(v[k], one);
+      v[k] = _mm_or_si128(_mm_andnot_si128(over, v[k]), _mm_and_si128(over, one));
+      v[k] = _mm_sub_epi32(v[k], _mm_srli_epi32(_mm_add_epi32(v[k], half), 16));
+      v[k] = _mm_sub_epi32(v[k], half);
+    }
+    _mm_storeu_si128((__m128i *)(ramp + j),
+                     _mm_xor_si128(_mm_packs_epi32(v[0], v[1]), sign));
+  }
+#endif
+  for(; j < nEntries; j++)
+  {
+    x = (int)((unsigned int)data[4*j] << 24 | data[4*j+1] << 16 | data[4*j+2] << 8 | data[4*j+3]);
+    if(x < 0)
+      x = 0;
+    if(x > 65536)
+      x = 65536;
+    ramp[j] = x - ((x + 32768) >> 16);
+  }
+}
+
+/*
+ * FUNCTION read_mhc2
+ *
+ * decode the regamma LUTs of an MHC2 tag into the ramps and keep its
+ * matrix and luminance range in mhc2
+ *
+ * returns 1 on success, 0 for an invalid tag
+ */
+int
+read_mhc2(FILE * fp, unsigned int tagOffset, unsigned int tagSize,
+          u_int16_t * rRamp, u_int16_t * gRamp, u_int16_t * bRamp,
+          unsigned int nEntries)
+{
+  u_int16_t * ramps[3];
+  u_int16_t * lut = NULL;
+  unsigned char * tag;
+  unsigned int numEntries, offset, r, c;
+  struct resample_t resample;
+  int retVal = 0;
+
+  ramps[0] = rRamp;
+  ramps[1] = gRamp;
+  ramps[2] = bRamp;
+  if(tagSize < 36 || tagSize > 36 + 48 + 3 * (8 + 4 * MHC2_MAX_ENTRIES) + 64 ||
+     (tag = (unsigned char *) malloc(tagSize)) == NULL)
+    return 0;
+  if(fseek(fp, tagOffset, SEEK_SET) || fread(tag, 1, tagSize, fp) != tagSize ||
+     BE_INT(tag) != MHC2_TAG)
+    goto done;
+
+  numEntries = BE_INT(tag + 8);
+  if(numEntries < 2 || numEntries > MHC2_MAX_ENTRIES)
+  {
+    warning("MHC2 with %u entries per channel", numEntries);
+    goto done;
+  }
+  mhc2.minLuminance = read_s15fixed16(tag + 12);
+  mhc2.peakLuminance = read_s15fixed16(tag + 16);
+  message ("MHC2 found\n");
+  message ("entries/channel: \t%d\n", numEntries);
+  message ("luminance:       \t%g - %g cd/m2\n", mhc2.minLuminance, mhc2.peakLuminance);
+
+  /* identity unless the tag has a matrix */
+  memset(mhc2.matrix, 0, sizeof(mhc2.matrix));
+  for(r = 0; r < 3; r++)
+    mhc2.matrix[r][r] = 1.0;
+  offset = BE_INT(tag + 20);
+  if(offset && tagSize >= 48 && offset <= tagSize - 48)
+    for(r = 0; r < 3; r++)
+    {
+      for(c = 0; c < 4; c++)
+        mhc2.matrix[r][c] = read_s15fixed16(tag + offset + 16*r + 4*c);
+      message ("matrix:          \t%f %f %f  %f\n", mhc2.matrix[r][0],
+               mhc2.matrix[r][1], mhc2.matrix[r][2], mhc2.matrix[r][3]);
+    }
+
+  /* one entry more for the interpolation of the resampler */
+  if((lut = (u_int16_t *) malloc((numEntries + 1) * sizeof(u_int16_t))) == NULL)
+    goto done;
+  resample_select(&resample, numEntries, nEntries);
+  for(c = 0; c < 3; c++)
+  {
+    offset = BE_INT(tag + 24 + 4*c);
+    if(offset > tagSize || tagSize - offset < 8 + 4 * numEntries ||
+       BE_INT(tag + offset) != SF32_TYPE)
+    {
+      warning("invalid LUT %d in MHC2", c);
+      break;
+    }
+    decode_s15fixed16(tag + offset + 8, lut, numEntries);
+    lut[numEntries] = lut[numEntries - 1];
+    resample.kernel(&resample, lut, ramps[c]);
+  }
+  resample_release(&resample);
+  if(c == 3)
+    retVal = mhc2.found = 1;
+
+done:
+  free(lut);
+  free(tag);
+  return retVal;
+}
+
+/*
+ * FUNCTION read_vcgt_stream
  *
  * this is a parser for the vcgt tag of ICC profiles which tries to
- * resemble most of the functionality of Graeme Gill's icclib.
+ * resemble most of the functionality of Graeme Gill's icclib. The
+ * profile is read from an open stream, filename is for messages.
  *
  * returns
  * -1: file could not be read
@@ -254,10 +836,9 @@ float        LinInterpolateRampU16   ( unsigned short    * ramp,
  * 1: success
  */
 int
-read_vcgt_internal(const char * filename, u_int16_t * rRamp, u_int16_t * gRamp,
+read_vcgt_stream(FILE * fp, const char * filename, u_int16_t * rRamp, u_int16_t * gRamp,
 		       u_int16_t * bRamp, unsigned int nEntries)
 {
-  FILE * fp;
   unsigned int bytesRead;
   unsigned int numTags=0;
   unsigned int tagName=0;
@@ -281,13 +862,13 @@ read_vcgt_internal(const char * filename, u_int16_t * rRamp, u_int16_t * gRamp,
   unsigned int numEntries=0;
   unsigned int entrySize=0;
   int j=0;
+  /* grey balanced: one channel is computed and copied to the others */
+  int shared=0;
+  struct resample_t resample;
+  /* taken if there is neither vcgt nor MLUT */
+  unsigned int mhc2Offset=0, mhc2Size=0;
 
-  if(filename) {
-    fp = fopen(filename, "rb");
-    if(!fp)
-      return -1; /* file can not be opened */
-  } else
-    return -1; /* filename char pointer not valid */
+  mhc2.found = 0;
   /* skip header */
   if(fseek(fp, 0+128, SEEK_SET))
     return  -1;
@@ -303,6 +884,11 @@ read_vcgt_internal(const char * filename, u_int16_t * rRamp, u_int16_t * gRamp,
     tagSize = BE_INT(cTmp);
     if(!bytesRead)
       break;
+    if(tagName == MHC2_TAG)
+    {
+      mhc2Offset = tagOffset;
+      mhc2Size = tagSize;
+    }
     if(tagName == MLUT_TAG)
     {
       if(fseek(fp, 0+tagOffset, SEEK_SET))
@@ -406,6 +992,8 @@ read_vcgt_internal(const char * filename, u_int16_t * rRamp, u_int16_t * gRamp,
         message("Red:   Gamma %f \tMin %f \tMax %f\n", rGamma, rMin, rMax);
         message("Green: Gamma %f \tMin %f \tMax %f\n", gGamma, gMin, gMax);
         message("Blue:  Gamma %f \tMin %f \tMax %f\n", bGamma, bMin, bMax);
+        shared = rGamma == gGamma && rGamma == bGamma && rMin == gMin && rMin == bMin &&
+                 rMax == gMax && rMax == bMax;
 
         for(j=0; j<nEntries; j++)
         {
@@ -413,6 +1001,8 @@ read_vcgt_internal(const char * filename, u_int16_t * rRamp, u_int16_t * gRamp,
             ((double) pow ((double) j / (double) (nEntries),
                            rGamma * (double) xcalib_state.gamma_cor 
                           ) * (rMax - rMin) + rMin);
+          if(shared)
+            continue;
           gRamp[j] = 65536.0 *
             ((double) pow ((double) j / (double) (nEntries),
                            gGamma * (double) xcalib_state.gamma_cor
@@ -521,17 +1111,14 @@ read_vcgt_internal(const char * filename, u_int16_t * rRamp, u_int16_t * gRamp,
           break;
         }
         
-        if(numEntries >= nEntries) {
-          /* simply subsample if the LUT is smaller than the number of entries in the file */
-          ratio = (unsigned int)(numEntries / (nEntries));
-          for(j=0; j<nEntries; j++) {
-            rRamp[j] = redRamp[ratio*j];
-            gRamp[j] = greenRamp[ratio*j];
-            bRamp[j] = blueRamp[ratio*j];
-          }
-        }
-        else {
-          ratio = (unsigned int)(nEntries / numEntries);
+        shared = !memcmp(redRamp, greenRamp, numEntries * sizeof(u_int16_t)) &&
+                 !memcmp(redRamp, blueRamp, numEntries * sizeof(u_int16_t));
+        if(shared)
+          message ("identical channels\n");
+
+        /* simply subsample if the LUT is smaller than the number of
+         * entries in the file, else interpolate */
+        if(numEntries < nEntries) {
           /* add extrapolated upper limit to the arrays - handle overflow */
           redRamp[numEntries] = (redRamp[numEntries-1] + (redRamp[numEntries-1] - redRamp[numEntries-2])) & 0xffff;
           if(redRamp[numEntries] < 0x4000)
@@ -544,16 +1131,15 @@ read_vcgt_internal(const char * filename, u_int16_t * rRamp, u_int16_t * gRamp,
           blueRamp[numEntries] = (blueRamp[numEntries-1] + (blueRamp[numEntries-1] - blueRamp[numEntries-2])) & 0xffff;
           if(blueRamp[numEntries] < 0x4000)
             blueRamp[numEntries] = 0xffff;
-         
-          for(j=0; j<numEntries; j++) {
-            for(i=0; i<ratio; i++)
-            {
-              rRamp[j*ratio+i] = (int)LinInterpolateRampU16( redRamp, numEntries, (j*ratio+i)*(double)(numEntries-1)/(double)(nEntries-1));
-              gRamp[j*ratio+i] = (int)LinInterpolateRampU16( greenRamp, numEntries, (j*ratio+i)*(double)(numEntries-1)/(double)(nEntries-1));
-              bRamp[j*ratio+i] = (int)LinInterpolateRampU16( blueRamp, numEntries, (j*ratio+i)*(double)(numEntries-1)/(double)(nEntries-1));
-            }
-          }
         }
+        resample_select(&resample, numEntries, nEntries);
+        resample.kernel(&resample, redRamp, rRamp);
+        if(!shared)
+        {
+          resample.kernel(&resample, greenRamp, gRamp);
+          resample.kernel(&resample, blueRamp, bRamp);
+        }
+        resample_release(&resample);
         free(redRamp);
         free(greenRamp);
         free(blueRamp);
@@ -562,10 +1148,4265 @@ read_vcgt_internal(const char * filename, u_int16_t * rRamp, u_int16_t * gRamp,
       break;
     } /* for all tags */
   }
-  fclose(fp);
-  return retVal;
+  if(retVal == 0 && mhc2Size)
+    retVal = read_mhc2(fp, mhc2Offset, mhc2Size, rRamp, gRamp, bRamp, nEntries);
+  if(shared && retVal == 1 && gRamp != rRamp)
+  {
+    memcpy(gRamp, rRamp, nEntries * sizeof(u_int16_t));
+    memcpy(bRamp, rRamp, nEntries * sizeof(u_int16_t));
+  }
+  return retVal;
+}
+
+/*
+ * FUNCTION read_vcgt_internal
+ *
+ * parse the vcgt or MLUT tag of a profile file, see read_vcgt_stream
+ */
+int
+read_vcgt_internal(const char * filename, u_int16_t * rRamp, u_int16_t * gRamp,
+		       u_int16_t * bRamp, unsigned int nEntries)
+{
+  FILE * fp;
+  int retVal;
+
+  if(!filename)
+    return -1; /* filename char pointer not valid */
+  if((fp = fopen(filename, "rb")) == NULL)
+    return -1; /* file can not be opened */
+  retVal = read_vcgt_stream(fp, filename, rRamp, gRamp, bRamp, nEntries);
+  fclose(fp);
+  return retVal;
+}
+
+#ifndef _WIN32
+/*
+ * FUNCTION load_profile
+ *
+ * read a whole profile into memory
+ *
+ * returns the bytes, to be freed, or NULL if it can't be read
+ */
+unsigned char *
+load_profile(const char * filename, size_t * length)
+{
+  unsigned char * data;
+  struct stat st;
+  FILE * fp;
+
+  if((fp = fopen(filename, "rb")) == NULL)
+    return NULL;
+  if(fstat(fileno(fp), &st) < 0 || st.st_size < 132 ||
+     (data = (unsigned char *) malloc(st.st_size)) == NULL)
+  {
+    fclose(fp);
+    return NULL;
+  }
+  if(fread(data, 1, st.st_size, fp) != (size_t)st.st_size)
+  {
+    free(data);
+    data = NULL;
+  }
+  fclose(fp);
+  *length = st.st_size;
+  return data;
+}
+
+/*
+ * FUNCTION read_vcgt_memory
+ *
+ * parse the vcgt or MLUT tag of a profile loaded with load_profile
+ */
+int
+read_vcgt_memory(unsigned char * data, size_t length, const char * filename,
+                 u_int16_t * rRamp, u_int16_t * gRamp, u_int16_t * bRamp,
+                 unsigned int nEntries)
+{
+  FILE * fp;
+  int retVal;
+
+  if((fp = fmemopen(data, length, "rb")) == NULL)
+    return -1;
+  retVal = read_vcgt_stream(fp, filename, rRamp, gRamp, bRamp, nEntries);
+  fclose(fp);
+  return retVal;
+}
+#endif
+
+/*
+ * FUNCTION apply_correction
+ *
+ * apply the gamma, brightness and contrast settings of a state,
+ * normally xcalib_state, to the ramps. Three channels given as one
+ * buffer share it and the red settings and are corrected once.
+ */
+void
+apply_correction(const struct xcalib_state_t * state, u_int16_t * rRamp,
+                 u_int16_t * gRamp, u_int16_t * bRamp, unsigned int nEntries)
+{
+  unsigned int i;
+
+  for(i=0; i<nEntries; i++)
+  {
+    rRamp[i] =  65536.0 * (((double) pow (((double) rRamp[i]/65536.0),
+                              state->redGamma * (double) state->gamma_cor
+                ) * (state->redMax - state->redMin)) + state->redMin);
+    if(gRamp == rRamp)
+      continue;
+    gRamp[i] =  65536.0 * (((double) pow (((double) gRamp[i]/65536.0),
+                              state->greenGamma * (double) state->gamma_cor
+                ) * (state->greenMax - state->greenMin)) + state->greenMin);
+    bRamp[i] =  65536.0 * (((double) pow (((double) bRamp[i]/65536.0),
+                              state->blueGamma * (double) state->gamma_cor
+                ) * (state->blueMax - state->blueMin)) + state->blueMin); 
+  }
+}
+
+/*
+ * FUNCTION invert_ramps
+ *
+ * reverse the order of the entries of all ramps; three channels given
+ * as one buffer are reversed once
+ */
+void
+invert_ramps(u_int16_t * rRamp, u_int16_t * gRamp, u_int16_t * bRamp,
+             unsigned int nEntries)
+{
+  unsigned int i;
+  u_int16_t tmpRampVal;
+
+  for (i = 0; i < nEntries / 2; i++) {
+    tmpRampVal = rRamp[i];
+    rRamp[i] = rRamp[nEntries - i - 1];
+    rRamp[nEntries - i - 1] = tmpRampVal;
+    if(gRamp == rRamp)
+      continue;
+    tmpRampVal = gRamp[i];
+    gRamp[i] = gRamp[nEntries - i - 1];
+    gRamp[nEntries - i - 1] = tmpRampVal;
+    tmpRampVal = bRamp[i];
+    bRamp[i] = bRamp[nEntries - i - 1];
+    bRamp[nEntries - i - 1] = tmpRampVal;
+  }
+}
+
+/*
+ * FUNCTION free_ramps
+ *
+ * free three ramps which may share one buffer
+ */
+void
+free_ramps(u_int16_t * rRamp, u_int16_t * gRamp, u_int16_t * bRamp)
+{
+  free(rRamp);
+  if(gRamp != rRamp)
+  {
+    free(gRamp);
+    free(bRamp);
+  }
+}
+
+/*
+ * FUNCTION ramp_view_planar
+ *
+ * describe three separate arrays of the given depth
+ */
+struct ramp_view_t
+ramp_view_planar(u_int16_t * rRamp, u_int16_t * gRamp, u_int16_t * bRamp,
+                 unsigned int nEntries, int bits)
+{
+  struct ramp_view_t view;
+
+  view.channel[0] = rRamp;
+  view.channel[1] = gRamp;
+  view.channel[2] = bRamp;
+  view.stride = 1;
+  view.bits = bits;
+  view.size = nEntries;
+  return view;
+}
+
+/*
+ * FUNCTION ramp_view_interleaved
+ *
+ * describe one table of nEntries records of stride values, red,
+ * green and blue first
+ */
+struct ramp_view_t
+ramp_view_interleaved(u_int16_t * table, unsigned int nEntries, int stride, int bits)
+{
+  struct ramp_view_t view;
+
+  view.channel[0] = table;
+  view.channel[1] = table + 1;
+  view.channel[2] = table + 2;
+  view.stride = stride;
+  view.bits = bits;
+  view.size = nEntries;
+  return view;
+}
+
+/*
+ * FUNCTION ramp_copy_channel
+ *
+ * copy one planar channel, shifted right to a smaller or left to a
+ * larger depth
+ */
+void
+ramp_copy_channel(u_int16_t * dst, const u_int16_t * src, unsigned int nEntries, int shift)
+{
+  unsigned int j = 0;
+
+  if(!shift)
+  {
+    if(dst != src)
+      memcpy(dst, src, nEntries * sizeof(u_int16_t));
+    return;
+  }
+#ifdef __SSE2__
+  for(; j + 8 <= nEntries; j += 8)
+  {
+    __m128i v = _mm_loadu_si128((__m128i *)(src + j));
+    v = shift > 0 ? _mm_srli_epi16(v, shift) : _mm_slli_epi16(v, -shift);
+    _mm_storeu_si128((__m128i *)(dst + j), v);
+  }
+#endif
+  for(; j < nEntries; j++)
+    dst[j] = shift > 0 ? src[j] >> shift : src[j] << -shift;
+}
+
+/*
+ * FUNCTION ramp_convert
+ *
+ * convert ramps between two views of the same size in one pass.
+ * Planar to planar copies or shifts per channel, a source whose three
+ * channels share one buffer is converted once and copied. Planar to
+ * and from an interleaved stride 4 table is done eight entries per
+ * step with SSE2 unpacking; the pad value is written as 0. Any other
+ * layout falls back to a loop per entry.
+ *
+ * returns 0 if the sizes differ
+ */
+int
+ramp_convert(const struct ramp_view_t * dst, const struct ramp_view_t * src)
+{
+  int shift = src->bits - dst->bits, c;
+  unsigned int j = 0, n = src->size;
+  int dstPacked = dst->stride == 4 && dst->channel[1] == dst->channel[0] + 1 &&
+                  dst->channel[2] == dst->channel[0] + 2;
+  int srcPacked = src->stride == 4 && src->channel[1] == src->channel[0] + 1 &&
+                  src->channel[2] == src->channel[0] + 2;
+
+  if(dst->size != n)
+    return 0;
+
+  if(src->stride == 1 && dst->stride == 1)
+  {
+    if(src->channel[1] == src->channel[0] && src->channel[2] == src->channel[0])
+    {
+      ramp_copy_channel(dst->channel[0], src->channel[0], n, shift);
+      for(c = 1; c < 3; c++)
+        if(dst->channel[c] != dst->channel[0])
+          memcpy(dst->channel[c], dst->channel[0], n * sizeof(u_int16_t));
+      return 1;
+    }
+    for(c = 0; c < 3; c++)
+      ramp_copy_channel(dst->channel[c], src->channel[c], n, shift);
+    return 1;
+  }
+
+#ifdef __SSE2__
+  if(src->stride == 1 && dstPacked)
+  {
+    u_int16_t * out = dst->channel[0];
+    __m128i zero = _mm_setzero_si128();
+
+    for(; j + 8 <= n; j += 8)
+    {
+      __m128i r = _mm_loadu_si128((__m128i *)(src->channel[0] + j));
+      __m128i g = _mm_loadu_si128((__m128i *)(src->channel[1] + j));
+      __m128i b = _mm_loadu_si128((__m128i *)(src->channel[2] + j));
+      __m128i rgLo, rgHi, bLo, bHi;
+
+      if(shift > 0)
+      {
+        r = _mm_srli_epi16(r, shift);
+        g = _mm_srli_epi16(g, shift);
+        b = _mm_srli_epi16(b, shift);
+      } else if(shift < 0)
+      {
+        r = _mm_slli_epi16(r, -shift);
+        g = _mm_slli_epi16(g, -shift);
+        b = _mm_slli_epi16(b, -shift);
+      }
+      /* r0 g0 r1 g1 ... and b0 0 b1 0 ... give r0 g0 b0 0 r1 g1 b1 0 */
+      rgLo = _mm_unpacklo_epi16(r, g);
+      rgHi = _mm_unpackhi_epi16(r, g);
+      bLo = _mm_unpacklo_epi16(b, zero);
+      bHi = _mm_unpackhi_epi16(b, zero);
+      _mm_storeu_si128((__m128i *)(out + 4*j), _mm_unpacklo_epi32(rgLo, bLo));
+      _mm_storeu_si128((__m128i *)(out + 4*j + 8), _mm_unpackhi_epi32(rgLo, bLo));
+      _mm_storeu_si128((__m128i *)(out + 4*j + 16), _mm_unpacklo_epi32(rgHi, bHi));
+      _mm_storeu_si128((__m128i *)(out + 4*j + 24), _mm_unpackhi_epi32(rgHi, bHi));
+    }
+  }
+  else if(srcPacked && dst->stride == 1)
+  {
+    const u_int16_t * in = src->channel[0];
+
+    for(; j + 8 <= n; j += 8)
+    {
+      __m128i v0 = _mm_loadu_si128((__m128i *)(in + 4*j));
+      __m128i v1 = _mm_loadu_si128((__m128i *)(in + 4*j + 8));
+      __m128i v2 = _mm_loadu_si128((__m128i *)(in + 4*j + 16));
+      __m128i v3 = _mm_loadu_si128((__m128i *)(in + 4*j + 24));
+      /* two rounds of 16-bit unpacking sort four records by channel */
+      __m128i lo0 = _mm_unpacklo_epi16(v0, v1), lo1 = _mm_unpackhi_epi16(v0, v1);
+      __m128i hi0 = _mm_unpacklo_epi16(v2, v3), hi1 = _mm_unpackhi_epi16(v2, v3);
+      __m128i rgLo = _mm_unpacklo_epi16(lo0, lo1), bxLo = _mm_unpackhi_epi16(lo0, lo1);
+      __m128i rgHi = _mm_unpacklo_epi16(hi0, hi1), bxHi = _mm_unpackhi_epi16(hi0, hi1);
+      __m128i v[3];
+
+      v[0] = _mm_unpacklo_epi64(rgLo, rgHi);
+      v[1] = _mm_unpackhi_epi64(rgLo, rgHi);
+      v[2] = _mm_unpacklo_epi64(bxLo, bxHi);
+      for(c = 0; c < 3; c++)
+      {
+        if(shift > 0)
+          v[c] = _mm_srli_epi16(v[c], shift);
+        else if(shift < 0)
+          v[c] = _mm_slli_epi16(v[c], -shift);
+        _mm_storeu_si128((__m128i *)(dst->channel[c] + j), v[c]);
+      }
+    }
+  }
+#else
+  (void) srcPacked;
+#endif
+
+  for(; j < n; j++)
+  {
+    for(c = 0; c < 3; c++)
+    {
+      unsigned int value = src->channel[c][j * src->stride];
+      dst->channel[c][j * dst->stride] = shift > 0 ? value >> shift : value << -shift;
+    }
+    if(dstPacked)
+      dst->channel[0][4*j + 3] = 0;
+  }
+  return 1;
+}
+
+/*
+ * FUNCTION ramp_fingerprint
+ *
+ * downsample the three ramps of any size to FINGERPRINT_SIZE entries
+ * per channel. Sample positions include both end points, so ramps of
+ * different sizes that describe the same curve get close fingerprints.
+ */
+void
+ramp_fingerprint(u_int16_t * rRamp, u_int16_t * gRamp, u_int16_t * bRamp,
+                 unsigned int nEntries, u_int16_t * fingerprint)
+{
+  int j;
+  float pos;
+
+  for(j=0; j<FINGERPRINT_SIZE; j++)
+  {
+    pos = j * (float)(nEntries-1) / (float)(FINGERPRINT_SIZE-1);
+    fingerprint[j] = (int)ROUND(LinInterpolateRampU16(rRamp, nEntries, pos));
+    fingerprint[FINGERPRINT_SIZE+j] = (int)ROUND(LinInterpolateRampU16(gRamp, nEntries, pos));
+    fingerprint[2*FINGERPRINT_SIZE+j] = (int)ROUND(LinInterpolateRampU16(bRamp, nEntries, pos));
+  }
+}
+
+/*
+ * FUNCTION ramp_statistics
+ *
+ * derive brightness, contrast and the end points of one channel the
+ * same way the ramp report of main() does, check if it is increasing
+ * and, if hash is given, continue a 64-bit FNV-1a hash over the
+ * ramp values - all in a single pass over the ramp.
+ */
+void
+ramp_statistics(u_int16_t * ramp, unsigned int nEntries,
+                struct ramp_stats_t * stats, unsigned long long * hash)
+{
+  unsigned int j;
+  unsigned long long h;
+
+  stats->min = (double)ramp[0] / 65535.0;
+  stats->max = (double)ramp[nEntries - 1] / 65535.0;
+  stats->brightness = stats->min * 100.0;
+  /* a ramp starting at white has no range left for contrast */
+  stats->contrast = stats->min < 1.0 ?
+                    (stats->max - stats->min) / (1.0 - stats->min) * 100.0 : 0.0;
+  stats->increasing = 1;
+
+  if(hash)
+  {
+    h = *hash;
+    for(j=0; j<nEntries; j++)
+    {
+      h = (h ^ (ramp[j] & 0xff)) * FNV_PRIME;
+      h = (h ^ (ramp[j] >> 8)) * FNV_PRIME;
+      if(j && ramp[j] < ramp[j-1])
+        stats->increasing = 0;
+    }
+    *hash = h;
+  }
+  else
+    for(j=1; j<nEntries; j++)
+      if(ramp[j] < ramp[j-1])
+        stats->increasing = 0;
+}
+
+/*
+ * FUNCTION build_profile_index
+ *
+ * parse every ICC profile in a directory once and write the
+ * fingerprints of their calibration curves to an index file.
+ * The fingerprints are stored as one contiguous block followed by
+ * the profile paths, so a query only has to scan a few KB per
+ * thousand profiles.
+ *
+ * returns
+ * -1: directory or index file could not be opened
+ * otherwise: number of indexed profiles
+ */
+int
+build_profile_index(const char * indexname, const char * dirname)
+{
+  DIR * dir;
+  struct dirent * entry;
+  FILE * fp;
+  char path[1024];
+  const char * ext;
+  u_int16_t rRamp[256], gRamp[256], bRamp[256];
+  u_int16_t * fingerprints = NULL, * moreFingerprints;
+  char * names = NULL, * moreNames;
+  unsigned int count = 0, allocated = 0, namesLen = 0, namesAllocated = 0;
+  unsigned int header[4];
+  size_t len;
+
+  if((dir = opendir(dirname)) == NULL)
+    return -1;
+
+  while((entry = readdir(dir)) != NULL)
+  {
+    ext = strrchr(entry->d_name, '.');
+    if(!ext || (strcasecmp(ext, ".icc") && strcasecmp(ext, ".icm")))
+      continue;
+    if(snprintf(path, sizeof(path), "%s/%s", dirname, entry->d_name) >= (int)sizeof(path))
+      continue;
+    if(read_vcgt_internal(path, rRamp, gRamp, bRamp, 256) <= 0)
+    {
+      message("skipping '%s': no calibration data\n", path);
+      continue;
+    }
+
+    if(count == allocated)
+    {
+      allocated = allocated ? 2*allocated : 64;
+      if((moreFingerprints = (u_int16_t *) realloc(fingerprints,
+                       allocated * 3 * FINGERPRINT_SIZE * sizeof(u_int16_t))) == NULL)
+        break;
+      fingerprints = moreFingerprints;
+    }
+    ramp_fingerprint(rRamp, gRamp, bRamp, 256,
+                     fingerprints + count * 3 * FINGERPRINT_SIZE);
+
+    len = strlen(path) + 1;
+    if(namesLen + len > namesAllocated)
+    {
+      namesAllocated = 2*(namesLen + len);
+      if((moreNames = (char *) realloc(names, namesAllocated)) == NULL)
+        break;
+      names = moreNames;
+    }
+    memcpy(names + namesLen, path, len);
+    namesLen += len;
+    count++;
+  }
+  closedir(dir);
+
+  /* the loop ends early only without memory */
+  if(entry || (fp = fopen(indexname, "wb")) == NULL)
+  {
+    free(fingerprints);
+    free(names);
+    return -1;
+  }
+  header[0] = INDEX_MAGIC;
+  header[1] = FINGERPRINT_SIZE;
+  header[2] = count;
+  header[3] = namesLen;
+  fwrite(header, sizeof(header), 1, fp);
+  fwrite(fingerprints, 3 * FINGERPRINT_SIZE * sizeof(u_int16_t), count, fp);
+  fwrite(names, 1, namesLen, fp);
+  fclose(fp);
+
+  free(fingerprints);
+  free(names);
+  return count;
+}
+
+/*
+ * FUNCTION match_profile_index
+ *
+ * search the index for the profiles whose fingerprints are nearest
+ * to the given ramps and print the best MATCH_RESULTS of them. The
+ * squared distance is accumulated per channel and a candidate is
+ * dropped as soon as it exceeds the current worst result.
+ *
+ * returns
+ * -1: index file could not be read
+ * otherwise: number of printed matches
+ */
+int
+match_profile_index(const char * indexname, u_int16_t * rRamp,
+                    u_int16_t * gRamp, u_int16_t * bRamp, unsigned int nEntries)
+{
+  FILE * fp;
+  unsigned int header[4];
+  u_int16_t query[3 * FINGERPRINT_SIZE];
+  u_int16_t * fingerprints = NULL, * fingerprint;
+  char * names = NULL;
+  const char ** nameOf = NULL;
+  double bestDist[MATCH_RESULTS];
+  int bestIndex[MATCH_RESULTS];
+  int numBest = 0;
+  double dist, diff;
+  unsigned int n, c, j, offset;
+  long size;
+  int k;
+
+  if((fp = fopen(indexname, "rb")) == NULL)
+    return -1;
+  if(fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) < (long)sizeof(header) ||
+     fseek(fp, 0, SEEK_SET) != 0 ||
+     fread(header, sizeof(header), 1, fp) != 1 ||
+     header[0] != INDEX_MAGIC || header[1] != FINGERPRINT_SIZE)
+  {
+    fclose(fp);
+    return -1;
+  }
+  /* the counts must fit the file before they size anything */
+  size -= sizeof(header);
+  if(header[2] > size / (3 * FINGERPRINT_SIZE * sizeof(u_int16_t)) ||
+     header[3] > size - header[2] * 3 * FINGERPRINT_SIZE * sizeof(u_int16_t))
+  {
+    fclose(fp);
+    return -1;
+  }
+  fingerprints = (u_int16_t *) malloc(header[2] * 3 * FINGERPRINT_SIZE * sizeof(u_int16_t) + 1);
+  names = (char *) malloc(header[3] + 1);
+  nameOf = (const char **) malloc(header[2] * sizeof(char *) + 1);
+  if(!fingerprints || !names || !nameOf ||
+     fread(fingerprints, 3 * FINGERPRINT_SIZE * sizeof(u_int16_t), header[2], fp) != header[2] ||
+     fread(names, 1, header[3], fp) != header[3])
+  {
+    fclose(fp);
+    free(fingerprints);
+    free(names);
+    free(nameOf);
+    return -1;
+  }
+  fclose(fp);
+  names[header[3]] = '\0';
+  for(n=0, offset=0; n<header[2] && offset<header[3]; n++)
+  {
+    nameOf[n] = names + offset;
+    offset += strlen(names + offset) + 1;
+  }
+  header[2] = n;
+
+  ramp_fingerprint(rRamp, gRamp, bRamp, nEntries, query);
+
+  for(n=0; n<header[2]; n++)
+  {
+    fingerprint = fingerprints + n * 3 * FINGERPRINT_SIZE;
+    dist = 0.0;
+    for(c=0; c<3; c++)
+    {
+      for(j=c*FINGERPRINT_SIZE; j<(c+1)*FINGERPRINT_SIZE; j++)
+      {
+        diff = (double)fingerprint[j] - (double)query[j];
+        dist += diff * diff;
+      }
+      if(numBest == MATCH_RESULTS && dist >= bestDist[MATCH_RESULTS-1])
+        break;
+    }
+    if(numBest == MATCH_RESULTS && dist >= bestDist[MATCH_RESULTS-1])
+      continue;
+
+    /* insert into the sorted list of best results */
+    if(numBest < MATCH_RESULTS)
+      numBest++;
+    for(k=numBest-1; k>0 && bestDist[k-1] > dist; k--)
+    {
+      bestDist[k] = bestDist[k-1];
+      bestIndex[k] = bestIndex[k-1];
+    }
+    bestDist[k] = dist;
+    bestIndex[k] = n;
+  }
+
+  message("searched %u profiles in '%s'\n", header[2], indexname);
+  for(k=0; k<numBest; k++)
+    fprintf(stdout, "%d: RMS distance %.1f  %s\n", k+1,
+            sqrt(bestDist[k] / (3 * FINGERPRINT_SIZE)), nameOf[bestIndex[k]]);
+
+  free(fingerprints);
+  free(names);
+  free(nameOf);
+  return numBest;
+}
+
+/*
+ * FUNCTION resample_ramp
+ *
+ * linearly interpolate a ramp to another size; both end points are
+ * kept.
+ */
+void
+resample_ramp(u_int16_t * src, unsigned int srcSize,
+              u_int16_t * dst, unsigned int dstSize)
+{
+  unsigned int j;
+  double scale;
+
+  if(srcSize == dstSize)
+  {
+    memcpy(dst, src, dstSize * sizeof(u_int16_t));
+    return;
+  }
+  scale = dstSize > 1 ? (double)(srcSize-1) / (double)(dstSize-1) : 0.0;
+  for(j=0; j<dstSize; j++)
+    dst[j] = (int)ROUND(LinInterpolateRampU16(src, srcSize, j * scale));
+}
+
+/*
+ * FUNCTION encode_ramp_knots
+ *
+ * approximate one channel by straight segments between entries of the
+ * ramp, each deviating at most maxError from the ramp. Segments are
+ * grown greedily: the cone of slopes which keeps all covered entries
+ * inside the error bound is narrowed entry by entry, and a knot is
+ * set when the next entry's own slope leaves the cone. As all knots
+ * are exact ramp values, a monotone ramp gives a monotone result.
+ * x and y need room for nEntries knots.
+ *
+ * returns the number of knots
+ */
+unsigned int
+encode_ramp_knots(u_int16_t * ramp, unsigned int nEntries, unsigned int maxError,
+                  u_int16_t * x, u_int16_t * y)
+{
+  unsigned int anchor = 0, j, count = 0;
+  double lo, hi, slope, dist;
+
+  x[count] = 0;
+  y[count++] = ramp[0];
+  lo = -1e30;
+  hi = 1e30;
+  for(j=1; j<nEntries; j++)
+  {
+    dist = j - anchor;
+    slope = ((double)ramp[j] - ramp[anchor]) / dist;
+    if(slope < lo || slope > hi)
+    {
+      /* entry j-1 ends the segment and anchors the next one */
+      anchor = j-1;
+      x[count] = anchor;
+      y[count++] = ramp[anchor];
+      lo = -1e30;
+      hi = 1e30;
+      dist = 1.0;
+    }
+    if(((double)ramp[j] - maxError - ramp[anchor]) / dist > lo)
+      lo = ((double)ramp[j] - maxError - ramp[anchor]) / dist;
+    if(((double)ramp[j] + maxError - ramp[anchor]) / dist < hi)
+      hi = ((double)ramp[j] + maxError - ramp[anchor]) / dist;
+  }
+  if(nEntries > 1)
+  {
+    x[count] = nEntries-1;
+    y[count++] = ramp[nEntries-1];
+  }
+  return count;
+}
+
+/*
+ * FUNCTION decode_ramp_knots
+ *
+ * render a knot list of a ramp of srcSize entries to a ramp of any
+ * size. Each segment fills its range of entries with a plain
+ * multiply-add per entry and no dependency between entries, which
+ * compilers turn into vector code.
+ */
+void
+decode_ramp_knots(u_int16_t * x, u_int16_t * y, unsigned int count,
+                  unsigned int srcSize, u_int16_t * ramp, unsigned int nEntries)
+{
+  unsigned int k, j = 0, end;
+  float scale, base, step;
+
+  if(count < 2 || nEntries < 2)
+  {
+    for(; j<nEntries; j++)
+      ramp[j] = count ? y[0] : 0;
+    return;
+  }
+  scale = (float)(srcSize-1) / (float)(nEntries-1);
+  for(k=0; k+1<count; k++)
+  {
+    /* last entry whose position falls into this segment */
+    end = k+2 == count ? nEntries-1 :
+          (unsigned int)((unsigned long long)x[k+1] * (nEntries-1) / (srcSize-1));
+    step = ((float)y[k+1] - y[k]) / ((float)x[k+1] - x[k]) * scale;
+    base = y[k] - step * (x[k] / scale) + 0.5f;
+    for(; j<=end; j++)
+      ramp[j] = (u_int16_t)(base + step * (float)j);
+  }
+}
+
+/*
+ * FUNCTION save_ramp_knots
+ *
+ * write the ramps as compact knot lists. The file contains the magic,
+ * the encoded size, the error bound and the knot count of each
+ * channel, followed by the knot positions and values.
+ *
+ * returns
+ * -1: file could not be written
+ * otherwise: total number of knots
+ */
+int
+save_ramp_knots(const char * filename, u_int16_t * rRamp, u_int16_t * gRamp,
+                u_int16_t * bRamp, unsigned int nEntries, unsigned int maxError)
+{
+  FILE * fp;
+  u_int16_t * ramps[3];
+  u_int16_t * x, * y;
+  unsigned int header[6];
+  int c, total = 0;
+
+  if((fp = fopen(filename, "wb")) == NULL)
+    return -1;
+  ramps[0] = rRamp;
+  ramps[1] = gRamp;
+  ramps[2] = bRamp;
+  if((x = (u_int16_t *) malloc(6 * nEntries * sizeof(u_int16_t))) == NULL)
+  {
+    fclose(fp);
+    return -1;
+  }
+  y = x + 3 * nEntries;
+  header[0] = KNOTS_MAGIC;
+  header[1] = nEntries;
+  header[2] = maxError;
+  for(c=0; c<3; c++)
+  {
+    header[3+c] = encode_ramp_knots(ramps[c], nEntries, maxError,
+                                    x + c*nEntries, y + c*nEntries);
+    total += header[3+c];
+  }
+  fwrite(header, sizeof(header), 1, fp);
+  for(c=0; c<3; c++)
+  {
+    fwrite(x + c*nEntries, sizeof(u_int16_t), header[3+c], fp);
+    fwrite(y + c*nEntries, sizeof(u_int16_t), header[3+c], fp);
+  }
+  free(x);
+  if(fclose(fp))
+    return -1;
+  return total;
+}
+
+/*
+ * FUNCTION load_ramp_knots
+ *
+ * read a file written by save_ramp_knots()
+ *
+ * returns NULL if the file is no valid compact ramp file
+ */
+struct ramp_knots_t *
+load_ramp_knots(FILE * fp)
+{
+  struct ramp_knots_t * knots;
+  unsigned int header[6];
+  unsigned int total, k;
+  int c;
+
+  if(fread(header, sizeof(header), 1, fp) != 1 || header[0] != KNOTS_MAGIC ||
+     header[1] < 2 || header[1] > MAX_RAMP_SIZE)
+    return NULL;
+  for(c=0, total=0; c<3; c++)
+  {
+    if(header[3+c] < 2 || header[3+c] > header[1])
+      return NULL;
+    total += header[3+c];
+  }
+  if((knots = (struct ramp_knots_t *) malloc(sizeof(*knots) + 2 * total * sizeof(u_int16_t))) == NULL)
+    return NULL;
+  knots->size = header[1];
+  knots->maxError = header[2];
+  knots->x[0] = (u_int16_t *)(knots + 1);
+  for(c=0; c<3; c++)
+  {
+    knots->count[c] = header[3+c];
+    knots->y[c] = knots->x[c] + knots->count[c];
+    if(c < 2)
+      knots->x[c+1] = knots->y[c] + knots->count[c];
+    if(fread(knots->x[c], sizeof(u_int16_t), 2 * knots->count[c], fp) != 2 * knots->count[c] ||
+       knots->x[c][0] != 0 || knots->x[c][knots->count[c]-1] != knots->size-1)
+    {
+      free(knots);
+      return NULL;
+    }
+    /* the segments between knots must not be empty */
+    for(k=0; k+1<knots->count[c]; k++)
+      if(knots->x[c][k] >= knots->x[c][k+1])
+      {
+        free(knots);
+        return NULL;
+      }
+  }
+  return knots;
+}
+
+/*
+ * FUNCTION save_ramp_profile
+ *
+ * write the ramps as a minimal ICC display profile: header, desc, cprt
+ * and wtpt as required and a vcgt table of 16-bit entries at the size
+ * of the ramps, listed first so read_vcgt_stream() finds it at once.
+ * 65536 entries do not fit the 16-bit count and are halved.
+ *
+ * returns
+ * -1: file could not be written
+ * otherwise: number of entries per channel written
+ */
+int
+save_ramp_profile(const char * filename, u_int16_t * rRamp, u_int16_t * gRamp,
+                  u_int16_t * bRamp, unsigned int nEntries, const char * description)
+{
+  static const char copyright[] = "No copyright, use freely";
+  u_int16_t * ramps[3];
+  unsigned char * data, * p;
+  unsigned int step = nEntries > 0xffff ? 2 : 1, entries = nEntries / step;
+  unsigned int descLen = strlen(description) + 1, cprtLen = sizeof(copyright);
+  unsigned int vcgtSize = 18 + 6 * entries, descSize = 90 + descLen, cprtSize = 8 + cprtLen;
+  unsigned int tags[4][3], size, j, c;
+  time_t now = time(NULL);
+  struct tm * t = gmtime(&now);
+  FILE * fp;
+  int ok;
+
+  ramps[0] = rRamp;
+  ramps[1] = gRamp;
+  ramps[2] = bRamp;
+  /* tag table: signature, offset and size, data 4 byte aligned */
+  tags[0][0] = VCGT_TAG; tags[0][2] = vcgtSize;
+  tags[1][0] = DESC_TAG; tags[1][2] = descSize;
+  tags[2][0] = CPRT_TAG; tags[2][2] = cprtSize;
+  tags[3][0] = WTPT_TAG; tags[3][2] = 20;
+  for(c=0, size=128+4+4*12; c<4; c++)
+  {
+    tags[c][1] = size;
+    size += (tags[c][2] + 3) & ~3;
+  }
+  data = (unsigned char *) calloc(size, 1);
+
+  /* header of a version 2.1 RGB display profile */
+  SET_BE_INT(data, size);
+  SET_BE_INT(data + 8, 0x02100000);
+  memcpy(data + 12, "mntrRGB XYZ ", 12);
+  SET_BE_SHORT(data + 24, t->tm_year + 1900);
+  SET_BE_SHORT(data + 26, t->tm_mon + 1);
+  SET_BE_SHORT(data + 28, t->tm_mday);
+  SET_BE_SHORT(data + 30, t->tm_hour);
+  SET_BE_SHORT(data + 32, t->tm_min);
+  SET_BE_SHORT(data + 34, t->tm_sec);
+  memcpy(data + 36, "acsp", 4);
+  /* D50 */
+  SET_BE_INT(data + 68, 0x0000f6d6);
+  SET_BE_INT(data + 72, 0x00010000);
+  SET_BE_INT(data + 76, 0x0000d32d);
+  SET_BE_INT(data + 128, 4);
+  for(c=0; c<4; c++)
+    for(j=0; j<3; j++)
+      SET_BE_INT(data + 132 + 12*c + 4*j, tags[c][j]);
+
+  /* vcgt: table type, channels, entries, entry size, channels planar */
+  p = data + tags[0][1];
+  SET_BE_INT(p, VCGT_TAG);
+  SET_BE_SHORT(p + 12, 3);
+  SET_BE_SHORT(p + 14, entries);
+  SET_BE_SHORT(p + 16, 2);
+  for(c=0, p += 18; c<3; c++)
+    for(j=0; j<entries; j++, p += 2)
+      SET_BE_SHORT(p, ramps[c][j * step]);
+
+  /* textDescriptionType with empty Unicode and ScriptCode parts */
+  p = data + tags[1][1];
+  SET_BE_INT(p, DESC_TAG);
+  SET_BE_INT(p + 8, descLen);
+  memcpy(p + 12, description, descLen);
+
+  p = data + tags[2][1];
+  SET_BE_INT(p, TEXT_TYPE);
+  memcpy(p + 8, copyright, cprtLen);
+
+  p = data + tags[3][1];
+  SET_BE_INT(p, XYZ_TYPE);
+  memcpy(p + 8, data + 68, 12);
+
+  if((fp = fopen(filename, "wb")) == NULL)
+  {
+    free(data);
+    return -1;
+  }
+  ok = fwrite(data, size, 1, fp) == 1;
+  free(data);
+  if(fclose(fp) || !ok)
+    return -1;
+  return entries;
+}
+
+/*
+ * FUNCTION now_ns
+ *
+ * returns a monotonic time stamp in nanoseconds
+ */
+unsigned long long
+now_ns(void)
+{
+#ifndef _WIN32
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#else
+  return (unsigned long long)GetTickCount() * 1000000ULL;
+#endif
+}
+
+/*
+ * FUNCTION ramp_absdiff
+ *
+ * store |a - b| per entry and return the largest difference and the
+ * sum of squared differences. With SSE2 eight entries are handled per
+ * step: saturating subtraction in both directions gives the absolute
+ * difference, which is widened to 32 bit and squared into 64-bit
+ * accumulators.
+ */
+unsigned int
+ramp_absdiff(u_int16_t * a, u_int16_t * b, u_int16_t * diff,
+             unsigned int nEntries, unsigned long long * sumsq)
+{
+  unsigned int j = 0, maxDiff = 0, d;
+  unsigned long long sum = 0;
+#ifdef __SSE2__
+  __m128i vmax = _mm_setzero_si128(), vsum = _mm_setzero_si128();
+  __m128i zero = _mm_setzero_si128();
+  unsigned long long lanes[2];
+  u_int16_t maxLanes[8];
+  int k;
+
+  for(; j + 8 <= nEntries; j += 8)
+  {
+    __m128i va = _mm_loadu_si128((__m128i *)(a + j));
+    __m128i vb = _mm_loadu_si128((__m128i *)(b + j));
+    __m128i vd = _mm_or_si128(_mm_subs_epu16(va, vb), _mm_subs_epu16(vb, va));
+    __m128i lo = _mm_unpacklo_epi16(vd, zero);
+    __m128i hi = _mm_unpackhi_epi16(vd, zero);
+
+    _mm_storeu_si128((__m128i *)(diff + j), vd);
+    /* unsigned max(x, y) = (x -sat y) + y */
+    vmax = _mm_add_epi16(_mm_subs_epu16(vmax, vd), vd);
+    vsum = _mm_add_epi64(vsum, _mm_mul_epu32(lo, lo));
+    vsum = _mm_add_epi64(vsum, _mm_mul_epu32(_mm_srli_epi64(lo, 32), _mm_srli_epi64(lo, 32)));
+    vsum = _mm_add_epi64(vsum, _mm_mul_epu32(hi, hi));
+    vsum = _mm_add_epi64(vsum, _mm_mul_epu32(_mm_srli_epi64(hi, 32), _mm_srli_epi64(hi, 32)));
+  }
+  _mm_storeu_si128((__m128i *)lanes, vsum);
+  _mm_storeu_si128((__m128i *)maxLanes, vmax);
+  sum = lanes[0] + lanes[1];
+  for(k=0; k<8; k++)
+    if(maxLanes[k] > maxDiff)
+      maxDiff = maxLanes[k];
+#endif
+  for(; j<nEntries; j++)
+  {
+    d = a[j] > b[j] ? a[j] - b[j] : b[j] - a[j];
+    diff[j] = d;
+    sum += (unsigned long long)d * d;
+    if(d > maxDiff)
+      maxDiff = d;
+  }
+  *sumsq = sum;
+  return maxDiff;
+}
+
+/*
+ * FUNCTION diff_percentile
+ *
+ * find the smallest difference which is larger or equal than the
+ * given fraction of all differences. A histogram over the high bytes
+ * selects the bucket, a second one over the low bytes of that bucket
+ * gives the exact value - no sorting needed.
+ */
+unsigned int
+diff_percentile(u_int16_t * diff, unsigned int nEntries, double fraction)
+{
+  unsigned int hist[256];
+  unsigned int rank, count, hi, lo, j;
+
+  rank = (unsigned int)ceil(fraction * nEntries);
+  if(rank < 1)
+    rank = 1;
+
+  memset(hist, 0, sizeof(hist));
+  for(j=0; j<nEntries; j++)
+    hist[diff[j] >> 8]++;
+  for(hi=0, count=0; hi<255 && count + hist[hi] < rank; hi++)
+    count += hist[hi];
+  rank -= count;
+
+  memset(hist, 0, sizeof(hist));
+  for(j=0; j<nEntries; j++)
+    if((diff[j] >> 8) == hi)
+      hist[diff[j] & 0xff]++;
+  for(lo=0, count=0; lo<255 && count + hist[lo] < rank; lo++)
+    count += hist[lo];
+
+  return (hi << 8) | lo;
+}
+
+/*
+ * FUNCTION compare_ramp
+ *
+ * compute the differences of one channel; diff is scratch space of
+ * nEntries entries.
+ */
+void
+compare_ramp(u_int16_t * a, u_int16_t * b, unsigned int nEntries,
+             u_int16_t * diff, struct ramp_diff_t * result)
+{
+  unsigned long long sumsq;
+  unsigned int j;
+  int k, l;
+
+  result->max = ramp_absdiff(a, b, diff, nEntries, &sumsq);
+  result->rms = sqrt((double)sumsq / nEntries);
+  result->p50 = diff_percentile(diff, nEntries, 0.50);
+  result->p95 = diff_percentile(diff, nEntries, 0.95);
+  result->p99 = diff_percentile(diff, nEntries, 0.99);
+
+  /* keep the positions of the largest differences, first one wins */
+  for(k=0; k<WORST_ENTRIES; k++)
+    result->worst[k] = 0;
+  for(j=0, l=0; j<nEntries; j++)
+  {
+    if(l == WORST_ENTRIES && diff[j] <= diff[result->worst[l-1]])
+      continue;
+    k = l < WORST_ENTRIES ? l++ : WORST_ENTRIES-1;
+    for(; k>0 && diff[result->worst[k-1]] < diff[j]; k--)
+      result->worst[k] = result->worst[k-1];
+    result->worst[k] = j;
+  }
+}
+
+#ifndef _WIN32
+/*
+ * FUNCTION find_output_crtc
+ *
+ * look up the CRTC of an output, counted like the -output option
+ * does.
+ *
+ * returns the gamma size of the CRTC or 0 if the output is not active
+ */
+int
+find_output_crtc(Display * dpy, int screen, int xoutput, RRCrtc * crtc)
+{
+  XRRScreenResources * res;
+  int i, ncrtc = 0, size = 0;
+
+  res = XRRGetScreenResourcesCurrent(dpy, RootWindow(dpy, screen));
+  for(i = 0; res && i < res->noutput && !size; ++i)
+  {
+    XRROutputInfo * output_info = XRRGetOutputInfo(dpy, res, res->outputs[i]);
+    if(output_info && output_info->crtc && ncrtc++ == xoutput)
+    {
+      *crtc = output_info->crtc;
+      size = XRRGetCrtcGammaSize(dpy, *crtc);
+    }
+    if(output_info)
+      XRRFreeOutputInfo(output_info);
+  }
+  if(res)
+    XRRFreeScreenResources(res);
+  return size;
+}
+#endif
+
+/*
+ * FUNCTION open_ramp_source
+ *
+ * read the native ramps of a -compare operand. "output:<#>" reads the
+ * current gamma of an X output, files starting like an ICC profile
+ * and compact ramp files are decoded later at the requested size,
+ * and any other file is read as -printramps output with one "red green blue" line per
+ * entry.
+ *
+ * returns
+ * -1: source could not be read
+ * 1: success
+ */
+int
+open_ramp_source(const char * name, struct ramp_source_t * src,
+                 void * display, int screen)
+{
+  FILE * fp;
+  unsigned char header[40];
+  char line[128];
+  unsigned int r, g, b, allocated = 0;
+
+  memset(src, 0, sizeof(*src));
+  src->name = name;
+
+  if(!strncmp(name, "output:", 7))
+  {
+#ifndef _WIN32
+    Display * dpy = (Display *)display;
+    XRRCrtcGamma * gamma;
+    RRCrtc crtc = 0;
+    struct ramp_view_t from, to;
+
+    src->kind = SOURCE_OUTPUT;
+    if(!dpy || find_output_crtc(dpy, screen, atoi(name + 7), &crtc) <= 0)
+      return -1;
+    if((gamma = XRRGetCrtcGamma(dpy, crtc)) == NULL || gamma->size <= 0)
+      return -1;
+    src->size = gamma->size;
+    src->ramp = (u_int16_t *) malloc(3 * src->size * sizeof(u_int16_t));
+    from = ramp_view_planar(gamma->red, gamma->green, gamma->blue, src->size, 16);
+    to = ramp_view_planar(src->ramp, src->ramp + src->size, src->ramp + 2*src->size, src->size, 16);
+    ramp_convert(&to, &from);
+    XRRFreeGamma(gamma);
+    return 1;
+#else
+    return -1;
+#endif
+  }
+
+  if((fp = fopen(name, "rb")) == NULL)
+    return -1;
+  if(fread(header, 1, sizeof(header), fp) == sizeof(header) &&
+     !memcmp(header + 36, "acsp", 4))
+  {
+    fclose(fp);
+    src->kind = SOURCE_PROFILE;
+    return 1;
+  }
+  rewind(fp);
+  if((src->knots = load_ramp_knots(fp)) != NULL)
+  {
+    fclose(fp);
+    src->kind = SOURCE_KNOTS;
+    src->size = src->knots->size;
+    return 1;
+  }
+
+  /* -printramps output: collect the channels interleaved, then split;
+     lines which are no ramp entries, like warnings, are skipped */
+  src->kind = SOURCE_TEXT;
+  rewind(fp);
+  while(fgets(line, sizeof(line), fp) && src->size < MAX_RAMP_SIZE)
+  {
+    if(sscanf(line, "%u %u %u", &r, &g, &b) != 3)
+      continue;
+    if(src->size == allocated)
+    {
+      allocated = allocated ? 2*allocated : 256;
+      src->ramp = (u_int16_t *) realloc(src->ramp, 3 * allocated * sizeof(u_int16_t));
+    }
+    src->ramp[3*src->size] = r;
+    src->ramp[3*src->size+1] = g;
+    src->ramp[3*src->size+2] = b;
+    src->size++;
+  }
+  fclose(fp);
+  if(src->size < 2)
+    return -1;
+  {
+    u_int16_t * planar = (u_int16_t *) malloc(3 * src->size * sizeof(u_int16_t));
+    for(r=0; r<src->size; r++)
+    {
+      planar[r] = src->ramp[3*r];
+      planar[src->size+r] = src->ramp[3*r+1];
+      planar[2*src->size+r] = src->ramp[3*r+2];
+    }
+    free(src->ramp);
+    src->ramp = planar;
+  }
+  return 1;
+}
+
+/*
+ * FUNCTION render_ramp_source
+ *
+ * fill three ramps of nEntries entries from an opened source
+ *
+ * returns
+ * -1: profile could not be read
+ * 0: profile doesn't contain calibration data
+ * 1: success
+ */
+int
+render_ramp_source(struct ramp_source_t * src, u_int16_t * rRamp,
+                   u_int16_t * gRamp, u_int16_t * bRamp, unsigned int nEntries)
+{
+  struct ramp_knots_t * knots = src->knots;
+
+  if(src->kind == SOURCE_PROFILE)
+    return read_vcgt_internal(src->name, rRamp, gRamp, bRamp, nEntries);
+  if(src->kind == SOURCE_KNOTS)
+  {
+    decode_ramp_knots(knots->x[0], knots->y[0], knots->count[0], knots->size, rRamp, nEntries);
+    decode_ramp_knots(knots->x[1], knots->y[1], knots->count[1], knots->size, gRamp, nEntries);
+    decode_ramp_knots(knots->x[2], knots->y[2], knots->count[2], knots->size, bRamp, nEntries);
+    return 1;
+  }
+
+  resample_ramp(src->ramp, src->size, rRamp, nEntries);
+  resample_ramp(src->ramp + src->size, src->size, gRamp, nEntries);
+  resample_ramp(src->ramp + 2*src->size, src->size, bRamp, nEntries);
+  return 1;
+}
+
+/*
+ * FUNCTION compare_ramp_sources
+ *
+ * compare two ramp sources at a common size: the given size, or the
+ * larger native size of both, or 256 for two profiles. With brief
+ * set, a single summary line is printed as used for batches.
+ *
+ * returns
+ * -1: one of the sources could not be read
+ * 1: success
+ */
+int
+compare_ramp_sources(const char * nameA, const char * nameB, unsigned int nEntries,
+                     int brief, void * display, int screen)
+{
+  static const char * channels[3] = { "red", "green", "blue" };
+  struct ramp_source_t a, b;
+  struct ramp_diff_t diff[3];
+  u_int16_t * ramps;
+  unsigned int k;
+  int c, retVal = -1;
+
+  if(open_ramp_source(nameA, &a, display, screen) < 0)
+  {
+    warning("Unable to read ramps from '%s'", nameA);
+    free(a.ramp);
+    free(a.knots);
+    return -1;
+  }
+  if(open_ramp_source(nameB, &b, display, screen) < 0)
+  {
+    warning("Unable to read ramps from '%s'", nameB);
+    free(a.ramp);
+    free(a.knots);
+    free(b.ramp);
+    free(b.knots);
+    return -1;
+  }
+
+  if(!nEntries)
+    nEntries = a.size > b.size ? a.size : b.size;
+  if(!nEntries)
+    nEntries = 256;
+
+  /* both ramp triples plus one channel of differences */
+  ramps = (u_int16_t *) malloc(7 * nEntries * sizeof(u_int16_t));
+  if(render_ramp_source(&a, ramps, ramps + nEntries, ramps + 2*nEntries, nEntries) <= 0)
+    warning("No calibration data in '%s' found", nameA);
+  else if(render_ramp_source(&b, ramps + 3*nEntries, ramps + 4*nEntries,
+                             ramps + 5*nEntries, nEntries) <= 0)
+    warning("No calibration data in '%s' found", nameB);
+  else
+  {
+    for(c=0; c<3; c++)
+      compare_ramp(ramps + c*nEntries, ramps + (3+c)*nEntries, nEntries,
+                   ramps + 6*nEntries, &diff[c]);
+    retVal = 1;
+  }
+
+  if(retVal > 0 && brief)
+    fprintf(stdout, "%s %s %u  max %u %u %u  rms %.2f %.2f %.2f\n",
+            nameA, nameB, nEntries, diff[0].max, diff[1].max, diff[2].max,
+            diff[0].rms, diff[1].rms, diff[2].rms);
+  else if(retVal > 0)
+  {
+    fprintf(stdout, "comparing '%s' with '%s' at %u entries\n", nameA, nameB, nEntries);
+    fprintf(stdout, "channel   max      rms      p50    p95    p99    worst entries\n");
+    for(c=0; c<3; c++)
+    {
+      fprintf(stdout, "%-8s %5u %8.2f   %5u  %5u  %5u   ", channels[c], diff[c].max,
+              diff[c].rms, diff[c].p50, diff[c].p95, diff[c].p99);
+      for(k=0; k<WORST_ENTRIES && k<nEntries; k++)
+        fprintf(stdout, " %u (%u/%u)", diff[c].worst[k],
+                ramps[c*nEntries + diff[c].worst[k]],
+                ramps[(3+c)*nEntries + diff[c].worst[k]]);
+      fprintf(stdout, "\n");
+    }
+  }
+
+  free(ramps);
+  free(a.ramp);
+  free(a.knots);
+  free(b.ramp);
+  free(b.knots);
+  return retVal;
+}
+
+/*
+ * FUNCTION compare_ramp_list
+ *
+ * compare all pairs of sources listed in a file ("-" for stdin), one
+ * whitespace separated pair per line
+ *
+ * returns the number of pairs which could not be compared, or -1 if
+ * the list could not be opened
+ */
+int
+compare_ramp_list(const char * listname, unsigned int nEntries,
+                  void * display, int screen)
+{
+  FILE * fp;
+  char line[2048], nameA[1024], nameB[1024];
+  int failed = 0, pairs = 0;
+  clock_t start = clock();
+
+  if(!strcmp(listname, "-"))
+    fp = stdin;
+  else if((fp = fopen(listname, "r")) == NULL)
+    return -1;
+
+  while(fgets(line, sizeof(line), fp))
+  {
+    if(sscanf(line, "%1023s %1023s", nameA, nameB) != 2 || nameA[0] == '#')
+      continue;
+    if(compare_ramp_sources(nameA, nameB, nEntries, 1, display, screen) < 0)
+      failed++;
+    pairs++;
+  }
+  if(fp != stdin)
+    fclose(fp);
+
+  message("%d pairs compared in %.3f s\n", pairs,
+          (double)(clock() - start) / CLOCKS_PER_SEC);
+  return failed;
+}
+
+/*
+ * FUNCTION hash_file
+ *
+ * returns the 64-bit FNV-1a hash of the contents of a file, 0 if it
+ * cannot be read
+ */
+unsigned long long
+hash_file(const char * filename)
+{
+  unsigned long long h = FNV_OFFSET;
+  unsigned char buffer[4096];
+  size_t n, j;
+  FILE * fp;
+
+  if((fp = fopen(filename, "rb")) == NULL)
+    return 0;
+  while((n = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+    for(j=0; j<n; j++)
+      h = (h ^ buffer[j]) * FNV_PRIME;
+  fclose(fp);
+  return h;
+}
+
+/*
+ * FUNCTION audit_open
+ *
+ * open the audit log for appending and remember where the following
+ * records apply
+ *
+ * returns 0 if the file cannot be opened
+ */
+int
+audit_open(const char * filename, const char * display, int screen,
+           int output, const char * profile)
+{
+  struct audit_record_t * rec = &audit_log.record;
+
+  if((audit_log.fp = fopen(filename, "a+b")) == NULL)
+    return 0;
+  memset(rec, 0, sizeof(*rec));
+  rec->magic = AUDIT_MAGIC;
+  strncpy(rec->display, display, sizeof(rec->display) - 1);
+  rec->screen = screen;
+  rec->output = output;
+  rec->profile_hash = profile && *profile ? hash_file(profile) : 0;
+  return 1;
+}
+
+/*
+ * FUNCTION audit_apply
+ *
+ * append a record for ramps just uploaded with the current
+ * xcalib_state. The log is locked while the last record is read, so
+ * time stamps never decrease even if the clock was stepped back or
+ * another instance appended meanwhile. Nothing is done without
+ * -auditlog.
+ *
+ * returns 0 if the record could not be written
+ */
+int
+audit_apply(u_int16_t * rRamp, u_int16_t * gRamp, u_int16_t * bRamp,
+            unsigned int nEntries, unsigned int flags)
+{
+  struct audit_record_t * rec = &audit_log.record, last;
+  struct ramp_stats_t stats;
+  unsigned long long h = FNV_OFFSET;
+  int ok;
+#ifndef _WIN32
+  struct timespec ts;
+#endif
+
+  if(!audit_log.fp)
+    return 1;
+#ifndef _WIN32
+  clock_gettime(CLOCK_REALTIME, &ts);
+  rec->time = (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#else
+  rec->time = (unsigned long long)time(NULL) * 1000000000ULL;
+#endif
+
+  if(nEntries)
+  {
+    ramp_statistics(rRamp, nEntries, &stats, &h);
+    ramp_statistics(gRamp, nEntries, &stats, &h);
+    ramp_statistics(bRamp, nEntries, &stats, &h);
+  }
+  rec->size = nEntries;
+  rec->ramp_hash = nEntries ? h : 0;
+  rec->gamma[0] = xcalib_state.redGamma * xcalib_state.gamma_cor;
+  rec->gamma[1] = xcalib_state.greenGamma * xcalib_state.gamma_cor;
+  rec->gamma[2] = xcalib_state.blueGamma * xcalib_state.gamma_cor;
+  rec->min[0] = xcalib_state.redMin;
+  rec->min[1] = xcalib_state.greenMin;
+  rec->min[2] = xcalib_state.blueMin;
+  rec->max[0] = xcalib_state.redMax;
+  rec->max[1] = xcalib_state.greenMax;
+  rec->max[2] = xcalib_state.blueMax;
+  rec->flags = flags;
+
+#ifndef _WIN32
+  flock(fileno(audit_log.fp), LOCK_EX);
+#endif
+  if(fseek(audit_log.fp, -(long)sizeof(last), SEEK_END) == 0 &&
+     fread(&last, sizeof(last), 1, audit_log.fp) == 1 &&
+     last.magic == AUDIT_MAGIC && last.time > rec->time)
+    rec->time = last.time;
+  fseek(audit_log.fp, 0, SEEK_END);
+  ok = fwrite(rec, sizeof(*rec), 1, audit_log.fp) == 1 && fflush(audit_log.fp) == 0;
+#ifndef _WIN32
+  flock(fileno(audit_log.fp), LOCK_UN);
+#endif
+  return ok;
+}
+
+/*
+ * FUNCTION parse_audit_time
+ *
+ * parse a query bound: seconds since the epoch or a UTC date
+ * YYYY-MM-DD with optional THH:MM[:SS]. "-" is an open bound.
+ *
+ * returns nanoseconds since the epoch or -1 on error
+ */
+long long
+parse_audit_time(const char * text, long long open)
+{
+  int year, month, day, hour = 0, minute = 0, second = 0, used = 0, n;
+  long long days;
+  char * end;
+
+  if(!strcmp(text, "-"))
+    return open;
+  n = sscanf(text, "%d-%d-%d%n", &year, &month, &day, &used);
+  if(n < 3)
+  {
+    days = strtoll(text, &end, 10);
+    return *end || days < 0 ? -1 : days * 1000000000LL;
+  }
+  if(text[used] == 'T' &&
+     sscanf(text + used, "T%d:%d%n:%d%n", &hour, &minute, &used, &second, &used) < 2)
+    return -1;
+  if(month < 1 || month > 12 || day < 1 || day > 31)
+    return -1;
+
+  /* days since 1970-01-01 of the proleptic Gregorian calendar */
+  year -= month <= 2;
+  days = (long long)(year >= 0 ? year : year - 399) / 400 * 146097;
+  n = year - (year >= 0 ? year : year - 399) / 400 * 400;
+  days += n * 365 + n / 4 - n / 100 + (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+  days -= 719468;
+  return ((days * 24 + hour) * 60 + minute) * 60000000000LL + second * 1000000000LL;
+}
+
+/*
+ * FUNCTION audit_query
+ *
+ * print the records of an audit log from one time to another. The
+ * first one is found by binary search over the fixed size records.
+ *
+ * returns
+ * -1: log could not be read
+ * otherwise: number of printed records
+ */
+int
+audit_query(const char * filename, long long from, long long to)
+{
+  struct audit_record_t rec;
+  FILE * fp;
+  long count, low, high, mid;
+  int printed = 0;
+  time_t seconds;
+  struct tm * tm;
+  char date[32];
+
+  if((fp = fopen(filename, "rb")) == NULL)
+    return -1;
+  if(fseek(fp, 0, SEEK_END) != 0)
+  {
+    fclose(fp);
+    return -1;
+  }
+  count = ftell(fp) / (long)sizeof(rec);
+
+  /* first record not older than from */
+  low = 0;
+  high = count;
+  while(low < high)
+  {
+    mid = low + (high - low) / 2;
+    if(fseek(fp, mid * (long)sizeof(rec), SEEK_SET) != 0 ||
+       fread(&rec, sizeof(rec), 1, fp) != 1 || rec.magic != AUDIT_MAGIC)
+    {
+      fclose(fp);
+      return -1;
+    }
+    if((long long)rec.time < from)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+
+  fseek(fp, low * (long)sizeof(rec), SEEK_SET);
+  while(fread(&rec, sizeof(rec), 1, fp) == 1 && rec.magic == AUDIT_MAGIC &&
+        (long long)rec.time <= to)
+  {
+    seconds = (time_t)(rec.time / 1000000000ULL);
+    tm = gmtime(&seconds);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", tm);
+    rec.display[sizeof(rec.display) - 1] = '\0';
+    fprintf(stdout, "%s.%03uZ %s screen %d output %d ", date,
+            (unsigned int)(rec.time / 1000000ULL % 1000), rec.display, rec.screen, rec.output);
+    if(rec.flags & AUDIT_CLEAR)
+      fprintf(stdout, "cleared\n");
+    else
+      fprintf(stdout, "profile %016llx ramps %016llx size %u  R %.2f %.3f %.3f  G %.2f %.3f %.3f  B %.2f %.3f %.3f%s%s%s%s%s\n",
+              rec.profile_hash, rec.ramp_hash, rec.size,
+              rec.gamma[0], rec.min[0], rec.max[0], rec.gamma[1], rec.min[1], rec.max[1],
+              rec.gamma[2], rec.min[2], rec.max[2],
+              rec.flags & AUDIT_ALTER ? "  alter" : "",
+              rec.flags & AUDIT_INVERT ? "  invert" : "",
+              rec.flags & AUDIT_AMBIENT ? "  ambient" : "",
+              rec.flags & AUDIT_WATCH ? "  watch" : "",
+              rec.flags & AUDIT_PRESET ? "  preset" : "");
+    printed++;
+  }
+  fclose(fp);
+
+  message("%d of %ld records in range\n", printed, count);
+  return printed;
+}
+
+#ifndef _WIN32
+/*
+ * FUNCTION deadline_expired
+ *
+ * SIGALRM handler of -timeout: report the phase and leave at once,
+ * the blocking Xlib call cannot be resumed safely
+ */
+void
+deadline_expired(int sig)
+{
+  static const char text[] = "Error - timed out in phase ";
+  const char * phase = deadline.phase ? deadline.phase : "?";
+  ssize_t ignored;
+
+  ignored = write(2, text, sizeof(text) - 1);
+  ignored = write(2, phase, strlen(phase));
+  ignored = write(2, "\n", 1);
+  (void) ignored;
+  (void) sig;
+  _exit(DEADLINE_STATUS);
+}
+
+/*
+ * FUNCTION deadline_phase
+ *
+ * enter a phase of the startup path: the interval timer is set to the
+ * budget of the phase or the rest of -timeout, whichever ends first.
+ * NULL disarms it, e.g. before a resident mode.
+ */
+void
+deadline_phase(const char * phase)
+{
+  struct itimerval timer;
+  long long ms = -1, rest;
+  int k;
+
+  if(!deadline.armed)
+    return;
+  deadline.phase = phase;
+  for(k = 0; phase && k < DEADLINE_PHASES; k++)
+    if(!strcmp(deadline_phases[k], phase) && deadline.budget[k] > 0)
+      ms = deadline.budget[k];
+  if(phase && deadline.end)
+  {
+    rest = ((long long)deadline.end - (long long)now_ns()) / 1000000LL;
+    if(rest <= 0)
+      deadline_expired(SIGALRM);
+    if(ms < 0 || rest < ms)
+      ms = rest;
+  }
+
+  memset(&timer, 0, sizeof(timer));
+  if(ms > 0)
+  {
+    timer.it_value.tv_sec = ms / 1000;
+    timer.it_value.tv_usec = (ms % 1000) * 1000;
+  }
+  signal(SIGALRM, deadline_expired);
+  setitimer(ITIMER_REAL, &timer, NULL);
+}
+
+/*
+ * FUNCTION deadline_connect
+ *
+ * try the transport of a display name with a non-blocking connect,
+ * so a host that does not answer is noticed within the connect budget
+ * instead of the minutes a blocking connect may take. Only local and
+ * TCP displays are checked.
+ *
+ * returns 0 if the display cannot be reached, 1 otherwise
+ */
+int
+deadline_connect(const char * name)
+{
+  char host[256], port[16];
+  const char * colon;
+  struct addrinfo hints, * addr = NULL;
+  struct sockaddr_un local;
+  struct pollfd pfd;
+  socklen_t length;
+  int fd = -1, number, err = 0, ok = 0, abstract;
+
+  if(!name || name[0] == '/' || (colon = strrchr(name, ':')) == NULL ||
+     colon[1] < '0' || colon[1] > '9' || (colon > name && colon[-1] == ':') ||
+     colon - name >= (int)sizeof(host))
+    return 1;
+  number = atoi(colon + 1);
+  memcpy(host, name, colon - name);
+  host[colon - name] = '\0';
+
+  if(host[0] == '\0' || !strcmp(host, "unix"))
+  {
+    /* the socket file first, then the abstract name of Linux servers */
+    for(abstract = 0; abstract < 2 && !ok; abstract++)
+    {
+      memset(&local, 0, sizeof(local));
+      local.sun_family = AF_UNIX;
+      snprintf(local.sun_path + abstract, sizeof(local.sun_path) - abstract,
+               "/tmp/.X11-unix/X%d", number);
+      length = offsetof(struct sockaddr_un, sun_path) + abstract + strlen(local.sun_path + abstract);
+      if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return 1;
+      fcntl(fd, F_SETFL, O_NONBLOCK);
+      ok = connect(fd, (struct sockaddr *) &local, length) == 0 || errno == EINPROGRESS ||
+           errno == EAGAIN;
+      if(!ok)
+        close(fd);
+    }
+    if(!ok)
+      return 0;
+  }
+  else
+  {
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port, sizeof(port), "%d", 6000 + number);
+    if(getaddrinfo(host, port, &hints, &addr) != 0)
+      return 0;
+    if((fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol)) < 0)
+    {
+      freeaddrinfo(addr);
+      return 1;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    if(connect(fd, addr->ai_addr, addr->ai_addrlen) != 0 && errno != EINPROGRESS)
+      err = errno;
+    freeaddrinfo(addr);
+  }
+
+  /* the phase timer ends a wait that takes too long */
+  pfd.fd = fd;
+  pfd.events = POLLOUT;
+  while(!err && poll(&pfd, 1, -1) < 0 && errno == EINTR)
+    ;
+  length = sizeof(err);
+  if(!err)
+    getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &length);
+  close(fd);
+  return err == 0;
+}
+
+/*
+ * FUNCTION detach_apply
+ *
+ * hand the rest of the run to a detached process: the caller returns
+ * at once, a supervisor in a new session starts the worker that goes
+ * on with main() and, after the worker ended, writes its output and
+ * its exit status to the status file. The file appears complete
+ * through rename(). The temporary file is created by the caller, so
+ * a status file that can't be written fails before anything detaches.
+ *
+ * returns only in the worker; the caller exits with 0 or on failure
+ * with an error
+ */
+void
+detach_apply(const char * statusname, const char * displayname, const char * profile)
+{
+  char temp[512];
+  unsigned long long start = now_ns();
+  pid_t pid;
+  int status = 0, fd;
+  FILE * fp;
+
+  snprintf(temp, sizeof(temp), "%s.%d", statusname, (int)getpid());
+  if((fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+    error ("Unable to create status file '%s'", temp);
+  if((pid = fork()) < 0)
+  {
+    unlink(temp);
+    error ("Unable to detach");
+  }
+  if(pid > 0)
+  {
+    /* the intermediate process leaves at once */
+    waitpid(pid, &status, 0);
+    exit(WIFEXITED(status) ? WEXITSTATUS(status) : 1);
+  }
+  setsid();
+  if((pid = fork()) != 0)
+    _exit(pid < 0);
+
+  /* the supervisor */
+  if((pid = fork()) == 0)
+  {
+    dup2(fd, 1);
+    dup2(fd, 2);
+    close(fd);
+    if((fd = open("/dev/null", O_RDONLY)) >= 0)
+    {
+      dup2(fd, 0);
+      close(fd);
+    }
+    return;
+  }
+  close(0);
+  close(1);
+  close(2);
+  while(pid > 0 && waitpid(pid, &status, 0) < 0 && errno == EINTR)
+    ;
+  if((fp = fdopen(fd, "a")) != NULL)
+  {
+    fprintf(fp, "display %s profile %s pid %d exit %d signal %d elapsed %.3f ms\n",
+            displayname, profile[0] ? profile : "-", (int)pid,
+            pid > 0 && WIFEXITED(status) ? WEXITSTATUS(status) : -1,
+            pid > 0 && WIFSIGNALED(status) ? WTERMSIG(status) : 0, (now_ns() - start) / 1e6);
+    fclose(fp);
+    rename(temp, statusname);
+  }
+  _exit(0);
+}
+
+/*
+ * FUNCTION request_key
+ *
+ * hash everything which determines the result of an apply: the
+ * command line and the size and modification time of the profile
+ */
+unsigned long long
+request_key(int argc, char * argv[], const char * profile)
+{
+  unsigned long long h = FNV_OFFSET;
+  const char * c;
+  struct stat st;
+  int i;
+
+  for(i=1; i<argc; i++)
+    for(c=argv[i]; ; c++)
+    {
+      h = (h ^ (unsigned char)*c) * FNV_PRIME;
+      if(!*c)
+        break;
+    }
+  if(profile[0] && !stat(profile, &st))
+  {
+    h = (h ^ (unsigned long long)st.st_size) * FNV_PRIME;
+    h = (h ^ (unsigned long long)st.st_mtime) * FNV_PRIME;
+  }
+  return h;
+}
+
+static int apply_lock_fd = -1;
+static unsigned int apply_lock_ticket;
+
+/*
+ * FUNCTION apply_lock_acquire
+ *
+ * serialize the applies of all instances on a display. Every instance
+ * draws a ticket from the lock file and waits until its ticket is
+ * served, so differing requests are applied in order of arrival.
+ * Tickets of instances which died are skipped. If the apply finished
+ * last has the same request key and completed after this instance
+ * arrived, it covered this request as well.
+ *
+ * returns
+ * -1: lock file not usable, apply without coordination
+ * 0: an identical apply finished meanwhile, its status is in status
+ * 1: this instance may apply now
+ */
+int
+apply_lock_acquire(const char * display, unsigned long long key, int * status)
+{
+  struct apply_lock_t lock;
+  struct timespec pause = { 0, 2000000 };
+  char path[1024], name[256];
+  const char * dir = getenv("XDG_RUNTIME_DIR");
+  unsigned long long arrival = now_ns();
+  int i;
+
+  for(i=0; display[i] && i < (int)sizeof(name)-1; i++)
+    name[i] = display[i] == '/' ? '_' : display[i];
+  name[i] = '\0';
+  snprintf(path, sizeof(path), "%s/xcalib-%u-%s.lock", dir ? dir : "/tmp",
+           (unsigned int)getuid(), name);
+  if((apply_lock_fd = open(path, O_RDWR | O_CREAT, 0600)) < 0)
+    return -1;
+
+  if(flock(apply_lock_fd, LOCK_EX))
+  {
+    close(apply_lock_fd);
+    apply_lock_fd = -1;
+    return -1;
+  }
+  if(pread(apply_lock_fd, &lock, sizeof(lock), 0) != sizeof(lock) ||
+     lock.magic != LOCK_MAGIC)
+  {
+    memset(&lock, 0, sizeof(lock));
+    lock.magic = LOCK_MAGIC;
+  }
+  apply_lock_ticket = lock.next_ticket++;
+  lock.pid[apply_lock_ticket % LOCK_SLOTS] = getpid();
+  pwrite(apply_lock_fd, &lock, sizeof(lock), 0);
+
+  while(lock.serving != apply_lock_ticket)
+  {
+    /* skip the turn of an instance which exited without releasing it */
+    if(kill(lock.pid[lock.serving % LOCK_SLOTS], 0) && errno == ESRCH)
+    {
+      lock.serving++;
+      pwrite(apply_lock_fd, &lock, sizeof(lock), 0);
+      continue;
+    }
+    flock(apply_lock_fd, LOCK_UN);
+    nanosleep(&pause, NULL);
+    if(flock(apply_lock_fd, LOCK_EX) ||
+       pread(apply_lock_fd, &lock, sizeof(lock), 0) != sizeof(lock))
+    {
+      close(apply_lock_fd);
+      apply_lock_fd = -1;
+      return -1;
+    }
+  }
+
+  if(lock.key == key && lock.finished >= arrival)
+  {
+    *status = lock.status;
+    lock.serving++;
+    pwrite(apply_lock_fd, &lock, sizeof(lock), 0);
+    flock(apply_lock_fd, LOCK_UN);
+    close(apply_lock_fd);
+    apply_lock_fd = -1;
+    return 0;
+  }
+  /* the lock stays held until apply_lock_release() */
+  return 1;
+}
+
+/*
+ * FUNCTION apply_lock_release
+ *
+ * record the result of this apply and hand the display over to the
+ * next queued instance
+ */
+void
+apply_lock_release(unsigned long long key, int status)
+{
+  struct apply_lock_t lock;
+
+  if(apply_lock_fd < 0)
+    return;
+  if(pread(apply_lock_fd, &lock, sizeof(lock), 0) == sizeof(lock))
+  {
+    lock.key = key;
+    lock.status = status;
+    lock.finished = now_ns();
+    lock.serving = apply_lock_ticket + 1;
+    pwrite(apply_lock_fd, &lock, sizeof(lock), 0);
+  }
+  flock(apply_lock_fd, LOCK_UN);
+  close(apply_lock_fd);
+  apply_lock_fd = -1;
+}
+
+/*
+ * FUNCTION parse_image_header
+ *
+ * parse the header of a binary PPM (P6) or of a PAM (P7) with RGB or
+ * RGB_ALPHA tuples.
+ *
+ * returns the size of the header or 0 if the format is not supported
+ */
+unsigned int
+parse_image_header(unsigned char * data, size_t length, struct image_t * image)
+{
+  char token[32], value[32];
+  size_t pos = 2;
+  unsigned int fields[3], n = 0, k;
+
+  if(length < 3 || data[0] != 'P' || (data[1] != '6' && data[1] != '7'))
+    return 0;
+  image->depth = 3;
+
+  if(data[1] == '6')
+  {
+    /* width, height and maxval separated by whitespace and comments */
+    while(n < 3 && pos < length)
+    {
+      if(data[pos] == '#')
+        while(pos < length && data[pos] != '\n')
+          pos++;
+      else if(isspace(data[pos]))
+        pos++;
+      else if(isdigit(data[pos]))
+      {
+        for(fields[n] = 0; pos < length && isdigit(data[pos]); pos++)
+          fields[n] = 10 * fields[n] + data[pos] - '0';
+        n++;
+      }
+      else
+        return 0;
+    }
+    if(n < 3 || pos >= length)
+      return 0;
+    pos++;      /* single whitespace before the raster */
+    image->width = fields[0];
+    image->height = fields[1];
+    image->maxval = fields[2];
+  }
+  else
+  {
+    image->width = image->height = image->maxval = 0;
+    while(pos < length)
+    {
+      /* one "TOKEN value" line after the other up to ENDHDR */
+      while(pos < length && isspace(data[pos]))
+        pos++;
+      for(k=0; pos < length && !isspace(data[pos]) && k < sizeof(token)-1; pos++)
+        token[k++] = data[pos];
+      token[k] = '\0';
+      while(pos < length && (data[pos] == ' ' || data[pos] == '\t'))
+        pos++;
+      for(k=0; pos < length && data[pos] != '\n' && k < sizeof(value)-1; pos++)
+        value[k++] = data[pos];
+      value[k] = '\0';
+      pos++;
+      if(!strcmp(token, "ENDHDR"))
+        break;
+      if(!strcmp(token, "WIDTH"))
+        image->width = atoi(value);
+      else if(!strcmp(token, "HEIGHT"))
+        image->height = atoi(value);
+      else if(!strcmp(token, "DEPTH"))
+        image->depth = atoi(value);
+      else if(!strcmp(token, "MAXVAL"))
+        image->maxval = atoi(value);
+    }
+    if(pos > length || (image->depth != 3 && image->depth != 4))
+      return 0;
+  }
+  if(!image->width || !image->height || !image->maxval || image->maxval > 65535)
+    return 0;
+  image->bytes = image->maxval > 255 ? 2 : 1;
+  if((length - pos) / image->bytes / image->depth / image->width < image->height)
+    return 0;
+  return pos;
+}
+
+/*
+ * FUNCTION image_worker
+ *
+ * thread function applying the LUTs to bands of rows until all bands
+ * of the image are taken
+ */
+void *
+image_worker(void * arg)
+{
+  struct image_t * image = (struct image_t *) arg;
+  size_t rowSamples = (size_t)image->width * image->depth;
+  unsigned int tile, row, end;
+  size_t j, start, stop;
+
+  while((tile = __sync_fetch_and_add(&image->next_tile, 1)) * IMAGE_TILE_ROWS < image->height)
+  {
+    row = tile * IMAGE_TILE_ROWS;
+    end = row + IMAGE_TILE_ROWS < image->height ? row + IMAGE_TILE_ROWS : image->height;
+    start = row * rowSamples;
+    stop = end * rowSamples;
+
+    if(image->bytes == 1)
+    {
+      unsigned char * src = image->src, * dst = image->dst;
+      unsigned char * lr = image->lut[0], * lg = image->lut[1], * lb = image->lut[2];
+      unsigned int d = image->depth;
+
+      /* independent loads of four pixels per step keep the core busy */
+      if(d == 3)
+        for(j=start; j+12<=stop; j+=12)
+        {
+          unsigned char r0 = lr[src[j]], g0 = lg[src[j+1]], b0 = lb[src[j+2]];
+          unsigned char r1 = lr[src[j+3]], g1 = lg[src[j+4]], b1 = lb[src[j+5]];
+          unsigned char r2 = lr[src[j+6]], g2 = lg[src[j+7]], b2 = lb[src[j+8]];
+          unsigned char r3 = lr[src[j+9]], g3 = lg[src[j+10]], b3 = lb[src[j+11]];
+          dst[j] = r0; dst[j+1] = g0; dst[j+2] = b0;
+          dst[j+3] = r1; dst[j+4] = g1; dst[j+5] = b1;
+          dst[j+6] = r2; dst[j+7] = g2; dst[j+8] = b2;
+          dst[j+9] = r3; dst[j+10] = g3; dst[j+11] = b3;
+        }
+      else
+        j = start;
+      for(; j<stop; j+=d)
+      {
+        dst[j] = lr[src[j]];
+        dst[j+1] = lg[src[j+1]];
+        dst[j+2] = lb[src[j+2]];
+        if(d == 4)
+          dst[j+3] = src[j+3];
+      }
+    }
+    else
+    {
+      unsigned char * src = image->src, * dst = image->dst;
+      unsigned int c, v;
+
+      for(j=start; j<stop; j+=image->depth)
+      {
+        for(c=0; c<3; c++)
+        {
+          v = (src[2*(j+c)] << 8) | src[2*(j+c)+1];
+          v = ((u_int16_t *)image->lut[c])[v > image->maxval ? image->maxval : v];
+          dst[2*(j+c)] = v >> 8;
+          dst[2*(j+c)+1] = v & 0xff;
+        }
+        if(image->depth == 4)
+        {
+          dst[2*j+6] = src[2*j+6];
+          dst[2*j+7] = src[2*j+7];
+        }
+      }
+    }
+  }
+  return NULL;
+}
+
+/*
+ * FUNCTION apply_ramps_to_image
+ *
+ * map a PPM/PAM image and pass all RGB samples through the ramps,
+ * in place or into a new file, using one thread per online CPU
+ *
+ * returns
+ * -1: file could not be read or written
+ * 0: file format not supported
+ * 1: success
+ */
+int
+apply_ramps_to_image(const char * inname, const char * outname,
+                     u_int16_t * rRamp, u_int16_t * gRamp, u_int16_t * bRamp,
+                     unsigned int nEntries)
+{
+  struct image_t image;
+  struct stat st, outst;
+  pthread_t threads[MAX_THREADS];
+  u_int16_t * ramps[3];
+  u_int16_t * scaled;
+  unsigned char * in, * out = NULL;
+  unsigned int header, c, v, numThreads;
+  size_t raster;
+  unsigned long long start;
+  int fd, outfd = -1, retVal = 1;
+  long cpus;
+
+  if((fd = open(inname, outname ? O_RDONLY : O_RDWR)) < 0 || fstat(fd, &st) ||
+     st.st_size == 0)
+  {
+    if(fd >= 0)
+      close(fd);
+    return -1;
+  }
+  /* truncating the mapped input would end in SIGBUS */
+  if(outname && !stat(outname, &outst) && outst.st_dev == st.st_dev && outst.st_ino == st.st_ino)
+  {
+    warning ("Image '%s' is the input, leave out -imageout to convert in place", outname);
+    close(fd);
+    return -1;
+  }
+  in = mmap(NULL, st.st_size, outname ? PROT_READ : PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+  close(fd);
+  if(in == MAP_FAILED)
+    return -1;
+  memset(&image, 0, sizeof(image));
+  if((header = parse_image_header(in, st.st_size, &image)) == 0)
+  {
+    munmap(in, st.st_size);
+    return 0;
+  }
+
+  if(outname)
+  {
+    if((outfd = open(outname, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0 ||
+       ftruncate(outfd, st.st_size) ||
+       (out = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, outfd, 0)) == MAP_FAILED)
+    {
+      if(outfd >= 0)
+        close(outfd);
+      munmap(in, st.st_size);
+      return -1;
+    }
+    close(outfd);
+    /* copy the header and whatever follows the raster */
+    raster = (size_t)image.width * image.height * image.depth * image.bytes;
+    memcpy(out, in, header);
+    memcpy(out + header + raster, in + header + raster, st.st_size - header - raster);
+  }
+  image.src = in + header;
+  image.dst = outname ? out + header : image.src;
+
+  /* LUTs indexed by sample values: sample v is ramp position v/maxval */
+  ramps[0] = rRamp;
+  ramps[1] = gRamp;
+  ramps[2] = bRamp;
+  scaled = (u_int16_t *) malloc((image.maxval + 1) * sizeof(u_int16_t));
+  for(c=0; c<3; c++)
+  {
+    /* 8-bit samples index without a check: samples above maxval are
+     * clamped through the entries up to 255 */
+    image.lut[c] = malloc((image.bytes == 1 ? 256 : image.maxval + 1) * image.bytes);
+    resample_ramp(ramps[c], nEntries, scaled, image.maxval + 1);
+    for(v=0; v<=image.maxval; v++)
+    {
+      unsigned int sample = (unsigned int)ROUND(scaled[v] * (double)image.maxval / 65535.0);
+      if(image.bytes == 1)
+        ((unsigned char *)image.lut[c])[v] = sample;
+      else
+        ((u_int16_t *)image.lut[c])[v] = sample;
+    }
+    for(; image.bytes == 1 && v<256; v++)
+      ((unsigned char *)image.lut[c])[v] = ((unsigned char *)image.lut[c])[image.maxval];
+  }
+  free(scaled);
+
+  start = now_ns();
+  cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  numThreads = cpus < 1 ? 1 : cpus > MAX_THREADS ? MAX_THREADS : cpus;
+  if(numThreads > (image.height + IMAGE_TILE_ROWS - 1) / IMAGE_TILE_ROWS)
+    numThreads = (image.height + IMAGE_TILE_ROWS - 1) / IMAGE_TILE_ROWS;
+  for(c=1; c<numThreads; c++)
+    if(pthread_create(&threads[c], NULL, image_worker, &image))
+      break;
+  numThreads = c;
+  image_worker(&image);
+  for(c=1; c<numThreads; c++)
+    pthread_join(threads[c], NULL);
+  start = now_ns() - start;
+
+  fprintf(stdout, "%ux%u pixels in %.3f ms with %u threads: %.1f Mpixel/s\n",
+          image.width, image.height, start / 1e6, numThreads,
+          (double)image.width * image.height / (start / 1e9) / 1e6);
+
+  for(c=0; c<3; c++)
+    free(image.lut[c]);
+  if(outname && msync(out, st.st_size, MS_ASYNC))
+    retVal = -1;
+  if(out)
+    munmap(out, st.st_size);
+  munmap(in, st.st_size);
+  return retVal;
+}
+
+/*
+ * FUNCTION mask_shift
+ *
+ * returns the position of the lowest set bit of a color mask
+ */
+int
+mask_shift(unsigned long mask)
+{
+  int shift = 0;
+
+  while(mask && !(mask & 1))
+  {
+    mask >>= 1;
+    shift++;
+  }
+  return shift;
+}
+
+/*
+ * FUNCTION compare_ull
+ *
+ * qsort() callback for unsigned long long values
+ */
+int
+compare_ull(const void * a, const void * b)
+{
+  unsigned long long x = *(const unsigned long long *)a;
+  unsigned long long y = *(const unsigned long long *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+/*
+ * FUNCTION capture_screen
+ *
+ * grab the root window, or the area of one output, through MIT-SHM,
+ * pass each pixel through the ramps right in the shared buffer and
+ * write the frames unmodified in layout - 32 bits per pixel in the
+ * server's byte order - to stdout at the given rate. Without MIT-SHM,
+ * e.g. on a remote display, XGetImage is used instead. Latency
+ * statistics go to stderr as stdout carries the frames.
+ *
+ * returns
+ * -1: the screen can not be captured
+ * otherwise: number of written frames
+ */
+int
+capture_screen(Display * dpy, int screen, int xoutput, int frames, double fps,
+               u_int16_t * rRamp, u_int16_t * gRamp, u_int16_t * bRamp,
+               unsigned int nEntries)
+{
+  Window root = RootWindow(dpy, screen);
+  Visual * visual = DefaultVisual(dpy, screen);
+  XShmSegmentInfo shminfo;
+  XImage * image = NULL;
+  unsigned char lut[3][256];
+  u_int16_t scaled[256];
+  u_int16_t * ramps[3];
+  unsigned int * lutShifted[3];
+  unsigned long long * latency;
+  unsigned long long start, deadline, interval;
+  struct timespec ts;
+  int x = 0, y = 0, useShm, shift[3], bytePos[3], byteWise, count, c, v, row;
+  unsigned int width = DisplayWidth(dpy, screen), height = DisplayHeight(dpy, screen);
+  unsigned int rgbMask, p, * pixels;
+  size_t j, rowPixels;
+
+  if(xoutput >= 0)
+  {
+    RRCrtc crtc = 0;
+    XRRScreenResources * res;
+    XRRCrtcInfo * info;
+
+    if(find_output_crtc(dpy, screen, xoutput, &crtc) <= 0 && !crtc)
+      return -1;
+    res = XRRGetScreenResourcesCurrent(dpy, root);
+    if(res && (info = XRRGetCrtcInfo(dpy, res, crtc)) != NULL)
+    {
+      x = info->x;
+      y = info->y;
+      width = info->width;
+      height = info->height;
+      XRRFreeCrtcInfo(info);
+    }
+    if(res)
+      XRRFreeScreenResources(res);
+  }
+  if(visual->class != TrueColor || DefaultDepth(dpy, screen) < 24 || !width || !height)
+    return -1;
+
+  useShm = XShmQueryExtension(dpy);
+  if(useShm)
+  {
+    image = XShmCreateImage(dpy, visual, DefaultDepth(dpy, screen), ZPixmap,
+                            NULL, &shminfo, width, height);
+    if(image && image->bits_per_pixel == 32)
+    {
+      shminfo.shmid = shmget(IPC_PRIVATE, image->bytes_per_line * image->height,
+                             IPC_CREAT | 0600);
+      shminfo.shmaddr = image->data = shmat(shminfo.shmid, NULL, 0);
+      shminfo.readOnly = False;
+      if(shminfo.shmid < 0 || shminfo.shmaddr == (char *)-1 || !XShmAttach(dpy, &shminfo))
+      {
+        if(shminfo.shmaddr != (char *)-1)
+          shmdt(shminfo.shmaddr);
+        useShm = 0;
+      }
+      else
+        XSync(dpy, False);
+      /* the segment goes away with the last detach, even on a crash */
+      if(shminfo.shmid >= 0)
+        shmctl(shminfo.shmid, IPC_RMID, NULL);
+    }
+    else
+      useShm = 0;
+    if(!useShm && image)
+    {
+      XDestroyImage(image);
+      image = NULL;
+    }
+  }
+
+  /* 8-bit tables, pre-shifted to the positions of the color masks */
+  shift[0] = mask_shift(visual->red_mask);
+  shift[1] = mask_shift(visual->green_mask);
+  shift[2] = mask_shift(visual->blue_mask);
+  rgbMask = visual->red_mask | visual->green_mask | visual->blue_mask;
+  /* channels in whole bytes, the usual case, are looked up byte wise
+   * in the image's byte order */
+  byteWise = 1;
+  for(c=0; c<3; c++)
+  {
+    unsigned long mask = c == 0 ? visual->red_mask : c == 1 ? visual->green_mask : visual->blue_mask;
+    byteWise &= mask == 0xffUL << shift[c] && shift[c] % 8 == 0;
+    bytePos[c] = shift[c] / 8;
+  }
+  ramps[0] = rRamp;
+  ramps[1] = gRamp;
+  ramps[2] = bRamp;
+  lutShifted[0] = (unsigned int *) malloc(3 * 256 * sizeof(unsigned int));
+  for(c=0; c<3; c++)
+  {
+    lutShifted[c] = lutShifted[0] + c * 256;
+    resample_ramp(ramps[c], nEntries, scaled, 256);
+    for(v=0; v<256; v++)
+    {
+      lut[c][v] = (scaled[v] + 128) / 257;
+      lutShifted[c][v] = (unsigned int)lut[c][v] << shift[c];
+    }
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  latency = (unsigned long long *) malloc((frames > 0 ? frames : 1024) * sizeof(unsigned long long));
+  interval = (unsigned long long)(1e9 / fps);
+  deadline = now_ns();
+  fprintf(stderr, "capturing %ux%u+%d+%d, 32 bits per pixel, %s, %s\n", width, height,
+          x, y, image && image->byte_order == MSBFirst ? "MSB first" : "LSB first",
+          useShm ? "MIT-SHM" : "XGetImage");
+
+  for(count = 0; frames <= 0 || count < frames; count++)
+  {
+    start = now_ns();
+    if(useShm)
+    {
+      if(!XShmGetImage(dpy, root, image, x, y, AllPlanes))
+        break;
+    }
+    else
+    {
+      if(image)
+        XDestroyImage(image);
+      image = XGetImage(dpy, root, x, y, width, height, AllPlanes, ZPixmap);
+      if(!image || image->bits_per_pixel != 32)
+        break;
+    }
+
+    rowPixels = image->bytes_per_line / 4;
+    if(image->byte_order == MSBFirst)
+      for(c=0; c<3; c++)
+        bytePos[c] = 3 - shift[c] / 8;
+    for(row = 0; row < image->height; row++)
+    {
+      pixels = (unsigned int *)(image->data + row * image->bytes_per_line);
+      if(byteWise)
+      {
+        unsigned char * b = (unsigned char *) pixels;
+        for(j=0; j<4*(size_t)width; j+=4)
+        {
+          b[j+bytePos[0]] = lut[0][b[j+bytePos[0]]];
+          b[j+bytePos[1]] = lut[1][b[j+bytePos[1]]];
+          b[j+bytePos[2]] = lut[2][b[j+bytePos[2]]];
+        }
+        j = width;
+      }
+      else
+        j = 0;
+      /* four independent pixels per step */
+      for(; j+4<=width; j+=4)
+      {
+        unsigned int p0 = pixels[j], p1 = pixels[j+1], p2 = pixels[j+2], p3 = pixels[j+3];
+        pixels[j] = (p0 & ~rgbMask) | lutShifted[0][(p0 >> shift[0]) & 0xff] |
+                    lutShifted[1][(p0 >> shift[1]) & 0xff] | lutShifted[2][(p0 >> shift[2]) & 0xff];
+        pixels[j+1] = (p1 & ~rgbMask) | lutShifted[0][(p1 >> shift[0]) & 0xff] |
+                      lutShifted[1][(p1 >> shift[1]) & 0xff] | lutShifted[2][(p1 >> shift[2]) & 0xff];
+        pixels[j+2] = (p2 & ~rgbMask) | lutShifted[0][(p2 >> shift[0]) & 0xff] |
+                      lutShifted[1][(p2 >> shift[1]) & 0xff] | lutShifted[2][(p2 >> shift[2]) & 0xff];
+        pixels[j+3] = (p3 & ~rgbMask) | lutShifted[0][(p3 >> shift[0]) & 0xff] |
+                      lutShifted[1][(p3 >> shift[1]) & 0xff] | lutShifted[2][(p3 >> shift[2]) & 0xff];
+      }
+      for(; j<width; j++)
+      {
+        p = pixels[j];
+        pixels[j] = (p & ~rgbMask) | lutShifted[0][(p >> shift[0]) & 0xff] |
+                    lutShifted[1][(p >> shift[1]) & 0xff] | lutShifted[2][(p >> shift[2]) & 0xff];
+      }
+      if(rowPixels != width &&
+         fwrite(pixels, 4, width, stdout) != width)
+        break;
+    }
+    if(row < image->height ||
+       (rowPixels == width && fwrite(image->data, 4 * width, height, stdout) != height) ||
+       fflush(stdout))
+      break;
+
+    if(frames <= 0 && count >= 1024)
+      memmove(latency, latency + 1, 1023 * sizeof(unsigned long long));
+    latency[frames <= 0 && count >= 1024 ? 1023 : count] = now_ns() - start;
+
+    /* absolute deadlines keep the rate even if a frame is late */
+    deadline += interval;
+    if(deadline > now_ns())
+    {
+      ts.tv_sec = deadline / 1000000000ULL;
+      ts.tv_nsec = deadline % 1000000000ULL;
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    }
+    else
+      deadline = now_ns();
+  }
+
+  if(count > 0)
+  {
+    int n = frames <= 0 && count > 1024 ? 1024 : count;
+    unsigned long long sum = 0;
+
+    for(c=0; c<n; c++)
+      sum += latency[c];
+    qsort(latency, n, sizeof(unsigned long long), compare_ull);
+    fprintf(stderr, "%d frames, latency ms: min %.2f  mean %.2f  p95 %.2f  max %.2f\n",
+            count, latency[0] / 1e6, sum / 1e6 / n, latency[(int)(0.95 * (n-1))] / 1e6,
+            latency[n-1] / 1e6);
+  }
+
+  free(latency);
+  free(lutShifted[0]);
+  if(useShm)
+  {
+    XShmDetach(dpy, &shminfo);
+    shmdt(shminfo.shmaddr);
+  }
+  if(image)
+    XDestroyImage(image);
+  return count;
+}
+
+/*
+ * FUNCTION set_display_ramps
+ *
+ * upload the ramps to a CRTC with XRandR 1.2 or to the screen with
+ * XVidMode
+ *
+ * returns 0 on failure
+ */
+int
+set_display_ramps(Display * dpy, int screen, RRCrtc crtc, int xrr_version,
+                  u_int16_t * rRamp, u_int16_t * gRamp, u_int16_t * bRamp,
+                  unsigned int nEntries)
+{
+  if(xrr_version >= 102)
+  {
+    XRRCrtcGamma * gamma = XRRAllocGamma (nEntries);
+    struct ramp_view_t from = ramp_view_planar(rRamp, gRamp, bRamp, nEntries, 16), to;
+    if(!gamma)
+      return 0;
+    to = ramp_view_planar(gamma->red, gamma->green, gamma->blue, nEntries, 16);
+    ramp_convert(&to, &from);
+    XRRSetCrtcGamma (dpy, crtc, gamma);
+    XRRFreeGamma (gamma);
+    return 1;
+  }
+  return XF86VidModeSetGammaRamp (dpy, screen, nEntries, rRamp, gRamp, bRamp);
+}
+
+/*
+ * FUNCTION publish_profile
+ *
+ * put the profile bytes into _ICC_PROFILE (_ICC_PROFILE_<index> for
+ * further outputs) on the root window and into the _ICC_PROFILE
+ * property of the RandR output, if any, or delete both without data.
+ * The atoms take one round trip, the properties are queued with the
+ * gamma upload.
+ *
+ * returns 0 on failure
+ */
+int
+publish_profile(Display * dpy, int screen, RROutput output, int index,
+                const unsigned char * data, size_t length)
+{
+  char name[32];
+  char * names[2];
+  Atom atoms[2];
+
+  if(index > 0)
+    snprintf(name, sizeof(name), "_ICC_PROFILE_%d", index);
+  else
+    strcpy(name, "_ICC_PROFILE");
+  names[0] = "_ICC_PROFILE";
+  names[1] = name;
+  if(!XInternAtoms(dpy, names, 2, False, atoms))
+    return 0;
+  if(data)
+    XChangeProperty(dpy, RootWindow(dpy, screen), atoms[1], XA_CARDINAL, 8,
+                    PropModeReplace, data, length);
+  else
+    XDeleteProperty(dpy, RootWindow(dpy, screen), atoms[1]);
+  if(!output)
+    return 1;
+  if(data)
+    XRRChangeOutputProperty(dpy, output, atoms[0], XA_CARDINAL, 8,
+                            PropModeReplace, data, length);
+  else
+    XRRDeleteOutputProperty(dpy, output, atoms[0]);
+  return 1;
+}
+
+/*
+ * FUNCTION matrix_is_identity
+ *
+ * returns whether the 3x3 part of a matrix is the identity
+ */
+int
+matrix_is_identity(double matrix[3][4])
+{
+  int r, c;
+
+  for(r = 0; r < 3; r++)
+    for(c = 0; c < 3; c++)
+      if(fabs(matrix[r][c] - (r == c)) > 1e-6)
+        return 0;
+  return 1;
+}
+
+/*
+ * FUNCTION set_output_ctm
+ *
+ * set the 3x3 part of a matrix as the colour transformation matrix of
+ * a RandR output, applied by the display engine before the gamma LUT.
+ * Drivers offering it (amdgpu, modesetting on atomic KMS) list a "CTM"
+ * output property of 9 S31.32 sign-magnitude values, each as two
+ * 32-bit items with the low one first. Without matrix the identity is
+ * set.
+ *
+ * returns 1 if set, 0 if the output has no CTM
+ */
+int
+set_output_ctm(Display * dpy, RROutput output, double matrix[3][4])
+{
+  Atom ctm, * props;
+  long data[18];
+  double value;
+  unsigned long long fixed;
+  int n, k, found = 0;
+
+  if((ctm = XInternAtom(dpy, "CTM", True)) == None)
+    return 0;
+  if((props = XRRListOutputProperties(dpy, output, &n)) == NULL)
+    return 0;
+  for(k = 0; k < n; k++)
+    found |= props[k] == ctm;
+  XFree(props);
+  if(!found)
+    return 0;
+
+  for(k = 0; k < 9; k++)
+  {
+    value = matrix ? matrix[k / 3][k % 3] : (k % 4 == 0);
+    fixed = fabs(value) >= 2147483648.0 ? 0x7fffffffffffffffULL :
+            (unsigned long long)(fabs(value) * 4294967296.0 + 0.5);
+    if(value < 0)
+      fixed |= 1ULL << 63;
+    data[2*k] = (long)(fixed & 0xffffffffUL);
+    data[2*k + 1] = (long)(fixed >> 32);
+  }
+  XRRChangeOutputProperty(dpy, output, ctm, XA_INTEGER, 32, PropModeReplace,
+                          (unsigned char *) data, 18);
+  return 1;
+}
+
+static volatile sig_atomic_t resident_quit = 0;
+
+/*
+ * FUNCTION resident_signal
+ *
+ * signal handler ending resident modes
+ */
+void
+resident_signal(int sig)
+{
+  (void) sig;
+  resident_quit = 1;
+}
+
+/*
+ * FUNCTION parse_ambient_curve
+ *
+ * parse "lux:brightness:contrast,..." with increasing lux values
+ *
+ * returns the number of points or 0 if the curve is invalid
+ */
+int
+parse_ambient_curve(const char * text, struct ambient_point_t * points)
+{
+  int n = 0, used;
+
+  while(n < AMBIENT_POINTS &&
+        sscanf(text, "%f:%f:%f%n", &points[n].lux, &points[n].brightness,
+               &points[n].contrast, &used) == 3)
+  {
+    if((n && points[n].lux <= points[n-1].lux) ||
+       points[n].brightness < 0.0 || points[n].brightness > 99.0 ||
+       points[n].contrast < 1.0 || points[n].contrast > 100.0)
+      return 0;
+    n++;
+    text += used;
+    if(*text != ',')
+      break;
+    text++;
+  }
+  return *text ? 0 : n;
+}
+
+/*
+ * FUNCTION read_illuminance
+ *
+ * read a light level from a file like the IIO sysfs attribute
+ * in_illuminance_input. For in_illuminance_raw the sibling
+ * in_illuminance_scale is applied if it exists.
+ *
+ * returns the light level or a negative value on failure
+ */
+double
+read_illuminance(const char * filename)
+{
+  char buffer[64], path[1024];
+  double value = -1.0, scale;
+  size_t len = strlen(filename);
+  int fd;
+  ssize_t n;
+
+  if((fd = open(filename, O_RDONLY)) < 0)
+    return -1.0;
+  if((n = read(fd, buffer, sizeof(buffer) - 1)) > 0)
+  {
+    buffer[n] = '\0';
+    value = atof(buffer);
+  }
+  close(fd);
+
+  if(value >= 0.0 && len > 4 && len < sizeof(path) && !strcmp(filename + len - 4, "_raw"))
+  {
+    snprintf(path, sizeof(path), "%.*s_scale", (int)(len - 4), filename);
+    if((fd = open(path, O_RDONLY)) >= 0)
+    {
+      if((n = read(fd, buffer, sizeof(buffer) - 1)) > 0)
+      {
+        buffer[n] = '\0';
+        if((scale = atof(buffer)) > 0.0)
+          value *= scale;
+      }
+      close(fd);
+    }
+  }
+  return value;
+}
+
+/*
+ * FUNCTION run_ambient
+ *
+ * resident mode following the room light: the light level is
+ * smoothed exponentially, mapped through the curve to brightness and
+ * contrast, and only when these moved by AMBIENT_STEP percent - and
+ * not more often than every AMBIENT_MIN_GAP seconds - the correction
+ * is rendered again on top of the unmodified base ramps and uploaded.
+ * While the level is stable, the source is read less often, down to
+ * a quarter of the poll rate.
+ *
+ * returns the number of uploads
+ */
+int
+run_ambient(Display * dpy, int screen, RRCrtc crtc, int xrr_version,
+            const char * source, struct ambient_point_t * points, int numPoints,
+            int interval, int invert, u_int16_t * baseRamps, unsigned int nEntries)
+{
+  u_int16_t * ramps = (u_int16_t *) malloc(3 * nEntries * sizeof(u_int16_t));
+  double lux, smoothed = -1.0, alpha, t, brightness, contrast;
+  double lastBrightness = -100.0, lastContrast = -100.0;
+  unsigned long long now, lastRead = now_ns(), lastUpload = 0;
+  struct timespec pause;
+  int uploads = 0, stable = 0, k;
+
+  signal(SIGINT, resident_signal);
+  signal(SIGTERM, resident_signal);
+
+  while(!resident_quit)
+  {
+    if((lux = read_illuminance(source)) < 0.0)
+      warning("Unable to read light level from '%s'", source);
+    else
+    {
+      now = now_ns();
+      alpha = 1.0 - exp(-(double)(now - lastRead) / 1e9 / AMBIENT_SMOOTHING);
+      lastRead = now;
+      smoothed = smoothed < 0.0 ? lux : smoothed + alpha * (lux - smoothed);
+
+      /* piecewise linear mapping, constant beyond the end points */
+      for(k=0; k < numPoints - 1 && smoothed > points[k+1].lux; k++)
+        ;
+      if(k == numPoints - 1 || smoothed <= points[0].lux)
+      {
+        k = smoothed <= points[0].lux ? 0 : numPoints - 1;
+        brightness = points[k].brightness;
+        contrast = points[k].contrast;
+      }
+      else
+      {
+        t = (smoothed - points[k].lux) / (points[k+1].lux - points[k].lux);
+        brightness = points[k].brightness + t * (points[k+1].brightness - points[k].brightness);
+        contrast = points[k].contrast + t * (points[k+1].contrast - points[k].contrast);
+      }
+
+      if((fabs(brightness - lastBrightness) >= AMBIENT_STEP ||
+          fabs(contrast - lastContrast) >= AMBIENT_STEP) &&
+         now - lastUpload >= AMBIENT_MIN_GAP * 1e9)
+      {
+        xcalib_state.redMin = xcalib_state.greenMin = xcalib_state.blueMin = brightness / 100.0;
+        xcalib_state.redMax = xcalib_state.greenMax = xcalib_state.blueMax =
+          (1.0 - xcalib_state.redMin) * (contrast / 100.0) + xcalib_state.redMin;
+        memcpy(ramps, baseRamps, 3 * nEntries * sizeof(u_int16_t));
+        apply_correction(&xcalib_state, ramps, ramps + nEntries, ramps + 2*nEntries,
+                         nEntries);
+        if(invert)
+          invert_ramps(ramps, ramps + nEntries, ramps + 2*nEntries, nEntries);
+        if(!set_display_ramps(dpy, screen, crtc, xrr_version, ramps,
+                              ramps + nEntries, ramps + 2*nEntries, nEntries))
+          warning ("Unable to calibrate display");
+        else if(!audit_apply(ramps, ramps + nEntries, ramps + 2*nEntries, nEntries,
+                             AUDIT_AMBIENT | (invert ? AUDIT_INVERT : 0)))
+          warning ("Unable to write audit log");
+        XFlush(dpy);
+        message("%.1f lux: brightness %.1f  contrast %.1f\n", smoothed, brightness, contrast);
+        lastBrightness = brightness;
+        lastContrast = contrast;
+        lastUpload = now;
+        uploads++;
+        stable = 0;
+      }
+      else if(stable < 3)
+        stable++;
+    }
+
+    k = interval * (1 + stable);
+    pause.tv_sec = k / 1000;
+    pause.tv_nsec = (k % 1000) * 1000000L;
+    nanosleep(&pause, NULL);
+  }
+
+  free(ramps);
+  return uploads;
+}
+
+/* upload ready ramps of the resident modes, one per distinct content */
+struct ramp_entry_t {
+  XRRCrtcGamma gamma;       /* first, the entry is found from its gamma */
+  unsigned long long hash;  /* like the ramp_hash of -inventory */
+  int refs;
+  int fd;                   /* of the shared file with -lowmem, else -1 */
+  size_t bytes;             /* of the three ramps */
+  struct ramp_entry_t * next;
+};
+
+/* content addressed, reference counted ramps, see -lowmem */
+struct ramp_store_t {
+  int shared;               /* keep ramps in files mapped by all sessions */
+  struct ramp_entry_t * entries;
+  int count;
+  size_t private_bytes;     /* entries and ramps on the heap */
+  size_t shared_bytes;      /* ramps mapped from RAMP_STORE_DIR */
+} ramp_store = { 0, NULL, 0, 0, 0 };
+
+/*
+ * FUNCTION ramp_store_path
+ */
+void
+ramp_store_path(char * path, size_t length, unsigned long long hash, int size)
+{
+  snprintf(path, length, "%s/xcalib-%016llx-%d", RAMP_STORE_DIR, hash, size);
+}
+
+/*
+ * FUNCTION ramp_store_cleanup
+ *
+ * remove the shared files no other session maps at exit, which may
+ * also come from an X I/O error; files of killed sessions are reused
+ */
+void
+ramp_store_cleanup(void)
+{
+  struct ramp_entry_t * entry;
+  char path[256];
+
+  for(entry = ramp_store.entries; entry; entry = entry->next)
+    if(entry->fd >= 0 && flock(entry->fd, LOCK_EX | LOCK_NB) == 0)
+    {
+      ramp_store_path(path, sizeof(path), entry->hash, entry->gamma.size);
+      unlink(path);
+    }
+}
+
+/*
+ * FUNCTION ramp_store_map
+ *
+ * map the ramps of an entry from the file all sessions share for this
+ * content, creating it first if no session did yet. Files appear
+ * complete through rename() and are only used if they hold exactly
+ * the expected ramps, so a stale or foreign file cannot change the
+ * calibration. Every user holds a shared lock on the file.
+ *
+ * returns 0 if the ramps have to stay private
+ */
+int
+ramp_store_map(struct ramp_entry_t * entry, u_int16_t * ramp, int size)
+{
+  static int cleanup = 0;
+  char path[256], temp[280];
+  struct stat st;
+  void * map;
+  int fd;
+
+  if(!cleanup++)
+    atexit(ramp_store_cleanup);
+  ramp_store_path(path, sizeof(path), entry->hash, size);
+  if((fd = open(path, O_RDONLY)) < 0)
+  {
+    snprintf(temp, sizeof(temp), "%s.%d", path, (int)getpid());
+    if((fd = open(temp, O_WRONLY | O_CREAT | O_EXCL, 0644)) < 0)
+      return 0;
+    if(write(fd, ramp, entry->bytes) != (ssize_t)entry->bytes || rename(temp, path) != 0)
+    {
+      close(fd);
+      unlink(temp);
+      return 0;
+    }
+    close(fd);
+    if((fd = open(path, O_RDONLY)) < 0)
+      return 0;
+  }
+  if(fstat(fd, &st) != 0 || st.st_size != (off_t)entry->bytes || flock(fd, LOCK_SH) != 0 ||
+     (map = mmap(NULL, entry->bytes, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+  {
+    close(fd);
+    return 0;
+  }
+  if(memcmp(map, ramp, entry->bytes))
+  {
+    munmap(map, entry->bytes);
+    close(fd);
+    return 0;
+  }
+  entry->fd = fd;
+  entry->gamma.red = (unsigned short *) map;
+  return 1;
+}
+
+/*
+ * FUNCTION ramp_store_get
+ *
+ * returns the entry holding these three ramps of size entries each
+ * (red, then green, then blue) as an XRRCrtcGamma ready for upload;
+ * existing entries gain a reference. The ramps may be freed at once.
+ */
+XRRCrtcGamma *
+ramp_store_get(u_int16_t * ramp, int size)
+{
+  unsigned long long h = FNV_OFFSET;
+  struct ramp_entry_t * entry;
+  struct ramp_stats_t stats;
+  size_t bytes = 3 * size * sizeof(u_int16_t);
+
+  ramp_statistics(ramp, size, &stats, &h);
+  ramp_statistics(ramp + size, size, &stats, &h);
+  ramp_statistics(ramp + 2*size, size, &stats, &h);
+  for(entry = ramp_store.entries; entry; entry = entry->next)
+    if(entry->hash == h && entry->gamma.size == size && !memcmp(entry->gamma.red, ramp, bytes))
+    {
+      entry->refs++;
+      return &entry->gamma;
+    }
+
+  if(ramp_store.shared && (entry = (struct ramp_entry_t *) malloc(sizeof(*entry))) != NULL)
+  {
+    entry->hash = h;
+    entry->bytes = bytes;
+    if(ramp_store_map(entry, ramp, size))
+    {
+      ramp_store.private_bytes += sizeof(*entry);
+      ramp_store.shared_bytes += bytes;
+    }
+    else
+    {
+      free(entry);
+      entry = NULL;
+    }
+  }
+  if(!entry)
+  {
+    if((entry = (struct ramp_entry_t *) malloc(sizeof(*entry) + bytes)) == NULL)
+      return NULL;
+    entry->hash = h;
+    entry->bytes = bytes;
+    entry->fd = -1;
+    entry->gamma.red = (unsigned short *)(entry + 1);
+    memcpy(entry->gamma.red, ramp, bytes);
+    ramp_store.private_bytes += sizeof(*entry) + bytes;
+  }
+  entry->gamma.size = size;
+  entry->gamma.green = entry->gamma.red + size;
+  entry->gamma.blue = entry->gamma.red + 2*size;
+  entry->refs = 1;
+  entry->next = ramp_store.entries;
+  ramp_store.entries = entry;
+  ramp_store.count++;
+  return &entry->gamma;
+}
+
+/*
+ * FUNCTION ramp_store_ref
+ *
+ * returns the entry with one more reference
+ */
+XRRCrtcGamma *
+ramp_store_ref(XRRCrtcGamma * gamma)
+{
+  ((struct ramp_entry_t *) gamma)->refs++;
+  return gamma;
+}
+
+/*
+ * FUNCTION ramp_store_put
+ *
+ * drop a reference; the last one frees the entry, and the last session
+ * mapping a shared file removes it
+ */
+void
+ramp_store_put(XRRCrtcGamma * gamma)
+{
+  struct ramp_entry_t * entry = (struct ramp_entry_t *) gamma, ** link;
+  char path[256];
+
+  if(!gamma || --entry->refs > 0)
+    return;
+  for(link = &ramp_store.entries; *link != entry; link = &(*link)->next)
+    ;
+  *link = entry->next;
+  ramp_store.count--;
+  if(entry->fd >= 0)
+  {
+    munmap(entry->gamma.red, entry->bytes);
+    if(flock(entry->fd, LOCK_EX | LOCK_NB) == 0)
+    {
+      ramp_store_path(path, sizeof(path), entry->hash, entry->gamma.size);
+      unlink(path);
+    }
+    close(entry->fd);
+    ramp_store.private_bytes -= sizeof(*entry);
+    ramp_store.shared_bytes -= entry->bytes;
+  }
+  else
+    ramp_store.private_bytes -= sizeof(*entry) + entry->bytes;
+  free(entry);
+}
+
+/*
+ * FUNCTION ramp_store_report
+ *
+ * print the memory the ramps of this session hold plus the
+ * bookkeeping the caller keeps per output, which is all a further
+ * output with ramps already stored costs; always with -lowmem, else
+ * with -verbose
+ */
+void
+ramp_store_report(const char * mode, int outputs, size_t perOutput)
+{
+  char text[256];
+
+  snprintf(text, sizeof(text), "%s: %d outputs, %d distinct ramps, %lu bytes private, "
+           "%lu bytes shared between sessions, %lu bytes per further output\n", mode,
+           outputs, ramp_store.count,
+           (unsigned long)(ramp_store.private_bytes + outputs * perOutput),
+           (unsigned long)ramp_store.shared_bytes, (unsigned long)perOutput);
+  if(ramp_store.shared)
+  {
+    fputs(text, stdout);
+    fflush(stdout);
+  }
+  else
+    message("%s", text);
+#ifdef __GLIBC__
+  /* give the freed parse buffers back */
+  if(ramp_store.shared)
+    malloc_trim(0);
+#endif
+}
+
+/* ramps of one gamma size rendered for -watch */
+struct watch_ramps_t {
+  int size;
+  XRRCrtcGamma * gamma;     /* from the ramp store */
+};
+
+static unsigned long watch_errors = 0;
+static int watch_rr_error = 0;
+static XErrorHandler watch_previous = NULL;
+
+/*
+ * FUNCTION watch_error
+ *
+ * X error handler of -watch and -preset: a CRTC may vanish or change
+ * its gamma size between discovery and upload, which -watch retries on
+ * the event announcing it. Other errors go to the previous handler.
+ */
+int
+watch_error(Display * dpy, XErrorEvent * event)
+{
+  if(event->error_code == BadMatch ||
+     event->error_code == watch_rr_error + BadRRCrtc)
+  {
+    watch_errors++;
+    return 0;
+  }
+  return watch_previous ? watch_previous(dpy, event) : 0;
+}
+
+/*
+ * FUNCTION watch_catch
+ *
+ * installs watch_error, which needs the RandR error base to tell
+ * BadRRCrtc from other errors
+ *
+ * returns the previous handler
+ */
+XErrorHandler
+watch_catch(Display * dpy)
+{
+  int event_base;
+
+  if(!XRRQueryExtension(dpy, &event_base, &watch_rr_error))
+    watch_rr_error = 0;
+  return watch_previous = XSetErrorHandler(watch_error);
+}
+
+/*
+ * FUNCTION watch_render
+ *
+ * returns the ramps for a gamma size, rendered from the profile like
+ * at startup or resampled from the startup ramps with -alter, or NULL
+ * without memory. The last WATCH_SIZES sizes are kept.
+ */
+XRRCrtcGamma *
+watch_render(struct watch_ramps_t * cache, int size, const char * profile,
+             int correction, int invert, u_int16_t * rRamp, u_int16_t * gRamp,
+             u_int16_t * bRamp, unsigned int nEntries)
+{
+  static unsigned int next = 0;
+  struct watch_ramps_t * slot;
+  u_int16_t * ramp;
+  int k;
+
+  for(k=0; k<WATCH_SIZES; k++)
+    if(cache[k].size == size)
+      return cache[k].gamma;
+
+  if((ramp = (u_int16_t *) malloc(3 * size * sizeof(u_int16_t))) == NULL)
+    return NULL;
+  if(profile && read_vcgt_internal(profile, ramp, ramp + size, ramp + 2*size, size) > 0)
+  {
+    if(correction)
+      apply_correction(&xcalib_state, ramp, ramp + size, ramp + 2*size, size);
+    if(invert)
+      invert_ramps(ramp, ramp + size, ramp + 2*size, size);
+  }
+  else
+  {
+    resample_ramp(rRamp, nEntries, ramp, size);
+    resample_ramp(gRamp, nEntries, ramp + size, size);
+    resample_ramp(bRamp, nEntries, ramp + 2*size, size);
+  }
+
+  slot = &cache[next++ % WATCH_SIZES];
+  ramp_store_put(slot->gamma);
+  slot->gamma = ramp_store_get(ramp, size);
+  slot->size = slot->gamma ? size : 0;
+  free(ramp);
+  return slot->gamma;
+}
+
+/*
+ * FUNCTION watch_outputs
+ *
+ * resident mode keeping the calibration on all CRTCs: after any
+ * RandR screen, CRTC or output change - all events queued at that
+ * time count as one - the CRTCs are discovered again and each gets
+ * the ramps rendered for its gamma size
+ *
+ * returns the number of uploads
+ */
+int
+watch_outputs(Display * dpy, int screen, const char * profile, int correction,
+              int invert, u_int16_t * rRamp, u_int16_t * gRamp, u_int16_t * bRamp,
+              unsigned int nEntries)
+{
+  struct watch_ramps_t cache[WATCH_SIZES];
+  XRRScreenResources * res;
+  struct pollfd pfd;
+  XEvent event;
+  XErrorHandler oldHandler;
+  unsigned long long start;
+  unsigned long events = 0, rounds = 0;
+  int uploads = 0, size, k, i, changed = 1, applied, output;
+  int * numbers;
+  XRRCrtcGamma * gamma;
+
+  memset(cache, 0, sizeof(cache));
+  XRRSelectInput(dpy, RootWindow(dpy, screen), RRScreenChangeNotifyMask |
+                 RRCrtcChangeNotifyMask | RROutputChangeNotifyMask);
+  oldHandler = watch_catch(dpy);
+  signal(SIGINT, resident_signal);
+  signal(SIGTERM, resident_signal);
+  pfd.fd = ConnectionNumber(dpy);
+  pfd.events = POLLIN;
+
+  while(!resident_quit)
+  {
+    while(XPending(dpy))
+    {
+      XNextEvent(dpy, &event);
+      XRRUpdateConfiguration(&event);
+      events++;
+      changed = 1;
+    }
+    if(!changed)
+    {
+      /* wake up now and then to notice signals */
+      poll(&pfd, 1, 500);
+      continue;
+    }
+    changed = 0;
+
+    start = now_ns();
+    if((res = XRRGetScreenResourcesCurrent(dpy, RootWindow(dpy, screen))) == NULL)
+      continue;
+    /* audit records name outputs counted like -output, not CRTCs */
+    numbers = audit_log.fp ? (int *) malloc(res->ncrtc * sizeof(int) + 1) : NULL;
+    for(k=0; numbers && k<res->ncrtc; k++)
+      numbers[k] = -1;
+    for(i=0, output=0; numbers && i<res->noutput; i++)
+    {
+      XRROutputInfo * output_info = XRRGetOutputInfo(dpy, res, res->outputs[i]);
+      if(output_info && output_info->crtc)
+      {
+        for(k=0; k<res->ncrtc; k++)
+          if(res->crtcs[k] == output_info->crtc && numbers[k] < 0)
+            numbers[k] = output;
+        output++;
+      }
+      if(output_info)
+        XRRFreeOutputInfo(output_info);
+    }
+    for(k=0, applied=0; k<res->ncrtc; k++)
+    {
+      if((size = XRRGetCrtcGammaSize(dpy, res->crtcs[k])) <= 0)
+        continue;
+      if((gamma = watch_render(cache, size, profile, correction, invert,
+                               rRamp, gRamp, bRamp, nEntries)) == NULL)
+        continue;
+      XRRSetCrtcGamma(dpy, res->crtcs[k], gamma);
+      audit_log.record.output = numbers ? numbers[k] : -1;
+      audit_apply(gamma->red, gamma->green, gamma->blue, size, AUDIT_WATCH |
+                  (profile ? 0 : AUDIT_ALTER) | (invert ? AUDIT_INVERT : 0));
+      applied++;
+    }
+    XRRFreeScreenResources(res);
+    free(numbers);
+    XSync(dpy, False);
+    uploads += applied;
+    rounds++;
+    message("%d CRTCs calibrated in %.3f ms\n", applied, (now_ns() - start) / 1e6);
+    /* once at startup; a hotplug storm must not print and trim each time */
+    if(rounds == 1 || xcalib_state.verbose)
+      ramp_store_report("-watch", applied, 0);
+  }
+
+  XSetErrorHandler(oldHandler);
+  for(k=0; k<WATCH_SIZES; k++)
+    ramp_store_put(cache[k].gamma);
+  message("%lu events, %lu updates, %lu X errors\n", events, rounds, watch_errors);
+  return uploads;
+}
+
+/* a -preset bank: a name and one profile per output */
+struct preset_t {
+  const char * name;
+  const char * profiles;    /* comma separated, the last one for all further outputs */
+};
+
+/* the banks of one CRTC, pre-rendered at its gamma size for -preset */
+struct preset_output_t {
+  RRCrtc crtc;
+  int size;                 /* 0 if the CRTC has no gamma */
+  int current;              /* bank on the CRTC, -1 before the first switch */
+  XRRCrtcGamma * gamma[PRESET_BANKS];     /* from the ramp store */
+  unsigned long long hash[PRESET_BANKS];  /* of the profile, for -auditlog */
+};
+
+static volatile sig_atomic_t preset_signals = 0;
+
+/*
+ * FUNCTION preset_signal
+ *
+ * signal handler of -preset, each signal moves all outputs to their
+ * next bank
+ */
+void
+preset_signal(int sig)
+{
+  (void) sig;
+  preset_signals++;
+}
+
+/*
+ * FUNCTION preset_profile
+ *
+ * copy the profile of an output out of the comma separated list of a
+ * bank; outputs beyond the list use its last entry
+ */
+void
+preset_profile(const char * profiles, int output, char * name, size_t length)
+{
+  const char * end;
+
+  while(output-- > 0 && (end = strchr(profiles, ',')) != NULL)
+    profiles = end + 1;
+  if((end = strchr(profiles, ',')) == NULL)
+    end = profiles + strlen(profiles);
+  if((size_t)(end - profiles) >= length)
+    end = profiles + length - 1;
+  memcpy(name, profiles, end - profiles);
+  name[end - profiles] = '\0';
+}
+
+/*
+ * FUNCTION render_presets
+ *
+ * find the CRTCs, counted like -output, and render every bank at the
+ * gamma size of each into the ramp store. "clear" is a linear ramp
+ * like -clear; a profile already rendered for an earlier CRTC of the
+ * same size is shared instead of parsed again.
+ *
+ * returns the number of CRTCs or -1 if a profile could not be read
+ */
+int
+render_presets(Display * dpy, int screen, struct preset_t * presets, int numPresets,
+               int correction, int invert, struct preset_output_t ** outputs)
+{
+  XRRScreenResources * res;
+  struct preset_output_t * out;
+  char name[256], other[256];
+  int n = 0, i, j, b, size;
+  u_int16_t * ramp;
+
+  *outputs = NULL;
+  if((res = XRRGetScreenResourcesCurrent(dpy, RootWindow(dpy, screen))) == NULL)
+    return 0;
+  *outputs = out = (struct preset_output_t *) calloc(res->noutput + 1, sizeof(*out));
+  for(i = 0; i < res->noutput; ++i)
+  {
+    XRROutputInfo * output_info = XRRGetOutputInfo(dpy, res, res->outputs[i]);
+    if(output_info && output_info->crtc)
+    {
+      out[n].crtc = output_info->crtc;
+      out[n].size = XRRGetCrtcGammaSize(dpy, out[n].crtc);
+      out[n].current = -1;
+      n++;
+    }
+    if(output_info)
+      XRRFreeOutputInfo(output_info);
+  }
+  XRRFreeScreenResources(res);
+
+  for(i = 0; i < n; ++i)
+  {
+    if((size = out[i].size) <= 0)
+      continue;
+    if((ramp = (u_int16_t *) malloc(3 * size * sizeof(u_int16_t))) == NULL)
+      return -1;
+    for(b = 0; b < numPresets; ++b)
+    {
+      preset_profile(presets[b].profiles, i, name, sizeof(name));
+      if(audit_log.fp && strcmp(name, "clear"))
+        out[i].hash[b] = hash_file(name);
+
+      for(j = 0; j < i; ++j)
+      {
+        preset_profile(presets[b].profiles, j, other, sizeof(other));
+        if(out[j].size == size && !strcmp(name, other))
+          break;
+      }
+      if(j < i)
+      {
+        out[i].gamma[b] = ramp_store_ref(out[j].gamma[b]);
+        continue;
+      }
+      if(!strcmp(name, "clear"))
+      {
+        for(j = 0; j < size; ++j)
+          ramp[j] = ramp[size + j] = ramp[2*size + j] = j * 65535 / size;
+      }
+      else if(read_vcgt_internal(name, ramp, ramp + size, ramp + 2*size, size) <= 0)
+      {
+        warning ("Unable to read calibration of preset '%s' from '%s'", presets[b].name, name);
+        free(ramp);
+        return -1;
+      }
+      else
+      {
+        if(correction)
+          apply_correction(&xcalib_state, ramp, ramp + size, ramp + 2*size, size);
+        if(invert)
+          invert_ramps(ramp, ramp + size, ramp + 2*size, size);
+      }
+      if((out[i].gamma[b] = ramp_store_get(ramp, size)) == NULL)
+      {
+        free(ramp);
+        return -1;
+      }
+    }
+    /* the parse buffer goes as soon as the output is done */
+    free(ramp);
+  }
+  return n;
+}
+
+/*
+ * FUNCTION switch_presets
+ *
+ * put a bank, or with bank -1 the next bank of each, on one output
+ * or with output -1 on all. This is one SetCrtcGamma request per CRTC
+ * out of the pre-rendered banks - no parsing, resampling or
+ * allocation.
+ *
+ * returns the number of CRTCs switched
+ */
+int
+switch_presets(Display * dpy, struct preset_output_t * outputs, int numOutputs,
+               int numPresets, int output, int bank)
+{
+  unsigned long long start = now_ns();
+  int k, next, switched = 0;
+
+  for(k = 0; k < numOutputs; ++k)
+  {
+    if((output >= 0 && k != output) || !outputs[k].size)
+      continue;
+    next = bank >= 0 ? bank : (outputs[k].current + 1) % numPresets;
+    XRRSetCrtcGamma(dpy, outputs[k].crtc, outputs[k].gamma[next]);
+    outputs[k].current = next;
+    switched++;
+  }
+  XFlush(dpy);
+  message("%d CRTCs switched in %.3f ms\n", switched, (now_ns() - start) / 1e6);
+
+  /* bookkeeping only after the requests left */
+  for(k = 0; audit_log.fp && k < numOutputs; ++k)
+  {
+    XRRCrtcGamma * gamma;
+    if((output >= 0 && k != output) || !outputs[k].size)
+      continue;
+    gamma = outputs[k].gamma[outputs[k].current];
+    audit_log.record.output = k;
+    audit_log.record.profile_hash = outputs[k].hash[outputs[k].current];
+    audit_apply(gamma->red, gamma->green, gamma->blue, gamma->size, AUDIT_PRESET);
+  }
+  return switched;
+}
+
+/*
+ * FUNCTION preset_command
+ *
+ * handle one line of standard input: "next", "<bank>" or
+ * "<output> <bank>", where a bank is given by name or number
+ *
+ * returns 0 if the line is not understood
+ */
+int
+preset_command(Display * dpy, struct preset_t * presets, int numPresets,
+               struct preset_output_t * outputs, int numOutputs, char * line)
+{
+  char first[64], second[64];
+  char * bankName, * end;
+  int output = -1, bank, fields;
+
+  fields = sscanf(line, "%63s %63s", first, second);
+  if(fields <= 0)
+    return 1;
+  bankName = fields == 2 ? second : first;
+  if(fields == 2)
+  {
+    output = strtol(first, &end, 10);
+    if(*end || output < 0 || output >= numOutputs)
+      return 0;
+  }
+
+  if(!strcmp(bankName, "next"))
+    bank = -1;
+  else
+  {
+    for(bank = 0; bank < numPresets && strcmp(presets[bank].name, bankName); ++bank)
+      ;
+    if(bank == numPresets)
+    {
+      bank = strtol(bankName, &end, 10);
+      if(*end || bank < 0 || bank >= numPresets)
+        return 0;
+    }
+  }
+  switch_presets(dpy, outputs, numOutputs, numPresets, output, bank);
+  return 1;
+}
+
+/*
+ * FUNCTION run_presets
+ *
+ * resident mode of -preset: render all banks, then switch on SIGUSR1
+ * (all outputs to their next bank) or commands on standard input
+ * until SIGINT or SIGTERM
+ *
+ * returns the number of switches
+ */
+int
+run_presets(Display * dpy, int screen, struct preset_t * presets, int numPresets,
+            int correction, int invert)
+{
+  struct preset_output_t * outputs;
+  struct pollfd pfd[2];
+  XErrorHandler oldHandler;
+  XEvent event;
+  char line[256];
+  int numOutputs, handled = 0, switches = 0, used = 0, k, b;
+  ssize_t got;
+  char * newline;
+
+  if((numOutputs = render_presets(dpy, screen, presets, numPresets, correction,
+                                  invert, &outputs)) > 0)
+  {
+    /* a CRTC vanishing must not end the process */
+    oldHandler = watch_catch(dpy);
+    signal(SIGINT, resident_signal);
+    signal(SIGTERM, resident_signal);
+    signal(SIGUSR1, preset_signal);
+    pfd[0].fd = 0;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = ConnectionNumber(dpy);
+    pfd[1].events = POLLIN;
+    message("%d presets on %d CRTCs ready\n", numPresets, numOutputs);
+    ramp_store_report("-preset", numOutputs, sizeof(*outputs));
+
+    while(!resident_quit)
+    {
+      for(; handled != preset_signals; handled++, switches++)
+        switch_presets(dpy, outputs, numOutputs, numPresets, -1, -1);
+
+      /* interrupted by signals at once, wakes up now and then anyway */
+      if(poll(pfd, 2, 500) <= 0)
+        continue;
+      while(XPending(dpy))
+        XNextEvent(dpy, &event);
+      if(!(pfd[0].revents & (POLLIN | POLLHUP)))
+        continue;
+      if((got = read(0, line + used, sizeof(line) - 1 - used)) <= 0)
+      {
+        /* end of input, signals still work */
+        pfd[0].fd = -1;
+        continue;
+      }
+      used += got;
+      line[used] = '\0';
+      while((newline = strchr(line, '\n')) != NULL || used == sizeof(line) - 1)
+      {
+        if(newline)
+          *newline = '\0';
+        if(!preset_command(dpy, presets, numPresets, outputs, numOutputs, line))
+          warning ("unknown preset command '%s'", line);
+        else
+          switches++;
+        k = newline ? newline + 1 - line : used;
+        memmove(line, line + k, used - k + 1);
+        used -= k;
+      }
+    }
+    XSetErrorHandler(oldHandler);
+  }
+
+  for(k = 0; outputs && k < numOutputs; ++k)
+    for(b = 0; b < numPresets; ++b)
+      ramp_store_put(outputs[k].gamma[b]);
+  free(outputs);
+  return numOutputs < 0 ? -1 : switches;
+}
+
+/* one CRTC of -map and its ramps */
+struct map_output_t {
+  RRCrtc crtc;
+  int size;
+  int output;               /* counted like -output */
+  char profile[256];
+  u_int16_t * ramp;         /* 3 * size entries, NULL if it failed */
+  unsigned long long hash;  /* of the profile, for -auditlog */
+};
+
+/* the CRTCs of -map shared with its workers */
+struct map_t {
+  struct map_output_t * out;
+  int numOutputs;
+  volatile int next;        /* next output to render */
+  int correction, invert;
+  int * order;              /* outputs in the order they got ready */
+  int done;                 /* entries of order, under the lock */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+/*
+ * FUNCTION map_worker
+ *
+ * render outputs of -map until none is left, like the image workers
+ * taking the next one with an atomic increment
+ */
+void *
+map_worker(void * arg)
+{
+  struct map_t * map = (struct map_t *) arg;
+  struct map_output_t * out;
+  u_int16_t * ramp;
+  int k, j, size;
+
+  while((k = __sync_fetch_and_add(&map->next, 1)) < map->numOutputs)
+  {
+    out = &map->out[k];
+    size = out->size;
+    if((ramp = (u_int16_t *) malloc(3 * size * sizeof(u_int16_t))) == NULL)
+      ;
+    else if(!strcmp(out->profile, "clear"))
+    {
+      for(j = 0; j < size; ++j)
+        ramp[j] = ramp[size + j] = ramp[2*size + j] = j * 65535 / size;
+    }
+    else if(read_vcgt_internal(out->profile, ramp, ramp + size, ramp + 2*size, size) <= 0)
+    {
+      free(ramp);
+      ramp = NULL;
+    }
+    else
+    {
+      if(map->correction)
+        apply_correction(&xcalib_state, ramp, ramp + size, ramp + 2*size, size);
+      if(map->invert)
+        invert_ramps(ramp, ramp + size, ramp + 2*size, size);
+      /* the file is read here, not between two uploads */
+      if(audit_log.fp)
+        out->hash = hash_file(out->profile);
+    }
+
+    pthread_mutex_lock(&map->lock);
+    out->ramp = ramp;
+    map->order[map->done++] = k;
+    pthread_cond_signal(&map->cond);
+    pthread_mutex_unlock(&map->lock);
+  }
+  return NULL;
+}
+
+/*
+ * FUNCTION map_outputs
+ *
+ * calibrate every CRTC, counted like -output, with its own profile out
+ * of a comma separated list, where the last one counts for all further
+ * outputs and "clear" is a linear ramp. The ramps are parsed and
+ * rendered at the gamma size of each CRTC by one thread per online CPU
+ * while this thread uploads each as soon as it is ready, so the first
+ * CRTC is calibrated before the last ramps are computed. The MHC2
+ * matrix of a profile is not set.
+ *
+ * returns the number of CRTCs calibrated or -1 if a profile could not
+ * be read or without memory
+ */
+int
+map_outputs(Display * dpy, int screen, const char * profiles, int correction, int invert)
+{
+  XRRScreenResources * res;
+  struct map_t map;
+  struct map_output_t * out;
+  pthread_t threads[MAX_THREADS];
+  XRRCrtcGamma gamma;
+  unsigned long long start, first = 0, last = 0;
+  int numThreads, uploads = 0, failed = 0, n = 0, output = 0, ready, i, k;
+  int * order;
+  long cpus;
+
+  start = now_ns();
+  if((res = XRRGetScreenResourcesCurrent(dpy, RootWindow(dpy, screen))) == NULL)
+    return 0;
+  out = (struct map_output_t *) calloc(res->noutput + 1, sizeof(*out));
+  order = (int *) calloc(res->noutput + 1, sizeof(int));
+  if(!out || !order)
+  {
+    free(out);
+    free(order);
+    XRRFreeScreenResources(res);
+    return -1;
+  }
+  for(i = 0; i < res->noutput; ++i)
+  {
+    XRROutputInfo * output_info = XRRGetOutputInfo(dpy, res, res->outputs[i]);
+    if(output_info && output_info->crtc)
+    {
+      out[n].crtc = output_info->crtc;
+      out[n].size = XRRGetCrtcGammaSize(dpy, out[n].crtc);
+      out[n].output = output;
+      preset_profile(profiles, output++, out[n].profile, sizeof(out[n].profile));
+      /* CRTCs without gamma are done already but keep their profile */
+      if(out[n].size > 0)
+        n++;
+    }
+    if(output_info)
+      XRRFreeOutputInfo(output_info);
+  }
+  XRRFreeScreenResources(res);
+
+  memset(&map, 0, sizeof(map));
+  map.out = out;
+  map.order = order;
+  map.numOutputs = n;
+  map.correction = correction;
+  map.invert = invert;
+  pthread_mutex_init(&map.lock, NULL);
+  pthread_cond_init(&map.cond, NULL);
+  cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  numThreads = cpus < 1 ? 1 : cpus > MAX_THREADS ? MAX_THREADS : cpus;
+  if(numThreads > n)
+    numThreads = n;
+  for(i = 0; i < numThreads; i++)
+    if(pthread_create(&threads[i], NULL, map_worker, &map))
+      break;
+  numThreads = i;
+  /* without threads the ramps are rendered here before the uploads */
+  if(!numThreads)
+    map_worker(&map);
+
+  for(k = 0; k < n; )
+  {
+    pthread_mutex_lock(&map.lock);
+    while(map.done == k)
+      pthread_cond_wait(&map.cond, &map.lock);
+    ready = map.done;
+    pthread_mutex_unlock(&map.lock);
+
+    /* in the order they got ready; the workers are done with these */
+    for(; k < ready; k++)
+    {
+      i = order[k];
+      if(!out[i].ramp)
+      {
+        warning ("Unable to read calibration of output %d from '%s'", out[i].output, out[i].profile);
+        failed = 1;
+        continue;
+      }
+      gamma.size = out[i].size;
+      gamma.red = out[i].ramp;
+      gamma.green = out[i].ramp + out[i].size;
+      gamma.blue = out[i].ramp + 2*out[i].size;
+      XRRSetCrtcGamma(dpy, out[i].crtc, &gamma);
+      XFlush(dpy);
+      last = now_ns();
+      if(!uploads++)
+        first = last;
+      if(audit_log.fp)
+      {
+        audit_log.record.output = out[i].output;
+        audit_log.record.profile_hash = out[i].hash;
+        audit_apply(gamma.red, gamma.green, gamma.blue, gamma.size, invert ? AUDIT_INVERT : 0);
+      }
+    }
+  }
+
+  for(i = 0; i < numThreads; i++)
+    pthread_join(threads[i], NULL);
+  pthread_mutex_destroy(&map.lock);
+  pthread_cond_destroy(&map.cond);
+  for(i = 0; i < n; ++i)
+    free(out[i].ramp);
+  free(out);
+  free(order);
+
+  message("%d CRTCs calibrated with %d threads, first upload after %.3f ms, last after %.3f ms\n",
+          uploads, numThreads, uploads ? (first - start) / 1e6 : 0.0,
+          uploads ? (last - start) / 1e6 : 0.0);
+  return failed ? -1 : uploads;
+}
+
+/*
+ * FUNCTION print_json_channel
+ *
+ * print the statistics of one channel as a JSON object member
+ */
+void
+print_json_channel(const char * name, u_int16_t * ramp, unsigned int nEntries,
+                   unsigned long long * hash, const char * separator)
+{
+  struct ramp_stats_t stats;
+
+  ramp_statistics(ramp, nEntries, &stats, hash);
+  fprintf(stdout, "\"%s\": {\"brightness\": %.4f, \"contrast\": %.4f, "
+          "\"min\": %.6f, \"max\": %.6f, \"increasing\": %s}%s",
+          name, stats.brightness, stats.contrast, stats.min, stats.max,
+          stats.increasing ? "true" : "false", separator);
+}
+
+/*
+ * FUNCTION print_json_string
+ *
+ * print a string as JSON string literal
+ */
+void
+print_json_string(const char * string)
+{
+  fputc('"', stdout);
+  for(; *string; string++)
+  {
+    if(*string == '"' || *string == '\\')
+      fprintf(stdout, "\\%c", *string);
+    else if((unsigned char)*string < 0x20)
+      fprintf(stdout, "\\u%04x", *string);
+    else
+      fputc(*string, stdout);
+  }
+  fputc('"', stdout);
+}
+
+/*
+ * FUNCTION print_inventory
+ *
+ * print the gamma state of all outputs of a screen as one JSON
+ * document. The screen resources are taken from the server's current
+ * configuration, so no output probing is triggered; outputs are
+ * numbered like the -output option counts them.
+ */
+void
+print_inventory(Display * dpy, int screen, int xrr_version)
+{
+  unsigned long long hash;
+  int i, ncrtc = 0, printed = 0, size;
+
+  fprintf(stdout, "{\"display\": ");
+  print_json_string(DisplayString(dpy));
+  fprintf(stdout, ", \"screen\": %d, \"randr\": %d.%d, \"outputs\": [",
+          screen, xrr_version / 100, xrr_version % 100);
+
+  if(xrr_version >= 102)
+  {
+    XRRScreenResources * res = xrr_version >= 103 ?
+      XRRGetScreenResourcesCurrent(dpy, RootWindow(dpy, screen)) :
+      XRRGetScreenResources(dpy, RootWindow(dpy, screen));
+
+    for(i = 0; res && i < res->noutput; ++i)
+    {
+      XRROutputInfo * output_info = XRRGetOutputInfo(dpy, res, res->outputs[i]);
+      XRRCrtcGamma * gamma = NULL;
+
+      if(!output_info)
+        continue;
+      fprintf(stdout, "%s\n  {\"name\": ", printed++ ? "," : "");
+      print_json_string(output_info->name);
+      fprintf(stdout, ", \"connected\": %s",
+              output_info->connection == RR_Connected ? "true" : "false");
+      if(!output_info->crtc)
+        fprintf(stdout, ", \"output\": null, \"crtc\": null}");
+      else
+      {
+        size = XRRGetCrtcGammaSize(dpy, output_info->crtc);
+        fprintf(stdout, ", \"output\": %d, \"crtc\": %lu, \"gamma_size\": %d",
+                ncrtc++, (unsigned long)output_info->crtc, size);
+        if(size > 0)
+          gamma = XRRGetCrtcGamma(dpy, output_info->crtc);
+        if(gamma && gamma->size > 0)
+        {
+          hash = FNV_OFFSET;
+          fprintf(stdout, ", \"channels\": {");
+          print_json_channel("red", gamma->red, gamma->size, &hash, ", ");
+          print_json_channel("green", gamma->green, gamma->size, &hash, ", ");
+          print_json_channel("blue", gamma->blue, gamma->size, &hash, "");
+          fprintf(stdout, "}, \"ramp_hash\": \"%016llx\"", hash);
+        }
+        fprintf(stdout, "}");
+        if(gamma)
+          XRRFreeGamma(gamma);
+      }
+      XRRFreeOutputInfo(output_info);
+    }
+    if(res)
+      XRRFreeScreenResources(res);
+  }
+  else if(XF86VidModeGetGammaRampSize(dpy, screen, &size) && size > 0)
+  {
+    u_int16_t * ramps = (u_int16_t *) malloc(3 * size * sizeof(u_int16_t));
+
+    fprintf(stdout, "\n  {\"name\": \"screen\", \"connected\": true, "
+            "\"output\": 0, \"crtc\": null, \"gamma_size\": %d", size);
+    if(XF86VidModeGetGammaRamp(dpy, screen, size, ramps, ramps + size, ramps + 2*size))
+    {
+      hash = FNV_OFFSET;
+      fprintf(stdout, ", \"channels\": {");
+      print_json_channel("red", ramps, size, &hash, ", ");
+      print_json_channel("green", ramps + size, size, &hash, ", ");
+      print_json_channel("blue", ramps + 2*size, size, &hash, "");
+      fprintf(stdout, "}, \"ramp_hash\": \"%016llx\"", hash);
+    }
+    fprintf(stdout, "}");
+    free(ramps);
+  }
+  fprintf(stdout, "\n]}\n");
+}
+#endif
+
+/* fields shared between the threads logging and the writer */
+#define LOG_LOAD(x)       __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define LOG_STORE(x, v)   __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+
+/* levels of log records */
+enum { LOG_ERROR, LOG_WARNING, LOG_INFO };
+
+/* one record of the log ring */
+struct log_record_t {
+  volatile unsigned long seq;       /* ticket + 1 when complete, 0 while written */
+  unsigned long long time;          /* from now_ns() */
+  int level;
+  unsigned int repeated;            /* summaries: number of warnings held back */
+  int printed;                      /* by the caller, the writer skips it */
+  char text[LOG_TEXT];
+};
+
+/* rate limit of one kind of warning, told apart by the format */
+struct log_type_t {
+  const char * volatile fmt;
+  volatile int busy;                /* spin lock of the fields below */
+  unsigned long long window;        /* start of the current second */
+  unsigned int count, suppressed;
+  char last[LOG_TEXT];              /* the last text printed */
+};
+
+/* all messages, warnings and errors go through a ring of records.
+ * Writers take a ticket with an atomic increment and never wait; in
+ * resident modes a background thread prints the records, so a slow
+ * terminal or journal does not hold up the ramps. */
+struct log_ring_t {
+  struct log_record_t ring[LOG_RING];
+  volatile unsigned long head;      /* next ticket */
+  unsigned long tail;               /* next ticket to print */
+  unsigned long dropped;
+  struct log_type_t types[LOG_TYPES];
+  unsigned long long start;
+  int flushing;
+  int to_stderr;                    /* stdout carries data, e.g. -capture */
+  volatile int async;
+#ifndef _WIN32
+  volatile sig_atomic_t dump;
+  pthread_t writer;
+#endif
+} log_ring;
+
+/*
+ * FUNCTION log_push
+ *
+ * put a record into the ring, overwriting the oldest
+ */
+void
+log_push(int level, const char * text, unsigned int repeated, int printed)
+{
+  unsigned long ticket = __sync_fetch_and_add(&log_ring.head, 1);
+  struct log_record_t * r = &log_ring.ring[ticket % LOG_RING];
+  size_t n;
+
+  LOG_STORE(r->seq, 0);
+  __sync_synchronize();
+  r->time = now_ns();
+  r->level = level;
+  r->repeated = repeated;
+  r->printed = printed;
+  snprintf(r->text, LOG_TEXT, "%s", text);
+  /* records are lines */
+  if((n = strlen(r->text)) > 0 && r->text[n - 1] == '\n')
+    r->text[n - 1] = '\0';
+  __sync_synchronize();
+  LOG_STORE(r->seq, ticket + 1);
+}
+
+/*
+ * FUNCTION log_print
+ *
+ * print a record the way error(), warning() and message() do
+ */
+void
+log_print(int level, const char * text, unsigned int repeated)
+{
+  FILE * out = log_ring.to_stderr ? stderr : stdout;
+
+  if(level == LOG_ERROR)
+    fprintf(stderr, "Error - %s\n", text);
+  else if(repeated)
+    fprintf(out, "Warning - %u more like \"%s\"\n", repeated, text);
+  else if(level == LOG_WARNING)
+    fprintf(out, "Warning - %s\n", text);
+  else if(xcalib_state.verbose)
+    fprintf(out, "%s\n", text);
+}
+
+/*
+ * FUNCTION log_format
+ *
+ * format a message into buf of LOG_TEXT bytes or, if it is longer,
+ * into an allocated string, so only the copy in the ring is cut
+ *
+ * returns buf or the string to be freed
+ */
+char *
+log_format(char * buf, const char * fmt, va_list args)
+{
+  va_list copy;
+  char * text;
+  int n;
+
+  va_copy(copy, args);
+  n = vsnprintf(buf, LOG_TEXT, fmt, copy);
+  va_end(copy);
+  if(n < LOG_TEXT || (text = (char *) malloc(n + 1)) == NULL)
+    return buf;
+  vsnprintf(text, n + 1, fmt, args);
+  return text;
+}
+
+/*
+ * FUNCTION log_summary
+ *
+ * record how many warnings of one kind were held back if its second is
+ * over or with all set. The kinds are shared by all threads calling
+ * warning() and the writer, so they are only touched under their lock.
+ */
+void
+log_summary(struct log_type_t * type, int all)
+{
+  char last[LOG_TEXT];
+  unsigned int n = 0;
+
+  while(__sync_lock_test_and_set(&type->busy, 1))
+    ;
+  if(type->suppressed && (all || now_ns() - type->window >= 1000000000ULL))
+  {
+    n = type->suppressed;
+    type->suppressed = 0;
+    memcpy(last, type->last, LOG_TEXT);
+  }
+  __sync_lock_release(&type->busy);
+  if(!n)
+    return;
+  log_push(LOG_WARNING, last, n, !log_ring.async);
+  if(!log_ring.async)
+    log_print(LOG_WARNING, last, n);
+}
+
+/*
+ * FUNCTION log_summaries
+ *
+ * log_summary() for all kinds
+ */
+void
+log_summaries(int all)
+{
+  unsigned int k;
+
+  for(k = 0; k < LOG_TYPES; k++)
+    if(LOG_LOAD(log_ring.types[k].fmt))
+      log_summary(&log_ring.types[k], all);
+}
+
+void log_flush(void);
+
+/*
+ * FUNCTION log_admit
+ *
+ * rate limit warnings to LOG_BURST per kind and second
+ *
+ * returns 0 if the warning is only counted
+ */
+int
+log_admit(const char * fmt, const char * text)
+{
+  static volatile int registered = 0;
+  unsigned long long now = now_ns();
+  struct log_type_t * type = NULL;
+  unsigned int k, slot = ((unsigned long)fmt >> 3) % LOG_TYPES;
+  int admit;
+
+  for(k = 0; k < LOG_TYPES && !type; k++, slot = (slot + 1) % LOG_TYPES)
+    if(LOG_LOAD(log_ring.types[slot].fmt) == fmt ||
+       (!LOG_LOAD(log_ring.types[slot].fmt) &&
+        __sync_bool_compare_and_swap(&log_ring.types[slot].fmt, NULL, fmt)))
+      type = &log_ring.types[slot];
+  if(!type)
+    return 1;
+  /* the counts of the second that is over go first */
+  log_summary(type, 0);
+
+  while(__sync_lock_test_and_set(&type->busy, 1))
+    ;
+  if(now - type->window >= 1000000000ULL)
+  {
+    type->window = now;
+    type->count = 0;
+  }
+  if((admit = type->count++ < LOG_BURST))
+    snprintf(type->last, LOG_TEXT, "%s", text);
+  else
+    type->suppressed++;
+  __sync_lock_release(&type->busy);
+
+  /* the counts are printed at the latest on exit */
+  if(!admit && __sync_bool_compare_and_swap(&registered, 0, 1))
+    atexit(log_flush);
+  return admit;
+}
+
+/*
+ * FUNCTION log_drain
+ *
+ * print the records not printed yet; records overwritten before they
+ * were printed are counted
+ */
+void
+log_drain(void)
+{
+  struct log_record_t copy;
+  unsigned long seq;
+
+  while(log_ring.tail != LOG_LOAD(log_ring.head))
+  {
+    struct log_record_t * r = &log_ring.ring[log_ring.tail % LOG_RING];
+    seq = LOG_LOAD(r->seq);
+    if(seq == 0 || seq < log_ring.tail + 1)
+      break;                        /* still being written */
+    if(seq == log_ring.tail + 1)
+    {
+      memcpy(&copy, (const void *)r, sizeof(copy));
+      __sync_synchronize();
+      if(LOG_LOAD(r->seq) == seq)
+      {
+        if(!copy.printed)
+          log_print(copy.level, copy.text, copy.repeated);
+        log_ring.tail++;
+        continue;
+      }
+    }
+    log_ring.dropped++;
+    log_ring.tail++;
+  }
+  if(log_ring.dropped)
+  {
+    fprintf(log_ring.to_stderr ? stderr : stdout, "Warning - %lu log records dropped\n",
+            log_ring.dropped);
+    log_ring.dropped = 0;
+  }
+  fflush(log_ring.to_stderr ? stderr : stdout);
+}
+
+/*
+ * FUNCTION log_dump
+ *
+ * print the records in the ring, printed or not, one per line with
+ * time in seconds since the first record, level, count of held back
+ * warnings and text
+ */
+void
+log_dump(FILE * fp)
+{
+  static const char * levels[] = { "error", "warning", "info" };
+  unsigned long head = LOG_LOAD(log_ring.head), ticket;
+  struct log_record_t copy;
+
+  for(ticket = head > LOG_RING ? head - LOG_RING : 0; ticket < head; ticket++)
+  {
+    struct log_record_t * r = &log_ring.ring[ticket % LOG_RING];
+    if(LOG_LOAD(r->seq) != ticket + 1)
+      continue;
+    memcpy(&copy, (const void *)r, sizeof(copy));
+    __sync_synchronize();
+    if(LOG_LOAD(r->seq) != ticket + 1)
+      continue;
+    if(!log_ring.start)
+      log_ring.start = copy.time;
+    fprintf(fp, "t=%.6f level=%s repeated=%u msg=\"%s\"\n",
+            (copy.time - log_ring.start) / 1e9, levels[copy.level], copy.repeated, copy.text);
+  }
+  fflush(fp);
+}
+
+#ifndef _WIN32
+/*
+ * FUNCTION log_signal
+ *
+ * SIGUSR2 handler: dump the ring to stderr
+ */
+void
+log_signal(int sig)
+{
+  (void) sig;
+  log_ring.dump = 1;
+}
+
+/*
+ * FUNCTION log_writer
+ *
+ * background thread printing the records of resident modes
+ */
+void *
+log_writer(void * arg)
+{
+  struct timespec pause = { 0, LOG_INTERVAL * 1000000L };
+
+  (void) arg;
+  while(LOG_LOAD(log_ring.async))
+  {
+    log_summaries(0);
+    log_drain();
+    if(log_ring.dump)
+    {
+      log_ring.dump = 0;
+      log_dump(stderr);
+    }
+    nanosleep(&pause, NULL);
+  }
+  log_drain();
+  return NULL;
+}
+
+/*
+ * FUNCTION log_async
+ *
+ * print records from a background thread from now on and dump the
+ * ring on SIGUSR2
+ */
+void
+log_async(void)
+{
+  static int registered = 0;
+
+  if(log_ring.async)
+    return;
+  fflush(stdout);
+  log_ring.tail = LOG_LOAD(log_ring.head);
+  log_ring.async = 1;
+  if(pthread_create(&log_ring.writer, NULL, log_writer, NULL) != 0)
+  {
+    log_ring.async = 0;
+    return;
+  }
+  signal(SIGUSR2, log_signal);
+  if(!registered)
+  {
+    registered = 1;
+    atexit(log_flush);
+  }
+}
+#endif
+
+/*
+ * FUNCTION log_flush
+ *
+ * print the counts of held back warnings and stop the writer
+ */
+void
+log_flush(void)
+{
+  if(log_ring.flushing)
+    return;
+  log_ring.flushing = 1;
+  log_summaries(1);
+#ifndef _WIN32
+  if(log_ring.async)
+  {
+    LOG_STORE(log_ring.async, 0);
+    pthread_join(log_ring.writer, NULL);
+  }
+#endif
+  log_ring.flushing = 0;
 }
 
+/* the Python module (python/xcalibmodule.c) builds this file without main */
+#ifndef XCALIB_NO_MAIN
 int
 main (int argc, char *argv[])
 {
@@ -581,7 +5422,45 @@ main (int argc, char *argv[])
   int calcloss = 0;
   int invert = 0;
   int correction = 0;
+  char * match_index = NULL;
+  int inventory = 0;
+  char * compare_a = NULL, * compare_b = NULL, * compare_list = NULL;
+  char * save_name = NULL;
+  char * snapshot_name = NULL;
+  int snapshot_only = 0;
+  char * audit_name = NULL;
+#ifndef _WIN32
+  char * image_name = NULL, * image_out = NULL;
+#endif
+  unsigned int max_error = KNOTS_MAX_ERROR;
+  /* exit status, recorded for instances waiting on the same request */
+  int apply_status = 0;
+#ifndef _WIN32
+  int lock = 0;
+  unsigned long long lock_key = 0;
+  char * detach_name = NULL;
+  /* -map, always NULL with FGLRX */
+  char * map_profiles = NULL;
+  int publish = 0;
+  unsigned char * profile_data = NULL;
+  size_t profile_length = 0;
+  RROutput xrr_output = 0;
+#endif
+  struct ramp_stats_t stats;
+  struct ramp_view_t from, to;
   u_int16_t tmpRampVal = 0;
+#if !defined(_WIN32) && !defined(FGLRX)
+  u_int16_t * base_ramps = NULL;
+  char * ambient = NULL;
+  struct ambient_point_t ambient_curve[AMBIENT_POINTS] = {
+    { 0.0, 0.0, 50.0 }, { 100.0, 0.0, 75.0 }, { 500.0, 0.0, 100.0 }
+  };
+  int ambient_points = 3;
+  int ambient_interval = AMBIENT_INTERVAL;
+  int watch = 0;
+  struct preset_t presets[PRESET_BANKS];
+  int num_presets = 0;
+#endif
   unsigned int r_res, g_res, b_res;
   int screen = -1;
 
@@ -596,6 +5475,9 @@ main (int argc, char *argv[])
   Display *dpy = NULL;
   char *displayname = NULL;
   int xoutput = 0;
+  int xoutput_given = 0;
+  int capture = -1;
+  double capture_fps = CAPTURE_FPS;
 #ifdef FGLRX
   int controller = -1;
   FGLRX_X11Gamma_C16native fglrx_gammaramps;
@@ -668,6 +5550,7 @@ main (int argc, char *argv[])
       if (++i >= argc)
         usage ();
         xoutput = atoi (argv[i]);
+        xoutput_given = 1;
         continue;
     }
 #endif
@@ -707,6 +5590,212 @@ main (int argc, char *argv[])
       continue;
     }
 #endif
+    /* write fingerprints of all profiles in a directory to an index */
+    if (!strcmp (argv[i], "-buildindex")) {
+      int count;
+      if (i + 2 >= argc)
+        usage();
+      if((count = build_profile_index(argv[i+1], argv[i+2])) < 0)
+        error ("Unable to index '%s' into '%s'", argv[i+2], argv[i+1]);
+      message ("%d profiles indexed\n", count);
+      exit (0);
+    }
+    /* print the records of an audit log in a time range */
+    if (!strcmp (argv[i], "-auditquery")) {
+      long long from, to;
+      int count;
+      if (i + 3 >= argc)
+        usage();
+      if((from = parse_audit_time(argv[i+2], 0)) < 0 ||
+         (to = parse_audit_time(argv[i+3], 0x7fffffffffffffffLL)) < 0)
+        error ("invalid time range '%s' '%s'", argv[i+2], argv[i+3]);
+      if((count = audit_query(argv[i+1], from, to)) < 0)
+        error ("Unable to read audit log '%s'", argv[i+1]);
+      exit (0);
+    }
+    /* record every applied calibration */
+    if (!strcmp (argv[i], "-auditlog")) {
+      if (++i >= argc)
+        usage();
+      audit_name = argv[i];
+      continue;
+    }
+#ifndef _WIN32
+    /* print the gamma state of all outputs as JSON */
+    if (!strcmp (argv[i], "-inventory")) {
+      inventory = 1;
+      continue;
+    }
+#endif
+#ifndef _WIN32
+    /* coordinate with other instances applying to the same display */
+    if (!strcmp (argv[i], "-lock")) {
+      lock = 1;
+      continue;
+    }
+    /* apply in the background after the profile was validated */
+    if (!strcmp (argv[i], "-detach")) {
+      if (++i >= argc)
+        usage();
+      detach_name = argv[i];
+      continue;
+    }
+    /* set _ICC_PROFILE along with the upload */
+    if (!strcmp (argv[i], "-publish")) {
+      publish = 1;
+      continue;
+    }
+    /* give up when the display does not answer in time */
+    if (!strcmp (argv[i], "-timeout")) {
+      if (++i >= argc || atoi (argv[i]) <= 0)
+        usage();
+      deadline.end = now_ns() + atoi (argv[i]) * 1000000ULL;
+      deadline.armed = 1;
+      continue;
+    }
+    if (!strcmp (argv[i], "-phasetimeout")) {
+      int k;
+      if (i + 2 >= argc)
+        usage();
+      for (k = 0; k < DEADLINE_PHASES && strcmp (deadline_phases[k], argv[i+1]); k++)
+        ;
+      if (k == DEADLINE_PHASES || atoi (argv[i+2]) <= 0)
+        usage();
+      deadline.budget[k] = atoi (argv[i+2]);
+      deadline.armed = 1;
+      i += 2;
+      continue;
+    }
+    /* apply the ramps to an image file instead of the display */
+    if (!strcmp (argv[i], "-applyimage")) {
+      if (++i >= argc)
+        usage();
+      image_name = argv[i];
+      donothing = 1;
+      continue;
+    }
+#ifndef FGLRX
+    /* follow the room light with brightness and contrast */
+    if (!strcmp (argv[i], "-ambient")) {
+      if (++i >= argc)
+        usage();
+      ambient = argv[i];
+      continue;
+    }
+    /* mapping of light level to brightness and contrast */
+    if (!strcmp (argv[i], "-ambientcurve")) {
+      if (++i >= argc)
+        usage();
+      if((ambient_points = parse_ambient_curve(argv[i], ambient_curve)) == 0)
+        error ("invalid light curve '%s'", argv[i]);
+      continue;
+    }
+    /* keep all outputs calibrated across hotplug and mode changes */
+    if (!strcmp (argv[i], "-watch")) {
+      watch = 1;
+      continue;
+    }
+    /* pre-rendered calibrations to switch between */
+    if (!strcmp (argv[i], "-preset")) {
+      if (i + 2 >= argc)
+        usage();
+      if (num_presets == PRESET_BANKS)
+        error ("at most %d presets", PRESET_BANKS);
+      presets[num_presets].name = argv[++i];
+      presets[num_presets].profiles = argv[++i];
+      num_presets++;
+      continue;
+    }
+    /* one profile per output, rendered in parallel */
+    if (!strcmp (argv[i], "-map")) {
+      if (++i >= argc)
+        usage();
+      map_profiles = argv[i];
+      continue;
+    }
+    /* share resident ramps between outputs and sessions */
+    if (!strcmp (argv[i], "-lowmem")) {
+      ramp_store.shared = 1;
+      continue;
+    }
+    /* poll interval of the light level */
+    if (!strcmp (argv[i], "-ambientinterval")) {
+      if (++i >= argc)
+        usage();
+      if((ambient_interval = atoi(argv[i])) < 10)
+        usage();
+      continue;
+    }
+#endif
+    /* stream calibrated screen captures to stdout */
+    if (!strcmp (argv[i], "-capture")) {
+      if (++i >= argc)
+        usage();
+      capture = atoi(argv[i]);
+      continue;
+    }
+    /* frame rate of -capture */
+    if (!strcmp (argv[i], "-framerate")) {
+      if (++i >= argc)
+        usage();
+      capture_fps = atof(argv[i]);
+      if(capture_fps <= 0.0)
+        usage();
+      continue;
+    }
+    /* write the image to a new file instead of in place */
+    if (!strcmp (argv[i], "-imageout")) {
+      if (++i >= argc)
+        usage();
+      image_out = argv[i];
+      continue;
+    }
+#endif
+    /* store the resulting ramps in a compact file */
+    if (!strcmp (argv[i], "-saveramps")) {
+      if (++i >= argc)
+        usage();
+      save_name = argv[i];
+      continue;
+    }
+    /* store the resulting ramps as an ICC profile */
+    if (!strcmp (argv[i], "-snapshot")) {
+      if (++i >= argc)
+        usage();
+      snapshot_name = argv[i];
+      continue;
+    }
+    /* largest deviation of the compact ramps in 16-bit code values */
+    if (!strcmp (argv[i], "-maxerror")) {
+      if (++i >= argc)
+        usage();
+      if (atoi (argv[i]) < 0)
+        usage();
+      max_error = atoi(argv[i]);
+      continue;
+    }
+    /* compare the ramps of two sources */
+    if (!strcmp (argv[i], "-compare")) {
+      if (i + 2 >= argc)
+        usage();
+      compare_a = argv[++i];
+      compare_b = argv[++i];
+      continue;
+    }
+    /* compare the pairs of sources listed in a file */
+    if (!strcmp (argv[i], "-comparelist")) {
+      if (++i >= argc)
+        usage();
+      compare_list = argv[i];
+      continue;
+    }
+    /* find the indexed profiles nearest to the current ramps */
+    if (!strcmp (argv[i], "-match")) {
+      if (++i >= argc)
+        usage();
+      match_index = argv[i];
+      continue;
+    }
     /* do not alter video-LUTs : work's best in conjunction with -v! */
     if (!strcmp (argv[i], "-n") || !strcmp (argv[i], "-noaction")) {
       donothing = 1;
@@ -880,6 +5969,47 @@ main (int argc, char *argv[])
     }
   }
 
+#ifndef _WIN32
+  /* the frames of -capture own stdout */
+  if (capture >= 0)
+    log_ring.to_stderr = 1;
+#endif
+
+  /* comparisons need a display only for live outputs */
+  if (compare_a || compare_list) {
+    void * display = NULL;
+#ifndef _WIN32
+    if (compare_list || !strncmp(compare_a, "output:", 7) || !strncmp(compare_b, "output:", 7)) {
+      if ((dpy = XOpenDisplay (displayname)) != NULL && screen == -1)
+        screen = DefaultScreen (dpy);
+      display = dpy;
+    }
+#endif
+    if (compare_list)
+      i = compare_ramp_list(compare_list, donothing ? ramp_size : 0, display, screen);
+    else
+      i = compare_ramp_sources(compare_a, compare_b, donothing ? ramp_size : 0, 0, display, screen) < 0;
+    if (compare_list && i < 0)
+      warning ("Unable to read list '%s'", compare_list);
+#ifndef _WIN32
+    if (dpy)
+      XCloseDisplay (dpy);
+#endif
+    exit (i != 0);
+  }
+
+  /* without a profile -match compares against the current LUT */
+  if (match_index && in_name[0] == '\0')
+    alter = 1;
+  /* and -snapshot stores it */
+  if (snapshot_name && in_name[0] == '\0')
+    alter = snapshot_only = 1;
+#ifndef _WIN32
+  /* and -capture applies the current LUT in software */
+  if (capture >= 0 && in_name[0] == '\0')
+    alter = 1;
+#endif
+
 #ifdef _WIN32
   if ((!clear || !alter) && (in_name[0] == '\0')) {
     hDc = FindMonitor(screen);
@@ -899,8 +6029,57 @@ main (int argc, char *argv[])
 #endif
 
 #ifndef _WIN32
-  /* X11 initializing */
-  if ((dpy = XOpenDisplay (displayname)) == NULL) {
+  if (detach_name && !donothing) {
+    /* only the validation of the profiles stays on the caller's path;
+     * -map has one per list entry, "clear" needs none */
+    int entries = 1, k;
+    const char * p;
+    if (map_profiles)
+      for (p = map_profiles; (p = strchr(p, ',')) != NULL; p++)
+        entries++;
+    for (k = 0; (map_profiles || (!clear && !alter)) && k < entries; k++) {
+      u_int16_t check[3 * 256];
+      char name[256];
+      if (map_profiles)
+        preset_profile(map_profiles, k, name, sizeof(name));
+      else
+        strcpy(name, in_name);
+      if (map_profiles && !strcmp(name, "clear"))
+        continue;
+      i = read_vcgt_internal(name, check, check + 256, check + 512, 256);
+      if (i < 0)
+        error ("Unable to read file '%s'", name);
+      if (i == 0)
+        error ("No calibration data in ICC profile '%s' found", name);
+    }
+    fflush (NULL);
+    detach_apply(detach_name, XDisplayName (displayname), map_profiles ? map_profiles : in_name);
+  }
+
+  if (lock) {
+    int status = 0;
+    deadline_phase("lock");
+    lock_key = request_key(argc, argv, in_name);
+    switch (apply_lock_acquire(XDisplayName (displayname), lock_key, &status)) {
+      case 0:
+        message ("identical request was applied by another instance\n");
+        exit (status);
+      case -1:
+        warning ("Unable to use the lock file, applying without coordination");
+        break;
+    }
+  }
+
+  /* X11 initializing - images are processed without a display */
+  if (!(image_name && !alter) && !donothing && deadline.armed) {
+    deadline_phase("connect");
+    if (!deadline_connect(XDisplayName (displayname)))
+      error ("Can't open display %s", XDisplayName (displayname));
+    deadline_phase("setup");
+  }
+  if (image_name && !alter)
+    dpy = NULL;
+  else if ((dpy = XOpenDisplay (displayname)) == NULL) {
     if(!donothing)
       error ("Can't open display %s", XDisplayName (displayname));
     else
@@ -914,13 +6093,24 @@ main (int argc, char *argv[])
   int major_versionp = 0;
   int minor_versionp = 0;
   int n = 0;
-  Window root = RootWindow(dpy, screen);
 
-  XRRQueryVersion( dpy, &major_versionp, &minor_versionp );
-  xrr_version = major_versionp*100 + minor_versionp;
+  deadline_phase("discovery");
+  if(dpy)
+  {
+    XRRQueryVersion( dpy, &major_versionp, &minor_versionp );
+    xrr_version = major_versionp*100 + minor_versionp;
+  }
+
+  if(inventory) {
+    if(!dpy)
+      error ("Can't open display %s", XDisplayName (displayname));
+    print_inventory(dpy, screen, xrr_version);
+    goto cleanupX;
+  }
 
   if(xrr_version >= 102)
   {                           
+    Window root = RootWindow(dpy, screen);
     XRRScreenResources * res = XRRGetScreenResources( dpy, root );
     int ncrtc = 0;
 
@@ -934,6 +6124,7 @@ main (int argc, char *argv[])
         if(ncrtc++ == xoutput)
         {
           crtc = output_info->crtc;
+          xrr_output = output;
           ramp_size = XRRGetCrtcGammaSize( dpy, crtc );
           message ("XRandR output:      \t%s\n", output_info->name);
         }
@@ -943,17 +6134,40 @@ main (int argc, char *argv[])
     //XRRFreeScreenResources(res); res = 0;
   }
 
+  if (audit_name && !donothing &&
+      !audit_open(audit_name, XDisplayName (displayname), screen,
+                  xrr_version >= 102 ? xoutput : -1, clear || alter ? NULL : in_name))
+    warning ("Unable to open audit log '%s'", audit_name);
+
+#ifndef FGLRX
+  if (map_profiles && !donothing) {
+    deadline_phase("upload");
+    if (xrr_version < 102)
+      error ("-map needs XRandR 1.2");
+    if (map_outputs(dpy, screen, map_profiles, correction, invert) < 0) {
+      warning ("Unable to calibrate all outputs");
+      apply_status = 1;
+    }
+    goto cleanupX;
+  }
+#endif
+
   /* clean gamma table if option set */
   gamma.red = 1.0;
   gamma.green = 1.0;
   gamma.blue = 1.0;
   if (clear) {
+    int cleared = 1;
+    /* bounded up to the sync of XCloseDisplay */
+    deadline_phase("upload");
 #ifndef FGLRX
     if(xrr_version >= 102)
     {
       XRRCrtcGamma * gamma = XRRAllocGamma (ramp_size);
-      if(!gamma)
+      if(!gamma) {
         warning ("Unable to clear screen gamma");
+        cleared = 0;
+      }
       else
       {
         for(i=0; i < ramp_size; ++i)
@@ -975,6 +6189,17 @@ main (int argc, char *argv[])
       XCloseDisplay (dpy);
       error ("Unable to reset display gamma");
     }
+    if (cleared)
+      audit_apply(NULL, NULL, NULL, 0, AUDIT_CLEAR);
+    if (publish && !publish_profile(dpy, screen, xrr_output, xrr_version >= 102 ? xoutput : 0, NULL, 0))
+      warning ("Unable to remove the published profile");
+    /* the matrix of an MHC2 profile named along goes as well; a CTM
+     * of another tool is left alone */
+    if (xrr_output && in_name[0]) {
+      u_int16_t check[3 * 256];
+      if (read_vcgt_internal(in_name, check, check + 256, check + 512, 256) > 0 && mhc2.found)
+        set_output_ctm(dpy, xrr_output, NULL);
+    }
     goto cleanupX;
   }
   
@@ -999,9 +6224,12 @@ main (int argc, char *argv[])
   if(!donothing) {
     if(!hDc)
       hDc = FindMonitor(screen);
+    if (audit_name && !audit_open(audit_name, "Win32", screen, -1, clear || alter ? NULL : in_name))
+      warning ("Unable to open audit log '%s'", audit_name);
     if (clear) {
       if (!SetDeviceGammaRamp(hDc, &winGammaRamp))
         error ("Unable to reset display gamma");
+      audit_apply(NULL, NULL, NULL, 0, AUDIT_CLEAR);
       goto cleanupX;
     }
   }
@@ -1032,9 +6260,21 @@ main (int argc, char *argv[])
   g_ramp = (unsigned short *) malloc (ramp_size * sizeof (unsigned short));
   b_ramp = (unsigned short *) malloc (ramp_size * sizeof (unsigned short));
 
+#ifndef _WIN32
+  deadline_phase("parse");
+#endif
   if(!alter)
   {
-    if( (i = read_vcgt_internal(in_name, r_ramp, g_ramp, b_ramp, ramp_size)) <= 0) {
+#ifndef _WIN32
+    /* the bytes parsed are the bytes published */
+    if(publish && !donothing &&
+       (profile_data = load_profile(in_name, &profile_length)) != NULL)
+      i = read_vcgt_memory(profile_data, profile_length, in_name,
+                           r_ramp, g_ramp, b_ramp, ramp_size);
+    else
+#endif
+      i = read_vcgt_internal(in_name, r_ramp, g_ramp, b_ramp, ramp_size);
+    if(i <= 0) {
       if(i<0)
         warning ("Unable to read file '%s'", in_name);
       if(i == 0)
@@ -1052,11 +6292,9 @@ main (int argc, char *argv[])
       if((gamma = XRRGetCrtcGamma(dpy, crtc)) == 0 )
         warning ("XRRGetCrtcGamma() is unable to get display calibration");
 
-      for (i = 0; i < ramp_size; i++) {
-        r_ramp[i] = gamma->red[i];
-        g_ramp[i] = gamma->green[i];
-        b_ramp[i] = gamma->blue[i];
-      }
+      from = ramp_view_planar(gamma->red, gamma->green, gamma->blue, ramp_size, 16);
+      to = ramp_view_planar(r_ramp, g_ramp, b_ramp, ramp_size, 16);
+      ramp_convert(&to, &from);
     }
     else if (!XF86VidModeGetGammaRamp (dpy, screen, ramp_size, r_ramp, g_ramp, b_ramp))
       warning ("XF86VidModeGetGammaRamp() is unable to get display calibration");
@@ -1064,67 +6302,57 @@ main (int argc, char *argv[])
     if (!GetDeviceGammaRamp(hDc, &winGammaRamp))
       warning ("GetDeviceGammaRamp() is unable to get display calibration");
 
-    for (i = 0; i < ramp_size; i++) {
-      r_ramp[i] = winGammaRamp.Red[i];
-      g_ramp[i] = winGammaRamp.Green[i];
-      b_ramp[i] = winGammaRamp.Blue[i];
-    }
+    from = ramp_view_planar(winGammaRamp.Red, winGammaRamp.Green, winGammaRamp.Blue, ramp_size, 16);
+    to = ramp_view_planar(r_ramp, g_ramp, b_ramp, ramp_size, 16);
+    ramp_convert(&to, &from);
 #endif
   }
 
+  /* grey balanced ramps with equal settings go through as one channel
+   * and fan out only at the upload */
+  if(!memcmp(r_ramp, g_ramp, ramp_size * sizeof(u_int16_t)) &&
+     !memcmp(r_ramp, b_ramp, ramp_size * sizeof(u_int16_t)) &&
+     (!correction ||
+      (xcalib_state.redGamma == xcalib_state.greenGamma &&
+       xcalib_state.redGamma == xcalib_state.blueGamma &&
+       xcalib_state.redMin == xcalib_state.greenMin && xcalib_state.redMin == xcalib_state.blueMin &&
+       xcalib_state.redMax == xcalib_state.greenMax && xcalib_state.redMax == xcalib_state.blueMax)))
   {
-    float redBrightness = 0.0;
-    float redContrast = 100.0;
-    float redMin = 0.0;
-    float redMax = 1.0;
-
-    redMin = (double)r_ramp[0] / 65535.0;
-    redMax = (double)r_ramp[ramp_size - 1] / 65535.0;
-    redBrightness = redMin * 100.0;
-    redContrast = (redMax - redMin) / (1.0 - redMin) * 100.0; 
-    message("Red Brightness: %f   Contrast: %f  Max: %f  Min: %f\n", redBrightness, redContrast, redMax, redMin);
+    free(g_ramp);
+    free(b_ramp);
+    g_ramp = b_ramp = r_ramp;
+    message("identical channels, processed once\n");
   }
 
-  {
-    float greenBrightness = 0.0;
-    float greenContrast = 100.0;
-    float greenMin = 0.0;
-    float greenMax = 1.0;
-
-    greenMin = (double)g_ramp[0] / 65535.0;
-    greenMax = (double)g_ramp[ramp_size - 1] / 65535.0;
-    greenBrightness = greenMin * 100.0;
-    greenContrast = (greenMax - greenMin) / (1.0 - greenMin) * 100.0; 
-    message("Green Brightness: %f   Contrast: %f  Max: %f  Min: %f\n", greenBrightness, greenContrast, greenMax, greenMin);
+  if(match_index) {
+    if(match_profile_index(match_index, r_ramp, g_ramp, b_ramp, ramp_size) < 0)
+      warning ("Unable to read profile index '%s'", match_index);
+    free_ramps(r_ramp, g_ramp, b_ramp);
+    goto cleanupX;
   }
 
-  {
-    float blueBrightness = 0.0;
-    float blueContrast = 100.0;
-    float blueMin = 0.0;
-    float blueMax = 1.0;
+  ramp_statistics(r_ramp, ramp_size, &stats, NULL);
+  message("Red Brightness: %f   Contrast: %f  Max: %f  Min: %f\n", stats.brightness, stats.contrast, stats.max, stats.min);
+  if(g_ramp != r_ramp)
+    ramp_statistics(g_ramp, ramp_size, &stats, NULL);
+  message("Green Brightness: %f   Contrast: %f  Max: %f  Min: %f\n", stats.brightness, stats.contrast, stats.max, stats.min);
+  if(b_ramp != r_ramp)
+    ramp_statistics(b_ramp, ramp_size, &stats, NULL);
+  message("Blue Brightness: %f   Contrast: %f  Max: %f  Min: %f\n", stats.brightness, stats.contrast, stats.max, stats.min);
 
-    blueMin = (double)b_ramp[0] / 65535.0;
-    blueMax = (double)b_ramp[ramp_size - 1] / 65535.0;
-    blueBrightness = blueMin * 100.0;
-    blueContrast = (blueMax - blueMin) / (1.0 - blueMin) * 100.0; 
-    message("Blue Brightness: %f   Contrast: %f  Max: %f  Min: %f\n", blueBrightness, blueContrast, blueMax, blueMin);
+#if !defined(_WIN32) && !defined(FGLRX)
+  /* -ambient renders the correction again on top of these */
+  if(ambient) {
+    base_ramps = (u_int16_t *) malloc(3 * ramp_size * sizeof(u_int16_t));
+    memcpy(base_ramps, r_ramp, ramp_size * sizeof(u_int16_t));
+    memcpy(base_ramps + ramp_size, g_ramp, ramp_size * sizeof(u_int16_t));
+    memcpy(base_ramps + 2*ramp_size, b_ramp, ramp_size * sizeof(u_int16_t));
   }
+#endif
 
   if(correction != 0)
   {
-    for(i=0; i<ramp_size; i++)
-    {
-      r_ramp[i] =  65536.0 * (((double) pow (((double) r_ramp[i]/65536.0),
-                                xcalib_state.redGamma * (double) xcalib_state.gamma_cor
-                  ) * (xcalib_state.redMax - xcalib_state.redMin)) + xcalib_state.redMin);
-      g_ramp[i] =  65536.0 * (((double) pow (((double) g_ramp[i]/65536.0),
-                                xcalib_state.greenGamma * (double) xcalib_state.gamma_cor
-                  ) * (xcalib_state.greenMax - xcalib_state.greenMin)) + xcalib_state.greenMin);
-      b_ramp[i] =  65536.0 * (((double) pow (((double) b_ramp[i]/65536.0),
-                                xcalib_state.blueGamma * (double) xcalib_state.gamma_cor
-                  ) * (xcalib_state.blueMax - xcalib_state.blueMin)) + xcalib_state.blueMin); 
-    }
+    apply_correction(&xcalib_state, r_ramp, g_ramp, b_ramp, ramp_size);
     message("Altering Red LUTs with   Gamma %f   Min %f   Max %f\n",
        xcalib_state.redGamma, xcalib_state.redMin, xcalib_state.redMax);
     message("Altering Green LUTs with   Gamma %f   Min %f   Max %f\n",
@@ -1136,28 +6364,16 @@ main (int argc, char *argv[])
   if(!invert) {
     /* ramps should be increasing - otherwise content is nonsense! */
     for (i = 0; i < ramp_size - 1; i++) {
-      if (r_ramp[i + 1] < r_ramp[i])
+      int down = r_ramp[i + 1] < r_ramp[i];
+      if (down)
         warning ("red gamma table not increasing");
-      if (g_ramp[i + 1] < g_ramp[i])
+      if (g_ramp == r_ramp ? down : g_ramp[i + 1] < g_ramp[i])
         warning ("green gamma table not increasing");
-      if (b_ramp[i + 1] < b_ramp[i])
+      if (b_ramp == r_ramp ? down : b_ramp[i + 1] < b_ramp[i])
         warning ("blue gamma table not increasing");
     }
-  } else {
-    for (i = 0; i < ramp_size; i++) {
-      if(i >= ramp_size / 2)
-        break;
-      tmpRampVal = r_ramp[i];
-      r_ramp[i] = r_ramp[ramp_size - i - 1];
-      r_ramp[ramp_size - i - 1] = tmpRampVal;
-      tmpRampVal = g_ramp[i];
-      g_ramp[i] = g_ramp[ramp_size - i - 1];
-      g_ramp[ramp_size - i - 1] = tmpRampVal;
-      tmpRampVal = b_ramp[i];
-      b_ramp[i] = b_ramp[ramp_size - i - 1];
-      b_ramp[ramp_size - i - 1] = tmpRampVal;
-    }
-  }
+  } else
+    invert_ramps(r_ramp, g_ramp, b_ramp, ramp_size);
   if(calcloss) {
     fprintf(stdout, "Resolution loss for %d entries:\n", ramp_size);
     r_res = 0;
@@ -1170,15 +6386,17 @@ main (int argc, char *argv[])
       }
       tmpRampVal = r_ramp[i];
     }
+    if (g_ramp == r_ramp)
+      g_res = b_res = r_res;
     tmpRampVal = 0xffff;
-    for(i = 0; i < ramp_size; i++) {
+    for(i = 0; g_ramp != r_ramp && i < ramp_size; i++) {
       if ((g_ramp[i] & 0xff00) != (tmpRampVal & 0xff00)) {
         g_res++;
       }
       tmpRampVal = g_ramp[i];
     }
     tmpRampVal = 0xffff;
-    for(i = 0; i < ramp_size; i++) {
+    for(i = 0; b_ramp != r_ramp && i < ramp_size; i++) {
       if ((b_ramp[i] & 0xff00) != (tmpRampVal & 0xff00)) {
         b_res++;
       }
@@ -1187,109 +6405,224 @@ main (int argc, char *argv[])
     fprintf(stdout, "R: %d  G: %d  B: %d  colors lost\n", ramp_size - r_res, ramp_size - g_res, ramp_size - b_res );
   }
 #ifdef _WIN32
-  for (i = 0; i < ramp_size; i++) {
-    winGammaRamp.Red[i] = r_ramp[i];
-    winGammaRamp.Green[i] = g_ramp[i];
-    winGammaRamp.Blue[i] = b_ramp[i];
-  }
-
+  from = ramp_view_planar(r_ramp, g_ramp, b_ramp, ramp_size, 16);
+  to = ramp_view_planar(winGammaRamp.Red, winGammaRamp.Green, winGammaRamp.Blue, ramp_size, 16);
+  ramp_convert(&to, &from);
 #endif
  
   if(printramps)
     for(i=0; i<ramp_size; i++)
       fprintf(stdout,"%d %d %d\n", r_ramp[i], g_ramp[i], b_ramp[i]);
 
+  if(save_name) {
+    if((i = save_ramp_knots(save_name, r_ramp, g_ramp, b_ramp, ramp_size, max_error)) < 0)
+      warning ("Unable to write ramps to '%s'", save_name);
+    else
+      message ("%d knots (%d bytes) written to '%s'\n", i, 4 * i + 24, save_name);
+  }
+
+  if(snapshot_name) {
+    char description[300];
+#ifndef _WIN32
+    snprintf(description, sizeof(description), "xcalib snapshot of %s screen %d output %d",
+             XDisplayName (displayname), screen, xoutput);
+#else
+    snprintf(description, sizeof(description), "xcalib snapshot of monitor %d", screen);
+#endif
+    if((i = save_ramp_profile(snapshot_name, r_ramp, g_ramp, b_ramp, ramp_size, description)) < 0)
+      warning ("Unable to write profile '%s'", snapshot_name);
+    else
+      message ("%d entries per channel written to '%s'\n", i, snapshot_name);
+    /* reading the LUT for the snapshot is no apply */
+    if(snapshot_only) {
+      free_ramps(r_ramp, g_ramp, b_ramp);
+      goto cleanupX;
+    }
+  }
+
+#ifndef _WIN32
+  if(image_name) {
+    /* the image takes as long as it is large; -timeout bounds the
+     * display, so the upload keeps what was left of it */
+    unsigned long long paused = now_ns();
+    deadline_phase(NULL);
+    if((i = apply_ramps_to_image(image_name, image_out, r_ramp, g_ramp, b_ramp, ramp_size)) < 0)
+      warning ("Unable to process image '%s'", image_name);
+    else if(i == 0)
+      warning ("Image '%s' is no binary PPM or RGB PAM", image_name);
+    if(deadline.end)
+      deadline.end += now_ns() - paused;
+  }
+
+  if(capture >= 0) {
+    /* runs as long as asked for, like the resident modes */
+    deadline_phase(NULL);
+    if(!dpy || capture_screen(dpy, screen, xoutput_given ? xoutput : -1, capture,
+                              capture_fps, r_ramp, g_ramp, b_ramp, ramp_size) < 0)
+      warning ("Unable to capture the screen");
+    free_ramps(r_ramp, g_ramp, b_ramp);
+    goto cleanupX;
+  }
+#endif
+
   if(!donothing) {
     /* write gamma ramp to X-server */
 #ifndef _WIN32
+    deadline_phase("upload");
 # ifdef FGLRX
-    for(i = 0; i < ramp_size; i++) {
-      fglrx_gammaramps.RGamma[i] = r_ramp[i] >> 6;
-      fglrx_gammaramps.GGamma[i] = g_ramp[i] >> 6;
-      fglrx_gammaramps.BGamma[i] = b_ramp[i] >> 6;
-    }
+    /* the driver takes 10-bit values */
+    from = ramp_view_planar(r_ramp, g_ramp, b_ramp, ramp_size, 16);
+    to = ramp_view_planar(fglrx_gammaramps.RGamma, fglrx_gammaramps.GGamma,
+                          fglrx_gammaramps.BGamma, ramp_size, 10);
+    ramp_convert(&to, &from);
     if (!FGLRX_X11SetGammaRamp_C16native_1024(dpy, screen, controller, ramp_size, &fglrx_gammaramps))
 # else
-    if(xrr_version >= 102)
-    {
-      XRRCrtcGamma * gamma = XRRAllocGamma (ramp_size);
-      if(!gamma)
-        warning ("Unable to calibrate display");
-      else
-      {
-        for(i=0; i < ramp_size; ++i)
-        {
-          gamma->red[i] = r_ramp[i];
-          gamma->green[i] = g_ramp[i];
-          gamma->blue[i] = b_ramp[i];
-        }
-        XRRSetCrtcGamma (dpy, crtc, gamma);
-        XRRFreeGamma (gamma);
-      }
-    } else
-    if (!XF86VidModeSetGammaRamp (dpy, screen, ramp_size, r_ramp, g_ramp, b_ramp))
+    if (!set_display_ramps(dpy, screen, crtc, xrr_version, r_ramp, g_ramp, b_ramp, ramp_size))
 # endif
 #else
     if (!SetDeviceGammaRamp(hDc, &winGammaRamp))
 #endif
+    {
       warning ("Unable to calibrate display");
+      apply_status = 1;
+    }
+    else if (!audit_apply(r_ramp, g_ramp, b_ramp, ramp_size,
+                          (alter ? AUDIT_ALTER : 0) | (invert ? AUDIT_INVERT : 0)))
+      warning ("Unable to write audit log");
+#ifndef _WIN32
+    /* published only for ramps the server took */
+    if (publish && alter)
+      warning ("-publish needs a profile");
+    else if (publish && !profile_data)
+      warning ("Unable to load '%s' to publish it", in_name);
+    else if (profile_data && !apply_status &&
+             !publish_profile(dpy, screen, xrr_output, xrr_version >= 102 ? xoutput : 0,
+                              profile_data, profile_length))
+      warning ("Unable to publish the profile");
+    if (mhc2.found && !alter && xrr_output) {
+      if (set_output_ctm(dpy, xrr_output, mhc2.matrix))
+        message ("MHC2 matrix set as CTM\n");
+      else if (!matrix_is_identity(mhc2.matrix))
+        warning ("The output has no CTM, the MHC2 matrix is not applied");
+    }
+    /* the reply shows the server took the ramps within the budget */
+    if (deadline.armed)
+      XSync (dpy, False);
+#endif
   }
 
   message ("X-LUT size:      \t%d\n", ramp_size);
 
-  free(r_ramp);
-  free(g_ramp);
-  free(b_ramp);
+#if !defined(_WIN32) && !defined(FGLRX)
+  if((ambient || watch || num_presets) && !donothing) {
+    deadline_phase(NULL);
+    log_async();
+  }
+  if(ambient && !donothing) {
+    i = run_ambient(dpy, screen, crtc, xrr_version, ambient, ambient_curve,
+                    ambient_points, ambient_interval, invert, base_ramps, ramp_size);
+    message ("%d light level changes applied\n", i);
+  }
+  if(watch && !donothing) {
+    if(xrr_version < 102)
+      warning ("-watch needs XRandR 1.2");
+    else
+      watch_outputs(dpy, screen, alter ? NULL : in_name, correction, invert,
+                    r_ramp, g_ramp, b_ramp, ramp_size);
+  }
+  if(num_presets && !donothing) {
+    /* the banks are rendered from their own profiles */
+    if(ramp_store.shared) {
+      free(base_ramps);
+      free_ramps(r_ramp, g_ramp, b_ramp);
+      base_ramps = r_ramp = g_ramp = b_ramp = NULL;
+    }
+    if(xrr_version < 102)
+      warning ("-preset needs XRandR 1.2");
+    else if((i = run_presets(dpy, screen, presets, num_presets, correction, invert)) < 0)
+      warning ("Unable to prepare the presets");
+    else
+      message ("%d preset switches\n", i);
+  }
+  free(base_ramps);
+#endif
+
+  free_ramps(r_ramp, g_ramp, b_ramp);
+#ifndef _WIN32
+  free(profile_data);
+#endif
 
 cleanupX:
+  if(audit_log.fp)
+    fclose(audit_log.fp);
 #ifndef _WIN32
   if(dpy)
-    if(!donothing)
-      XCloseDisplay (dpy);
+    XCloseDisplay (dpy);
+  /* only now all requests have reached the server */
+  if(lock)
+    apply_lock_release(lock_key, apply_status);
 #endif
 
-  return 0;
+  return apply_status;
 }
+#endif
 
 /* Basic printf type error() and warning() routines */
 
-/* errors are printed to stderr */
+/* errors are printed to stderr, after what is still queued */
 void
 error (char *fmt, ...)
 {
   va_list args;
+  char buf[LOG_TEXT], * text;
 
-  fprintf (stderr, "Error - ");
   va_start (args, fmt);
-  vfprintf (stderr, fmt, args);
+  text = log_format (buf, fmt, args);
   va_end (args);
-  fprintf (stderr, "\n");
+  log_push (LOG_ERROR, text, 0, 1);
+  log_flush ();
+  log_print (LOG_ERROR, text, 0);
   exit (-1);
 }
 
-/* warnings are printed to stdout */
+/* warnings are printed to stdout, up to LOG_BURST of a kind per second;
+ * in resident modes by the writer unless they are too long for the ring */
 void
 warning (char *fmt, ...)
 {
   va_list args;
+  char buf[LOG_TEXT], * text;
+  int now;
 
-  fprintf (stdout, "Warning - ");
   va_start (args, fmt);
-  vfprintf (stdout, fmt, args);
+  text = log_format (buf, fmt, args);
   va_end (args);
-  fprintf (stdout, "\n");
+  if (log_admit (fmt, text)) {
+    now = !log_ring.async || text != buf;
+    log_push (LOG_WARNING, text, 0, now);
+    if (now)
+      log_print (LOG_WARNING, text, 0);
+  }
+  if (text != buf)
+    free (text);
 }
 
-/* messages are printed only if the verbose flag is set */
+/* messages are recorded always, printed only if the verbose flag is set */
 void
 message (char *fmt, ...)
 {
   va_list args;
+  char buf[LOG_TEXT], * text;
+  int now;
 
-  if(xcalib_state.verbose) {
   va_start (args, fmt);
-  vfprintf (stdout, fmt, args);
+  text = log_format (buf, fmt, args);
   va_end (args);
-  }
+  now = !log_ring.async || text != buf;
+  log_push (LOG_INFO, text, 0, now);
+  if (now && xcalib_state.verbose)
+    fputs (text, log_ring.to_stderr ? stderr : stdout);
+  if (text != buf)
+    free (text);
 }
 